@@ -12,14 +12,126 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 
 #include "http_prot.h"
 #include "http_net.h"
 #include "socket_layer.h"
+#include "uring.h"
+#include "util.h" // MIN
 #include "error.h"
 
 static int passive_socket = -1;
 static EventCallback cb;
+static struct http_body_stream body_stream; // start == NULL: bodies are received whole
+
+// Event loop modes (see http_use_event_loop() and http_use_io_uring())
+#define MAX_EVENTS 256          // epoll: events handled per round
+#define URING_ENTRIES 256       // io_uring: size of the submission queue
+#define INPUT_BUFFER_SIZE 2048  // Initial size of the request buffer (most requests fit)
+#define STREAM_BUFFER_SIZE 65536    // Room for the pieces of a streamed body
+
+// io_uring: what a request is about, in the low bits of its user_data (the rest being its connection)
+#define URING_OP_MASK   3
+#define URING_OP_RECV   1
+#define URING_OP_SEND   2
+#define URING_OP_FILE   3
+#define URING_ACCEPT    0   // No connection
+#define URING_WAKEUP    1   // No connection
+
+/*
+ * Requests received on a connection: what is received is appended;
+ * once the first request is handled, it is consumed and what follows it
+ * (the next requests, if the client pipelines them) moves to the front.
+ * The buffer is kept from one request to the next. A streamed body (see
+ * struct http_body_stream) is taken out of it as it arrives.
+ */
+enum body_mode {
+    BODY_UNDECIDED,     // Headers not received yet, or streaming not asked for yet
+    BODY_WHOLE,         // Received in the buffer
+    BODY_STREAMED       // Handed over to body_stream.write()
+};
+
+struct input {
+    char* data;         // Requests received so far, 0-terminated (NULL if no buffer yet)
+    size_t len;
+    size_t size;
+    struct http_parser parser;      // State of the parsing of the first request
+    enum body_mode body;            // How its body is received
+    void* stream;                   // State of the streaming of its body (BODY_STREAMED)
+};
+
+#define INPUT_HEADERS 2 // input_next(): the body of the first request may be streamed (see input_start())
+
+enum connection_state {
+    CONN_READING,       // Waiting for (the rest of) a request
+    CONN_DISPATCHED,    // Request handed over to the callback, or to body_stream.start() (owned by a worker)
+    CONN_WRITING,       // Sending the reply
+    CONN_CLOSED         // Freed at the end of the current round (io_uring: once the kernel is done with it)
+};
+
+struct connection {
+    int fd;
+    enum connection_state state;
+    struct input in;    // Requests received
+    char* out;          // Reply to send (NULL if none)
+    size_t out_len;
+    size_t out_sent;
+    int file_fd;        // File part of the reply is in (-1 if none, or io_uring: if being read)
+    uint64_t file_offset;
+    size_t file_size;
+    size_t file_pos;    // Where the content goes in out (io_uring: room is left for it there;
+                        // epoll: it is sent straight from the file, unless the client is slow)
+    size_t file_sent;   // epoll: how much of it is sent
+    int corked;         // epoll: whether the socket is corked until the content is sent
+    FileReadCallback file_done;     // To call once it is read (NULL if none)
+    void* file_done_arg;
+    unsigned inflight;  // io_uring: requests the kernel has on the connection
+    struct connection* prev;        // Doubly linked list of the open connections
+    struct connection* next;
+    struct connection* next_job;    // Requests to dispatch, or replies to send
+};
+
+static struct {
+    int epoll_fd;       // -1: not in epoll mode
+    struct uring ring;  // ring.fd == -1: not in io_uring mode
+    int accepting;      // io_uring: whether an accept request is pending
+    int wakeup_fd;      // eventfd the workers signal completed requests on
+    uint64_t wakeups;   // io_uring: where the eventfd is read to
+    struct connection* open;
+    struct connection* closed;
+} loop = { .epoll_fd = -1, .ring = { .fd = -1 }, .wakeup_fd = -1 };
+
+// Connection the callback is run for, in event loop modes: http_reply() queues its reply
+static _Thread_local struct connection* replying = NULL;
+
+// Worker pool, fed by a bounded queue of accepted connections
+#define ACCEPT_QUEUE_SIZE 64
+
+static struct {
+    pthread_t* threads;
+    int* connections;       // Connection handled by each worker (-1 if none)
+    size_t nb_workers;      // 0: connections are handled by http_receive() itself
+    int stopping;
+
+    pthread_mutex_t lock;   // Protects everything below, and connections[] and stopping above
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int queue[ACCEPT_QUEUE_SIZE];
+    size_t head;            // Next connection to handle
+    size_t nb_queued;
+    struct connection* jobs;        // Event loop mode: requests to dispatch (FIFO)
+    struct connection* jobs_tail;
+    struct connection* done;        // Event loop mode: dispatched requests
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER
+};
 
 #define MK_OUR_ERR(X) \
 static int our_ ## X = X
@@ -78,6 +190,142 @@ int http_serve_file(int connection, const char* filename)
     return ret;
 }
 
+/*******************************************************************
+ * Requests received: makes room in the buffer for what is to come
+ * (headers, or the body they announce)
+ */
+static int input_reserve(struct input* in, int content_len)
+{
+    size_t needed = 0;
+    if (in->body == BODY_STREAMED) needed = in->parser.header_len + STREAM_BUFFER_SIZE + 1;
+    else if (content_len > 0) needed = MAX_HEADER_SIZE + (size_t) content_len + 1; // Headers and body
+    else if (in->size == 0) needed = INPUT_BUFFER_SIZE;
+    else if (in->len + 1 < in->size) return ERR_NONE;
+    else needed = MAX_HEADER_SIZE + 1;
+
+    if (in->size < needed) {
+        char* const data = realloc(in->data, needed);
+        if (data == NULL) return ERR_OUT_OF_MEMORY;
+        memset(data + in->size, 0, needed - in->size);
+        in->data = data;
+        in->size = needed;
+    }
+    return in->len + 1 < in->size ? ERR_NONE : ERR_INVALID_ARGUMENT; // Headers too long
+}
+
+/*******************************************************************
+ * Requests received: hands what is received of the streamed body of the
+ * first one over to body_stream.write(), and takes it out of the buffer
+ */
+static int input_stream(struct input* in)
+{
+    char* const body = in->data + in->parser.header_len;
+    const size_t len = MIN(in->len - in->parser.header_len,
+                           (size_t) in->parser.content_len - in->parser.body_taken);
+    if (len == 0) return ERR_NONE;
+
+    const int err = body_stream.write(in->stream, body, len);
+    if (err != ERR_NONE) return err;
+
+    in->len -= len;
+    memmove(body, body + len, in->len - in->parser.header_len);
+    in->data[in->len] = '\0';
+    http_parser_take_body(&in->parser, len);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Requests received: parses the first one, once bytes_read more bytes
+ * are received. Returns 1 if it is complete (in message), INPUT_HEADERS
+ * if its headers are and its body may be streamed, 0 if more is needed
+ * (room being made for it), or a negative error code.
+ */
+static int input_next(struct input* in, size_t bytes_read, struct http_message* message)
+{
+    in->len += bytes_read;
+    int content_len = 0;
+    if (in->len > 0) {
+        in->data[in->len] = '\0';
+        int ret = http_parser_feed(&in->parser, in->data, in->len, message, &content_len);
+        if (ret < 0 || content_len < 0) return ERR_INVALID_ARGUMENT;
+
+        if (in->body == BODY_STREAMED && in->len > in->parser.header_len) {
+            const int err = input_stream(in);
+            if (err != ERR_NONE) return err;
+            ret = http_parser_feed(&in->parser, in->data, in->len, message, &content_len);
+            if (ret < 0) return ERR_INVALID_ARGUMENT;
+        } else if (in->body == BODY_UNDECIDED && in->parser.header_len > 0) {
+            // Only bodies not received along with the headers are worth streaming
+            if (ret == 0 && body_stream.start != NULL) return INPUT_HEADERS;
+            in->body = BODY_WHOLE;
+        }
+
+        if (in->body == BODY_WHOLE && content_len > MAX_REQUEST_SIZE) return ERR_INVALID_ARGUMENT;
+        if (ret > 0) return 1;
+    }
+    return input_reserve(in, content_len);
+}
+
+/*******************************************************************
+ * Requests received: asks whether the body of the first one, whose
+ * headers are received, is to be streamed
+ */
+static void input_start(struct input* in)
+{
+    struct http_message headers;
+    in->stream = http_parser_headers(&in->parser, in->data, &headers) == ERR_NONE
+                 ? body_stream.start(&headers, (size_t) in->parser.content_len) : NULL;
+    in->body = in->stream != NULL ? BODY_STREAMED : BODY_WHOLE;
+}
+
+/*******************************************************************
+ * Requests received: the first one (complete) is handled
+ */
+static void input_consume(struct input* in)
+{
+    const size_t request_len = MIN(http_parser_message_len(&in->parser), in->len);
+    in->len -= request_len;
+    memmove(in->data, in->data + request_len, in->len);
+    in->data[in->len] = '\0';
+    http_parser_init(&in->parser);
+    in->body = BODY_UNDECIDED;
+    in->stream = NULL;
+
+    // Only the initial buffer is kept once a big request (an upload) is done with
+    if (in->len == 0 && in->size > INPUT_BUFFER_SIZE) {
+        free(in->data);
+        in->data = NULL;
+        in->size = 0;
+    }
+}
+
+/*******************************************************************
+ * Requests received: handles the first one (complete, in message) with
+ * the callback or, if its body is streamed, with body_stream.finish()
+ */
+static void input_handle(struct input* in, struct http_message* message, int connection)
+{
+    if (in->body == BODY_STREAMED) {
+        void* const stream = in->stream;
+        in->stream = NULL;
+        body_stream.finish(stream, message, connection);
+    } else {
+        cb(message, connection);
+    }
+    input_consume(in);
+}
+
+/*******************************************************************
+ * Requests received: frees them (a streaming in progress is aborted)
+ */
+static void input_free(struct input* in)
+{
+    if (in->stream != NULL) body_stream.abort(in->stream);
+    in->stream = NULL;
+    free(in->data);
+    in->data = NULL;
+}
+
 /*******************************************************************
  * Handle connection
  */
@@ -88,70 +336,776 @@ static void *handle_connection(void *arg)
     int *sock_ptr = (int *)arg;
     int sock = *sock_ptr;
 
-    char *rcvbuf = calloc(1, MAX_HEADER_SIZE);
-    if (rcvbuf == NULL) return &our_ERR_OUT_OF_MEMORY;
-    memset(rcvbuf, 0, MAX_HEADER_SIZE);
+    struct input in = { .data = NULL };
+    http_parser_init(&in.parser);
+    struct http_message message;
+    int err = ERR_NONE;
+    ssize_t bytes_read = 0;
+
+    do {
+        // Requests already received (pipelined) are handled before reading more
+        int complete = input_next(&in, (size_t) bytes_read, &message);
+        while (complete > 0) {
+            if (complete == INPUT_HEADERS) input_start(&in);
+            else input_handle(&in, &message, sock);
+            complete = input_next(&in, 0, &message);
+        }
+        if (complete < 0) {
+            err = complete;
+            break;
+        }
+
+        bytes_read = tcp_read(sock, in.data + in.len, in.size - 1 - in.len);
+        if (bytes_read < 0) err = ERR_IO;
+    } while (bytes_read > 0); // 0: connection closed
+
+    input_free(&in);
+    switch (err) {
+    case ERR_NONE:
+        return &our_ERR_NONE;
+    case ERR_OUT_OF_MEMORY:
+        return &our_ERR_OUT_OF_MEMORY;
+    case ERR_IO:
+        return &our_ERR_IO;
+    default:
+        return &our_ERR_INVALID_ARGUMENT;
+    }
+}
+
+
+
+static void dispatch(struct connection* conn);
+
+/*******************************************************************
+ * Worker: handles the queued connections (or, in event loop mode,
+ * requests) one after the other
+ */
+static void *worker(void *arg)
+{
+    const size_t id = (size_t) arg;
+
+    // Signals are for the main thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (pool.nb_queued == 0 && pool.jobs == NULL && !pool.stopping) {
+            pthread_cond_wait(&pool.not_empty, &pool.lock);
+        }
+        if (pool.stopping) break;
 
+        if (pool.jobs != NULL) {
+            struct connection* conn = pool.jobs;
+            pool.jobs = conn->next_job;
+            if (pool.jobs == NULL) pool.jobs_tail = NULL;
+            pool.connections[id] = conn->fd;
+            pthread_mutex_unlock(&pool.lock);
+
+            dispatch(conn);
+
+            // Hand the reply over to the event loop
+            pthread_mutex_lock(&pool.lock);
+            pool.connections[id] = -1;
+            conn->next_job = pool.done;
+            pool.done = conn;
+            const uint64_t one = 1;
+            if (write(loop.wakeup_fd, &one, sizeof(one)) == -1) perror("write() in worker()");
+            continue;
+        }
+
+        int connection = pool.queue[pool.head];
+        pool.head = (pool.head + 1) % ACCEPT_QUEUE_SIZE;
+        --pool.nb_queued;
+        pool.connections[id] = connection;
+        pthread_cond_signal(&pool.not_full);
+        pthread_mutex_unlock(&pool.lock);
+
+        const int err = *(int *) handle_connection(&connection);
+        if (err != ERR_NONE) {
+            fprintf(stderr, "handle_connection() failed: %s\n", ERR_MSG(err));
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        pool.connections[id] = -1;
+        close(connection);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+/*******************************************************************
+ * Stops the workers, interrupting the connections they handle
+ */
+static void stop_workers(void)
+{
+    if (pool.nb_workers == 0) return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    for (size_t i = 0; i < pool.nb_workers; ++i) {
+        if (pool.connections[i] >= 0) shutdown(pool.connections[i], SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&pool.not_empty);
+    pthread_cond_broadcast(&pool.not_full);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (size_t i = 0; i < pool.nb_workers; ++i) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    // Connections accepted but never handled
+    for (; pool.nb_queued > 0; --pool.nb_queued) {
+        close(pool.queue[pool.head]);
+        pool.head = (pool.head + 1) % ACCEPT_QUEUE_SIZE;
+    }
+
+    // Requests still to dispatch or to reply to belong to loop.open
+    pool.jobs = pool.jobs_tail = pool.done = NULL;
+
+    free(pool.threads);
+    free(pool.connections);
+    pool.threads = NULL;
+    pool.connections = NULL;
+    pool.nb_workers = 0;
+}
+
+/*******************************************************************
+ * Start the worker pool
+ */
+int http_start_workers(size_t nb_workers)
+{
+    if (nb_workers == 0 || pool.nb_workers > 0) return ERR_INVALID_ARGUMENT;
+
+    pool.threads = calloc(nb_workers, sizeof(pthread_t));
+    pool.connections = calloc(nb_workers, sizeof(int));
+    if (pool.threads == NULL || pool.connections == NULL) {
+        free(pool.threads);
+        free(pool.connections);
+        pool.threads = NULL;
+        pool.connections = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    pool.stopping = 0;
+    for (size_t i = 0; i < nb_workers; ++i) {
+        pool.connections[i] = -1;
+        if (pthread_create(&pool.threads[i], NULL, worker, (void *) i) != 0) {
+            stop_workers();
+            return ERR_THREADING;
+        }
+        pool.nb_workers = i + 1;
+    }
+
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Event loops: closes a connection (freed at the end of the round,
+ * as later events of the round may still refer to it)
+ */
+static void close_connection(struct connection* conn)
+{
+    if (conn->state == CONN_CLOSED) return;
+
+    // io_uring: shutting the socket down completes its pending requests;
+    // the descriptor is closed once the kernel is done with them
+    if (loop.ring.fd >= 0) shutdown(conn->fd, SHUT_RDWR);
+    else close(conn->fd); // Also removes it from the epoll set
+    conn->state = CONN_CLOSED;
+
+    // Content never read
+    if (conn->file_fd >= 0 && conn->file_done != NULL) {
+        conn->file_done(conn->file_done_arg);
+        conn->file_done = NULL;
+    }
+    conn->file_fd = -1;
+
+    if (conn->prev != NULL) conn->prev->next = conn->next;
+    else loop.open = conn->next;
+    if (conn->next != NULL) conn->next->prev = conn->prev;
+
+    conn->prev = NULL;
+    conn->next = loop.closed;
+    loop.closed = conn;
+}
+
+static void submit_accept(void);
+
+/*******************************************************************
+ * Event loops: frees the closed connections (all of them, or those the
+ * kernel is done with)
+ */
+static void free_closed_connections(int all)
+{
+    int freed = 0;
+    struct connection** link = &loop.closed;
+    while (*link != NULL) {
+        struct connection* const conn = *link;
+        if (!all && conn->inflight > 0) {
+            link = &conn->next;
+            continue;
+        }
+
+        *link = conn->next;
+        if (loop.ring.fd >= 0) close(conn->fd);
+        input_free(&conn->in);
+        free(conn->out);
+        free(conn);
+        freed = 1;
+    }
+
+    // A descriptor is available again, if accepting failed for lack of them
+    if (!all && freed && loop.ring.fd >= 0 && !loop.accepting) submit_accept();
+}
+
+/*******************************************************************
+ * Event loops: opens a connection on an accepted socket
+ */
+static struct connection* open_connection(int fd)
+{
+    struct connection* conn = calloc(1, sizeof(struct connection));
+    if (conn == NULL) return NULL;
+
+    conn->fd = fd;
+    conn->state = CONN_READING;
+    conn->file_fd = -1;
+    http_parser_init(&conn->in.parser);
+
+    conn->next = loop.open;
+    if (loop.open != NULL) loop.open->prev = conn;
+    loop.open = conn;
+    return conn;
+}
+
+/*******************************************************************
+ * Event loops: runs the callback on the first request received, or
+ * asks whether its body is to be streamed (in a worker, or in the loop
+ * itself if there is none)
+ */
+static void dispatch(struct connection* conn)
+{
     struct http_message message;
-    size_t total_read = 0;
-    int content_len = 0;
-    int extend_message = 0;
-    int buffer_size = MAX_HEADER_SIZE;
+    const int complete = input_next(&conn->in, 0, &message);
+    if (complete == INPUT_HEADERS) {
+        input_start(&conn->in);
+    } else if (complete > 0) {
+        replying = conn;
+        input_handle(&conn->in, &message, conn->fd);
+        replying = NULL;
+    }
+}
+
+/*******************************************************************
+ * Event loops: takes the bytes just received into account.
+ * Returns 1 (or INPUT_HEADERS) if the first request is to be dispatched,
+ * 0 if more is needed (and room is made for it), and -1 if the
+ * connection is to be closed.
+ */
+static int take_input(struct connection* conn, size_t bytes_read)
+{
+    struct http_message message;
+    const int complete = input_next(&conn->in, bytes_read, &message);
+    return complete < 0 ? -1 : complete;
+}
+
+static void send_reply(struct connection* conn);
+
+/*******************************************************************
+ * Event loops: hands a complete request over to the workers
+ */
+static void submit(struct connection* conn)
+{
+    conn->state = CONN_DISPATCHED;
+
+    if (pool.nb_workers == 0) {
+        dispatch(conn);
+        send_reply(conn);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    conn->next_job = NULL;
+    if (pool.jobs_tail != NULL) pool.jobs_tail->next_job = conn;
+    else pool.jobs = conn;
+    pool.jobs_tail = conn;
+    pthread_cond_signal(&pool.not_empty);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*******************************************************************
+ * Event loops: takes the requests the workers are done with
+ */
+static struct connection* take_replies(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    struct connection* const conn = pool.done;
+    pool.done = NULL;
+    pthread_mutex_unlock(&pool.lock);
+    return conn;
+}
+
+/*******************************************************************
+ * Event loops: raises the limit on file descriptors (each connection
+ * takes one) as far as allowed
+ */
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void receive(struct connection* conn);
+
+/*******************************************************************
+ * Reads size bytes at offset in the file fd
+ */
+static int read_file(int fd, char* buffer, size_t size, uint64_t offset)
+{
+    for (size_t done_size = 0; done_size < size; ) {
+        const ssize_t bytes_read = pread(fd, buffer + done_size, size - done_size,
+                                         (off_t) (offset + done_size));
+        if (bytes_read <= 0) return ERR_IO;
+        done_size += (size_t) bytes_read;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Event loops: done with the file content of the reply
+ */
+static void release_file(struct connection* conn)
+{
+    // What is left of the reply goes out right away
+    if (conn->corked) {
+        (void) tcp_set_cork(conn->fd, 0);
+        conn->corked = 0;
+    }
+
+    conn->file_fd = -1;
+    if (conn->file_done != NULL) {
+        conn->file_done(conn->file_done_arg);
+        conn->file_done = NULL;
+    }
+}
+
+/*******************************************************************
+ * epoll: inserts what is left to send of the file content into the
+ * reply, so that the file is not kept waiting on a slow client
+ */
+static int inline_file(struct connection* conn)
+{
+    const size_t rest = conn->file_size - conn->file_sent;
+    char* const out = realloc(conn->out, conn->out_len + rest);
+    int err = out == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    if (err == ERR_NONE) {
+        conn->out = out;
+        memmove(out + conn->file_pos + rest, out + conn->file_pos, conn->out_len - conn->file_pos);
+        conn->out_len += rest;
+        err = read_file(conn->file_fd, out + conn->file_pos, rest, conn->file_offset + conn->file_sent);
+    }
+    release_file(conn);
+    return err;
+}
+
+/*******************************************************************
+ * epoll: sends as much of the reply as the socket takes (its file
+ * content with sendfile())
+ */
+static void flush(struct connection* conn)
+{
+    conn->state = CONN_WRITING;
+
+    // The headers go along with the content (best effort)
+    if (conn->file_fd >= 0 && !conn->corked) conn->corked = tcp_set_cork(conn->fd, 1) == ERR_NONE;
+    while (conn->out_sent < conn->out_len || conn->file_fd >= 0) {
+        ssize_t bytes_sent = 0;
+        if (conn->file_fd >= 0 && conn->out_sent == conn->file_pos) {
+            if (conn->file_sent == conn->file_size) {
+                release_file(conn);
+                continue;
+            }
+            bytes_sent = tcp_sendfile(conn->fd, conn->file_fd, conn->file_offset + conn->file_sent,
+                                      conn->file_size - conn->file_sent);
+            if (bytes_sent > 0) conn->file_sent += (size_t) bytes_sent;
+        } else {
+            const size_t end = conn->file_fd >= 0 ? conn->file_pos : conn->out_len;
+            bytes_sent = tcp_send(conn->fd, conn->out + conn->out_sent, end - conn->out_sent);
+            if (bytes_sent > 0) conn->out_sent += (size_t) bytes_sent;
+        }
+
+        if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // EPOLLOUT tells when to go on: the file is not kept waiting meanwhile
+            if (conn->file_fd >= 0 && inline_file(conn) != ERR_NONE) close_connection(conn);
+            return;
+        }
+        if (bytes_sent <= 0) {
+            close_connection(conn);
+            return;
+        }
+    }
+
+    free(conn->out);
+    conn->out = NULL;
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    conn->state = CONN_READING; // The caller goes on with receive()
+}
 
+/*******************************************************************
+ * epoll: handles the requests received, reading everything available
+ * (the socket is edge-triggered)
+ */
+static void receive(struct connection* conn)
+{
+    // Requests already received (pipelined, or arrived while replying) come first
+    int complete = take_input(conn, 0);
+    while (complete >= 0 && conn->state == CONN_READING) {
+        if (complete > 0) {
+            submit(conn); // Without workers, the reply is sent right away (if the socket takes it)
+            if (conn->state == CONN_READING) complete = take_input(conn, 0);
+            continue;
+        }
+
+        const ssize_t bytes_read = tcp_read(conn->fd, conn->in.data + conn->in.len,
+                                            conn->in.size - 1 - conn->in.len);
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        complete = bytes_read > 0 ? take_input(conn, (size_t) bytes_read) : -1;
+    }
+
+    if (complete < 0) close_connection(conn);
+}
+
+/*******************************************************************
+ * epoll: accepts all the pending connections
+ */
+static void accept_connections(void)
+{
     while (1) {
-        ssize_t bytes_read = tcp_read(sock, rcvbuf + total_read, (size_t)buffer_size - total_read);
+        const int fd = tcp_accept_nonblocking(passive_socket);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept() in http_receive()");
+            return;
+        }
 
-        // Connection closed
-        if (bytes_read == 0) break;
+        struct connection* const conn = open_connection(fd);
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
 
-        // Error
-        if (bytes_read < 0) {
-            free(rcvbuf);
-            return &our_ERR_IO;
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = conn
+        };
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("epoll_ctl() in http_receive()");
+            close_connection(conn);
         }
+    }
+}
 
-        total_read += (size_t)bytes_read;
-        int parse_result = http_parse_message(rcvbuf, total_read, &message, &content_len);
+/*******************************************************************
+ * epoll: one round
+ */
+static int event_loop_round(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+    const int nb_events = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, -1);
+    if (nb_events < 0) return errno == EINTR ? ERR_NONE : ERR_IO;
+
+    for (int i = 0; i < nb_events; ++i) {
+        struct connection* const conn = events[i].data.ptr;
+        const uint32_t flags = events[i].events;
 
-        // Error
-        if (parse_result < 0) {
-            free(rcvbuf);
-            return &parse_result;
+        if (conn == NULL) {
+            accept_connections();
+        } else if (conn == (void*) &loop) {
+            uint64_t count;
+            if (read(loop.wakeup_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                perror("read() in http_receive()");
+            }
+            for (struct connection* done = take_replies(), *next; done != NULL; done = next) {
+                next = done->next_job;
+                flush(done);
+                if (done->state == CONN_READING) receive(done);
+            }
+        } else if (conn->state == CONN_READING) {
+            if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) receive(conn);
+        } else if (conn->state == CONN_WRITING) {
+            if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) flush(conn);
+            if (conn->state == CONN_READING) receive(conn);
         }
+        // Dispatched requests: what the socket has is read once the reply is sent
+    }
+
+    free_closed_connections(0);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Switch to event loop mode
+ */
+int http_use_event_loop(void)
+{
+    if (passive_socket < 0 || loop.epoll_fd >= 0 || loop.ring.fd >= 0) return ERR_INVALID_ARGUMENT;
+
+    raise_fd_limit();
+
+    // A client leaving before its reply is sent must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event listening = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    struct epoll_event wakeup = { .events = EPOLLIN | EPOLLET, .data.ptr = &loop };
+    if (loop.epoll_fd == -1 || loop.wakeup_fd == -1
+        || tcp_set_nonblocking(passive_socket) != ERR_NONE
+        || epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, passive_socket, &listening) == -1
+        || epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.wakeup_fd, &wakeup) == -1) {
+        perror("http_use_event_loop()");
+        if (loop.epoll_fd != -1) close(loop.epoll_fd);
+        if (loop.wakeup_fd != -1) close(loop.wakeup_fd);
+        loop.epoll_fd = -1;
+        loop.wakeup_fd = -1;
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * io_uring: queues a request about a connection (closing it if the
+ * submission queue stays full)
+ */
+static struct io_uring_sqe* uring_request(struct connection* conn, uint8_t opcode,
+                                          int fd, unsigned op)
+{
+    struct io_uring_sqe* const sqe = uring_get_sqe(&loop.ring);
+    if (sqe == NULL) {
+        fprintf(stderr, "http_receive(): io_uring submission queue full\n");
+        if (conn != NULL) close_connection(conn);
+        return NULL;
+    }
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t) (uintptr_t) conn | op;
+    if (conn != NULL) ++conn->inflight;
+    return sqe;
+}
+
+static void submit_accept(void)
+{
+    struct io_uring_sqe* const sqe = uring_request(NULL, IORING_OP_ACCEPT, passive_socket, URING_ACCEPT);
+    if (sqe == NULL) return;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    loop.accepting = 1;
+}
+
+static void submit_wakeup(void)
+{
+    struct io_uring_sqe* const sqe = uring_request(NULL, IORING_OP_READ, loop.wakeup_fd, URING_WAKEUP);
+    if (sqe == NULL) return;
+    sqe->addr = (uint64_t) (uintptr_t) &loop.wakeups;
+    sqe->len = sizeof(loop.wakeups);
+}
+
+static void submit_recv(struct connection* conn)
+{
+    conn->state = CONN_READING;
+    struct io_uring_sqe* const sqe = uring_request(conn, IORING_OP_RECV, conn->fd, URING_OP_RECV);
+    if (sqe == NULL) return;
+    sqe->addr = (uint64_t) (uintptr_t) (conn->in.data + conn->in.len);
+    sqe->len = (uint32_t) (conn->in.size - 1 - conn->in.len);
+}
 
-        // Incomplete message
-        if (parse_result == 0) {
-            // Extend the buffer if needed
-            if (!extend_message && content_len > 0 && total_read < (size_t)(content_len + MAX_HEADER_SIZE)) {
-                extend_message = 1;
-                buffer_size += content_len;
-                char *new_rcvbuf = realloc(rcvbuf, (size_t)(buffer_size + content_len));
-                if (new_rcvbuf == NULL) {
-                    free(rcvbuf);
-                    return &our_ERR_OUT_OF_MEMORY;
-                }
-                rcvbuf = new_rcvbuf;
+/*******************************************************************
+ * io_uring: handles the requests received, bytes_read more bytes
+ * being received (or waits for more)
+ */
+static void uring_receive(struct connection* conn, size_t bytes_read)
+{
+    const int complete = take_input(conn, bytes_read);
+    if (complete < 0) close_connection(conn);
+    else if (complete > 0) submit(conn);
+    else submit_recv(conn);
+}
+
+static void submit_send(struct connection* conn)
+{
+    if (conn->out_sent == conn->out_len) {
+        // Reply sent: on with the next request (possibly received already)
+        free(conn->out);
+        conn->out = NULL;
+        conn->out_len = 0;
+        conn->out_sent = 0;
+        conn->state = CONN_READING;
+        uring_receive(conn, 0);
+        return;
+    }
+
+    struct io_uring_sqe* const sqe = uring_request(conn, IORING_OP_SEND, conn->fd, URING_OP_SEND);
+    if (sqe == NULL) return;
+    sqe->addr = (uint64_t) (uintptr_t) (conn->out + conn->out_sent);
+    sqe->len = (uint32_t) MIN(conn->out_len - conn->out_sent, (size_t) UINT32_MAX);
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/*******************************************************************
+ * io_uring: sends a reply, reading its content from the file first
+ */
+static void uring_send_reply(struct connection* conn)
+{
+    conn->state = CONN_WRITING;
+    if (conn->file_fd < 0) {
+        submit_send(conn);
+        return;
+    }
+
+    struct io_uring_sqe* const sqe = uring_request(conn, IORING_OP_READ, conn->file_fd, URING_OP_FILE);
+    if (sqe == NULL) return;
+    sqe->addr = (uint64_t) (uintptr_t) (conn->out + conn->file_pos);
+    sqe->len = (uint32_t) conn->file_size;
+    sqe->off = conn->file_offset;
+    conn->file_fd = -1; // Being read
+}
+
+/*******************************************************************
+ * Event loops: sends the reply of a dispatched request
+ */
+static void send_reply(struct connection* conn)
+{
+    if (loop.ring.fd >= 0) uring_send_reply(conn);
+    else flush(conn);
+}
+
+/*******************************************************************
+ * io_uring: handles one completion
+ */
+static void uring_complete(uint64_t user_data, int res)
+{
+    struct connection* const conn = (struct connection*) (uintptr_t) (user_data & ~(uint64_t) URING_OP_MASK);
+    const unsigned op = (unsigned) (user_data & URING_OP_MASK);
+
+    if (conn == NULL) {
+        if (op == URING_ACCEPT) {
+            loop.accepting = 0;
+            if (res >= 0) {
+                struct connection* const new_conn = open_connection(res);
+                if (new_conn != NULL) uring_receive(new_conn, 0);
+                else close(res);
             } else {
-                continue;
+                fprintf(stderr, "accept() in http_receive(): %s\n", strerror(-res));
+            }
+            // Out of descriptors: wait for a connection to be closed
+            if (res != -EMFILE && res != -ENFILE) submit_accept();
+        } else {
+            submit_wakeup();
+            for (struct connection* done = take_replies(), *next; done != NULL; done = next) {
+                next = done->next_job;
+                uring_send_reply(done);
             }
         }
+        return;
+    }
+
+    --conn->inflight;
+    if (op == URING_OP_FILE && conn->file_done != NULL) {
+        conn->file_done(conn->file_done_arg);
+        conn->file_done = NULL;
+    }
+    if (conn->state == CONN_CLOSED) return;
 
-        // Full message received
-        if (parse_result > 0) {
-            cb(&message, sock);
-            memset(rcvbuf, 0, MAX_HEADER_SIZE);
-            total_read = 0;
-            content_len = 0;
-            extend_message = 0;
-            buffer_size = MAX_HEADER_SIZE;
+    switch (op) {
+    case URING_OP_RECV:
+        if (res <= 0) close_connection(conn);
+        else uring_receive(conn, (size_t) res);
+        break;
+
+    case URING_OP_FILE:
+        if (res < 0 || (size_t) res != conn->file_size) close_connection(conn);
+        else submit_send(conn);
+        break;
+
+    case URING_OP_SEND:
+        if (res < 0) {
+            close_connection(conn);
+            break;
         }
+        conn->out_sent += (size_t) res;
+        submit_send(conn);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/*******************************************************************
+ * io_uring: one round (submitting all the requests queued during the
+ * previous one at once)
+ */
+static int uring_round(void)
+{
+    const int err = uring_submit(&loop.ring, 1);
+    if (err != ERR_NONE) return err;
+
+    struct io_uring_cqe* cqe = NULL;
+    while ((cqe = uring_peek_cqe(&loop.ring)) != NULL) {
+        const uint64_t user_data = cqe->user_data;
+        const int res = cqe->res;
+        uring_cqe_seen(&loop.ring);
+        uring_complete(user_data, res);
     }
 
-    free(rcvbuf);
-    return &our_ERR_NONE;
+    free_closed_connections(0);
+    return ERR_NONE;
 }
 
+/*******************************************************************
+ * Switch to io_uring mode
+ */
+int http_use_io_uring(void)
+{
+    if (passive_socket < 0 || loop.epoll_fd >= 0 || loop.ring.fd >= 0) return ERR_INVALID_ARGUMENT;
 
+    const uint8_t ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ };
+    int err = uring_init(&loop.ring, URING_ENTRIES, ops, sizeof(ops));
+    if (err != ERR_NONE) return err;
+
+    loop.wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (loop.wakeup_fd == -1) {
+        uring_close(&loop.ring);
+        return ERR_IO;
+    }
+
+    raise_fd_limit();
+    submit_accept();
+    submit_wakeup();
+
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Streams the body of the requests stream->start() accepts
+ */
+int http_stream_bodies(const struct http_body_stream* stream)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(stream->start);
+    M_REQUIRE_NON_NULL(stream->write);
+    M_REQUIRE_NON_NULL(stream->finish);
+    M_REQUIRE_NON_NULL(stream->abort);
+
+    body_stream = *stream;
+    return ERR_NONE;
+}
 
 /*******************************************************************
  * Init connection
@@ -168,10 +1122,24 @@ int http_init(uint16_t port, EventCallback callback)
  */
 void http_close(void)
 {
+    stop_workers();
+
+    if (loop.epoll_fd >= 0 || loop.ring.fd >= 0) {
+        while (loop.open != NULL) close_connection(loop.open);
+        if (loop.ring.fd >= 0) uring_close(&loop.ring); // Cancels the pending requests
+        free_closed_connections(1);
+        if (loop.epoll_fd >= 0) close(loop.epoll_fd);
+        close(loop.wakeup_fd);
+        loop.epoll_fd = -1;
+        loop.wakeup_fd = -1;
+    }
+
     if (passive_socket > 0) {
         if (close(passive_socket) == -1) perror("close() in http_close()");
         else passive_socket = -1;
     }
+
+    memset(&body_stream, 0, sizeof(body_stream));
 }
 
 /*******************************************************************
@@ -179,9 +1147,30 @@ void http_close(void)
  */
 int http_receive(void)
 {
+    if (loop.epoll_fd >= 0) return event_loop_round();
+    if (loop.ring.fd >= 0) return uring_round();
+
     int new_socket = tcp_accept(passive_socket);
     if (new_socket < 0) return ERR_IO;
 
+    if (pool.nb_workers > 0) {
+        // Hand the connection over to the workers, waiting for room in the queue
+        pthread_mutex_lock(&pool.lock);
+        while (pool.nb_queued == ACCEPT_QUEUE_SIZE && !pool.stopping) {
+            pthread_cond_wait(&pool.not_full, &pool.lock);
+        }
+        if (pool.stopping) {
+            pthread_mutex_unlock(&pool.lock);
+            close(new_socket);
+            return ERR_NONE;
+        }
+        pool.queue[(pool.head + pool.nb_queued) % ACCEPT_QUEUE_SIZE] = new_socket;
+        ++pool.nb_queued;
+        pthread_cond_signal(&pool.not_empty);
+        pthread_mutex_unlock(&pool.lock);
+        return ERR_NONE;
+    }
+
     int *sock_ptr = calloc(1, sizeof(int));
     if (sock_ptr == NULL) {
         close(new_socket);
@@ -215,16 +1204,35 @@ size_t compute_body_length(size_t body_len)
 }
 
 /*******************************************************************
- * Create and send HTTP reply
+ * Event loops: appends a reply to those to send on the connection
+ * (takes buffer over)
  */
-int http_reply(int connection, const char* status, const char* headers, const char *body, size_t body_len)
+static int queue_reply(struct connection* conn, char* buffer, size_t len)
 {
-    M_REQUIRE_NON_NULL(headers);
-    M_REQUIRE_NON_NULL(status);
-    if(body_len != 0 && body == NULL) {
-        return ERR_INVALID_ARGUMENT;
+    if (conn->out == NULL) {
+        conn->out = buffer;
+        conn->out_len = len;
+        return ERR_NONE;
     }
 
+    char* const out = realloc(conn->out, conn->out_len + len);
+    if (out == NULL) {
+        free(buffer);
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(out + conn->out_len, buffer, len);
+    conn->out = out;
+    conn->out_len += len;
+    free(buffer);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Writes the header of a reply into header (MAX_HEADER_SIZE + 1 bytes)
+ */
+static int format_header(const char* status, const char* headers, size_t body_len,
+                         char* header, size_t* header_len)
+{
     // Compute the length of the body length
     const char* content_len = "Content-Length: ";
     char body_len_str [20];
@@ -234,26 +1242,234 @@ int http_reply(int connection, const char* status, const char* headers, const ch
     size_t header_size = strlen(HTTP_PROTOCOL_ID) + strlen(status) + strlen(HTTP_LINE_DELIM) 
                         + strlen(headers) + strlen(content_len)+ strlen(body_len_str) + strlen(HTTP_HDR_END_DELIM);
     if(header_size > MAX_HEADER_SIZE) return ERR_INVALID_ARGUMENT;
-    
-    // Compute the size of the buffer
-    size_t buffer_size = header_size + body_len + 1;
-    char* buffer = calloc(buffer_size, 1);
-    if(buffer == NULL) return ERR_OUT_OF_MEMORY;
 
     // Creating header
-    snprintf(buffer, MAX_HEADER_SIZE, "%s%s%s%s%s%s%s", HTTP_PROTOCOL_ID, status, 
+    snprintf(header, MAX_HEADER_SIZE + 1, "%s%s%s%s%s%s%s", HTTP_PROTOCOL_ID, status, 
             HTTP_LINE_DELIM, headers, content_len, body_len_str, HTTP_HDR_END_DELIM);
 
-   // Adding body
-    if(body_len > 0) memcpy(buffer + header_size, body, body_len);
+    *header_len = header_size;
+    return ERR_NONE;
+}
 
-    // Send the reply
-    if(tcp_send(connection, buffer, buffer_size-1) < 0) {
-        free(buffer);
-        return ERR_IO;
-    }
+/*******************************************************************
+ * Event loops: allocates a reply, with room for the body after the
+ * header (if with_body is set)
+ */
+static int build_reply(const char* status, const char* headers, size_t body_len, int with_body,
+                       char** reply, size_t* header_len)
+{
+    char header[MAX_HEADER_SIZE + 1];
+    size_t header_size = 0;
+    const int err = format_header(status, headers, body_len, header, &header_size);
+    if (err != ERR_NONE) return err;
 
-    free(buffer);
+    // The body is written over: no need to clear it
+    char* buffer = malloc(header_size + (with_body ? body_len : 0) + 1);
+    if(buffer == NULL) return ERR_OUT_OF_MEMORY;
+    memcpy(buffer, header, header_size + 1);
+
+    *reply = buffer;
+    *header_len = header_size;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Blocking mode: sends the iovcnt buffers of iov (which is updated as
+ * they are sent), however many calls the socket takes. This waits on
+ * the client: never call it while an image read is pending (for a file
+ * reply, before its FileReadCallback is called)
+ */
+static int send_all(int connection, struct iovec* iov, size_t iovcnt)
+{
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            ++iov;
+            --iovcnt;
+            continue;
+        }
+
+        const ssize_t bytes_sent = tcp_writev(connection, iov, iovcnt);
+        if (bytes_sent < 0 && errno == EINTR) continue;
+        if (bytes_sent <= 0) return ERR_IO;
+
+        // Skip what is sent
+        size_t sent = (size_t) bytes_sent;
+        while (iovcnt > 0 && sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
     return ERR_NONE;
 }
 
+/*******************************************************************
+ * Create and send HTTP reply, the body of which is in several parts
+ */
+int http_reply_iov(int connection, const char* status, const char* headers,
+                   const struct iovec* body, size_t nb_body)
+{
+    M_REQUIRE_NON_NULL(headers);
+    M_REQUIRE_NON_NULL(status);
+    if ((nb_body > 0 && body == NULL) || nb_body > MAX_BODY_IOV) return ERR_INVALID_ARGUMENT;
+
+    size_t body_len = 0;
+    for (size_t i = 0; i < nb_body; ++i) {
+        if (body[i].iov_len > 0 && body[i].iov_base == NULL) return ERR_INVALID_ARGUMENT;
+        body_len += body[i].iov_len;
+    }
+
+    // Event loop modes: the loop sends the reply (see send_reply()), so it is copied
+    if (replying != NULL && replying->fd == connection) {
+        char* buffer = NULL;
+        size_t header_size = 0;
+        const int err = build_reply(status, headers, body_len, 1, &buffer, &header_size);
+        if (err != ERR_NONE) return err;
+
+        size_t pos = header_size;
+        for (size_t i = 0; i < nb_body; ++i) {
+            if (body[i].iov_len > 0) memcpy(buffer + pos, body[i].iov_base, body[i].iov_len);
+            pos += body[i].iov_len;
+        }
+        return queue_reply(replying, buffer, pos);
+    }
+
+    // Blocking mode: the header and the body, as they are
+    char header[MAX_HEADER_SIZE + 1];
+    struct iovec iov[MAX_BODY_IOV + 1];
+    const int err = format_header(status, headers, body_len, header, &iov[0].iov_len);
+    if (err != ERR_NONE) return err;
+    iov[0].iov_base = header;
+    for (size_t i = 0; i < nb_body; ++i) iov[i + 1] = body[i];
+
+    return send_all(connection, iov, nb_body + 1);
+}
+
+/*******************************************************************
+ * Create and send HTTP reply
+ */
+int http_reply(int connection, const char* status, const char* headers, const char *body, size_t body_len)
+{
+    if(body_len != 0 && body == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const struct iovec body_iov = { .iov_base = (char*) (uintptr_t) body, .iov_len = body_len };
+    return http_reply_iov(connection, status, headers, &body_iov, 1);
+}
+
+/*******************************************************************
+ * Blocking mode: sends a reply whose body is in a file. The headers,
+ * then the content (with sendfile()), go out as long as the socket
+ * takes them right away; the rest of the content is then read and done
+ * called before anything is sent blocking, so that the file is never
+ * kept waiting on a slow (or not reading) client
+ */
+static int send_file_blocking(int connection, char* header, size_t header_size,
+                              int fd, uint64_t offset, size_t size,
+                              FileReadCallback done, void* arg)
+{
+    struct iovec iov[2] = { { .iov_base = header, .iov_len = header_size }, { .iov_base = NULL, .iov_len = 0 } };
+    size_t sent = 0;
+    int err = tcp_set_nonblocking(connection);
+    while (err == ERR_NONE && iov[0].iov_len > 0) {
+        const ssize_t bytes_sent = tcp_writev(connection, iov, 1);
+        if (bytes_sent > 0) {
+            iov[0].iov_base = (char*) iov[0].iov_base + bytes_sent;
+            iov[0].iov_len -= (size_t) bytes_sent;
+        } else if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (bytes_sent >= 0 || errno != EINTR) {
+            err = ERR_IO;
+        }
+    }
+    while (err == ERR_NONE && iov[0].iov_len == 0 && sent < size) {
+        const ssize_t bytes_sent = tcp_sendfile(connection, fd, offset + sent, size - sent);
+        if (bytes_sent > 0) sent += (size_t) bytes_sent;
+        else if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        else err = ERR_IO;
+    }
+    if (tcp_set_blocking(connection) != ERR_NONE) err = ERR_IO;
+
+    char* rest = NULL;
+    if (err == ERR_NONE && sent < size) {
+        rest = malloc(size - sent);
+        if (rest == NULL) err = ERR_OUT_OF_MEMORY;
+        else err = read_file(fd, rest, size - sent, offset + sent);
+    }
+    if (done != NULL) done(arg);
+
+    // What the socket did not take: unsent headers, then the rest of the content
+    if (err == ERR_NONE) {
+        iov[1].iov_base = rest;
+        iov[1].iov_len = size - sent;
+        err = send_all(connection, iov, 2);
+    }
+    free(rest);
+    return err;
+}
+
+/*******************************************************************
+ * Create and send HTTP reply, the body of which is in a file
+ */
+int http_reply_file(int connection, const char* status, const char* headers,
+                    int fd, uint64_t offset, size_t size,
+                    FileReadCallback done, void* arg)
+{
+    int err = ERR_NONE;
+    if (headers == NULL || status == NULL || fd < 0) err = ERR_INVALID_ARGUMENT;
+
+    // Event loop modes: the loop sends the content (io_uring: reads it right
+    // into the reply, see uring_send_reply(); epoll: see flush())
+    struct connection* const conn = replying;
+    if (err == ERR_NONE && conn != NULL && conn->fd == connection && conn->file_fd < 0
+        && conn->file_done == NULL && size > 0 && size <= UINT32_MAX) {
+        const size_t reply_pos = conn->out_len;
+        char* buffer = NULL;
+        size_t header_size = 0;
+        const int with_body = loop.ring.fd >= 0;
+        err = build_reply(status, headers, size, with_body, &buffer, &header_size);
+        if (err == ERR_NONE) err = queue_reply(conn, buffer, header_size + (with_body ? size : 0));
+        if (err == ERR_NONE) {
+            conn->file_fd = fd;
+            conn->file_offset = offset;
+            conn->file_size = size;
+            conn->file_pos = reply_pos + header_size;
+            conn->file_sent = 0;
+            conn->file_done = done;
+            conn->file_done_arg = arg;
+            return ERR_NONE;
+        }
+    }
+
+    // Blocking mode: the headers, then the content straight from the file
+    // (corked, so that the headers go along with it). Nothing is sent
+    // blocking before done is called (see send_file_blocking())
+    if (err == ERR_NONE && conn == NULL) {
+        char header[MAX_HEADER_SIZE + 1];
+        size_t header_size = 0;
+        err = format_header(status, headers, size, header, &header_size);
+        if (err == ERR_NONE) {
+            (void) tcp_set_cork(connection, 1); // Best effort
+            err = send_file_blocking(connection, header, header_size, fd, offset, size, done, arg);
+            (void) tcp_set_cork(connection, 0);
+            return err;
+        }
+    }
+
+    char* body = NULL;
+    if (err == ERR_NONE) {
+        body = malloc(size > 0 ? size : 1);
+        if (body == NULL) err = ERR_OUT_OF_MEMORY;
+    }
+    if (err == ERR_NONE) err = read_file(fd, body, size, offset);
+    if (done != NULL) done(arg);
+
+    if (err == ERR_NONE) err = http_reply(connection, status, headers, body, size);
+    free(body);
+    return err;
+}
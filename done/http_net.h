@@ -7,20 +7,145 @@
 
 #pragma once
 
+#include <stddef.h> // for size_t
 #include <stdint.h>
+#include <sys/uio.h> // for struct iovec
 #include "http_prot.h" // for structs
 
 #define MAX_REQUEST_SIZE 8388608 // 2^23 -> to handle images up to 8MB
 #define MAX_HEADER_SIZE    16384 // 2^14 -> to handle http headers
+#define MAX_BODY_IOV          16 // max. number of body parts of a reply (see http_reply_iov())
 
 typedef int (*EventCallback)(struct http_message* message, int status_code);
 
+typedef void (*FileReadCallback)(void* arg);
+
 int http_init(uint16_t port, EventCallback cb);
 
+/**
+ * @brief Switches http_receive() to an event loop: all the connections
+ *        are non-blocking and watched with (edge-triggered) epoll, so
+ *        that idle clients cost no thread. Each call to http_receive()
+ *        then handles one round of events: accepting connections,
+ *        reading requests, and sending the replies. Complete requests
+ *        are handed over to the workers (see http_start_workers()),
+ *        whose callback replies are queued for the loop to send.
+ *        To be called after http_init().
+ *
+ * @return Some error code. 0 if no error.
+ */
+int http_use_event_loop(void);
+
+/**
+ * @brief Switches http_receive() to an io_uring loop: accepting
+ *        connections, receiving requests and sending replies are
+ *        requests queued on a ring shared with the kernel, and all the
+ *        requests of a round are submitted with one system call. The
+ *        file content of replies (see http_reply_file()) is read through
+ *        the ring too. Complete requests are handed over to the workers,
+ *        as in event loop mode. To be called after http_init().
+ *
+ * @return Some error code (ERR_IO if the kernel does not provide
+ *         io_uring, or not all of what is needed): http_receive() then
+ *         keeps working as before. 0 if no error.
+ */
+int http_use_io_uring(void);
+
+/**
+ * @brief Starts nb_workers threads handling the connections accepted by
+ *        http_receive() (which then only queues them), so that several
+ *        clients are served at once. Without workers, http_receive()
+ *        handles each connection itself. In event loop mode, the workers
+ *        run the callback on the requests instead (without workers, the
+ *        loop does). http_close() stops them.
+ *
+ * @param nb_workers The number of threads (> 0)
+ * @return Some error code. 0 if no error.
+ */
+int http_start_workers(size_t nb_workers);
+
+/**
+ * @brief Handlers of requests whose body is streamed: instead of being
+ *        received whole before the callback runs, the body is handed over
+ *        piece by piece as it arrives, so that a small buffer is enough
+ *        whatever its size (MAX_REQUEST_SIZE does not apply either).
+ */
+struct http_body_stream {
+    // Once the headers of a request with a body are received (message has
+    // no body): returns the state of the streaming, or NULL to receive it whole
+    void* (*start)(const struct http_message* message, size_t content_len);
+    // The next piece of the body (an error closes the connection)
+    int (*write)(void* state, const char* data, size_t len);
+    // Once the body is received: handles the request in place of the
+    // callback (message has no body), which ends the streaming
+    int (*finish)(void* state, struct http_message* message, int connection);
+    // If the connection is closed before finish()
+    void (*abort)(void* state);
+};
+
+/**
+ * @brief Streams the body of the requests stream->start() accepts (see
+ *        struct http_body_stream), until http_close(). To be called
+ *        before http_receive().
+ *
+ * start() and finish() run where the callback does (in a worker, if
+ * there are some), and write() where the requests are received: in loop
+ * modes, the loop itself. write() and abort() must thus never wait for
+ * what the callbacks hold.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int http_stream_bodies(const struct http_body_stream* stream);
+
+/**
+ * @brief Serves the clients: in blocking mode, accepts a connection and
+ *        handles its requests until it is closed (or hands it over to
+ *        the workers); in loop modes, handles one round of events.
+ *        The requests of a connection are handled one after the other,
+ *        in order, including those a client sends without waiting for
+ *        the previous replies (pipelining).
+ *
+ * @return Some error code. 0 if no error.
+ */
 int http_receive(void);
 
 int http_serve_file(int connection, const char* filename);
 
 int http_reply(int connection, const char* status, const char* headers, const char* body, size_t body_len);
 
+/**
+ * @brief Same as http_reply(), with the body being the concatenation of
+ *        the nb_body buffers of body.
+ *
+ * In blocking mode, the header and the body parts are sent as they are
+ * (with writev()), without being copied, and until everything is sent.
+ * In event loop modes, the reply is copied (once) for the loop to send.
+ *
+ * @param body The parts of the body, in order (may be NULL if nb_body is 0)
+ * @param nb_body The number of parts (at most MAX_BODY_IOV)
+ * @return Some error code. 0 if no error.
+ */
+int http_reply_iov(int connection, const char* status, const char* headers,
+                   const struct iovec* body, size_t nb_body);
+
+/**
+ * @brief Same as http_reply(), with the body being the size bytes at
+ *        offset in the file fd.
+ *
+ * The content is sent straight from the file with sendfile(), without
+ * being copied to user memory: right away in blocking mode, and by the
+ * loop in event loop mode (the reply is only queued by the callback).
+ * As long as the client is slow to take it, what is left of it is read
+ * into memory instead. In io_uring mode, the loop reads the content
+ * through the ring into the reply. Either way, done (if not NULL) is
+ * called with arg exactly once, as soon as the content is sent or read
+ * (or is not going to be): until then, the content must stay where it
+ * is. done may be called by the thread running http_receive().
+ *
+ * @return Some error code. 0 if no error.
+ */
+int http_reply_file(int connection, const char* status, const char* headers,
+                    int fd, uint64_t offset, size_t size,
+                    FileReadCallback done, void* arg);
+
 void http_close(void);
@@ -4,6 +4,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <immintrin.h> // SSE2, AVX2 (see SCAN_BLOCK)
+#endif
 
 /**
  * @brief Checks whether the `message` URI starts with the provided `target_uri`.
@@ -46,6 +50,117 @@ int http_match_verb(const struct http_string* method, const char* verb)
     return 1;
 }
 
+// Value of hexadecimal digit c, or -1
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Percent-decodes the len bytes of src into query->decoded (at *used,
+ *        updated) as a null-terminated string, and points out to it.
+ */
+static int decode_component(const char* src, size_t len, struct http_query* query, size_t* used,
+                            struct http_string* out)
+{
+    char* const start = query->decoded + *used;
+    const char* const end = query->decoded + MAX_QUERY_SIZE;
+    char* dst = start;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (dst >= end) return ERR_RUNTIME;
+
+        if (src[i] == '%') {
+            const int high = i + 2 < len ? hex_value(src[i + 1]) : -1;
+            const int low = i + 2 < len ? hex_value(src[i + 2]) : -1;
+            if (high < 0 || low < 0 || (high | low) == 0) return ERR_INVALID_ARGUMENT;
+            *dst++ = (char) (high << 4 | low);
+            i += 2;
+        } else {
+            *dst++ = src[i] == '+' ? ' ' : src[i];
+        }
+    }
+    if (dst >= end) return ERR_RUNTIME;
+    *dst = '\0';
+
+    out->val = start;
+    out->len = (size_t) (dst - start);
+    *used += out->len + 1;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Parses the query string of url into query.
+ */
+int http_parse_query(const struct http_string* url, struct http_query* query)
+{
+    M_REQUIRE_NON_NULL(url);
+    M_REQUIRE_NON_NULL(query);
+    query->num_params = 0;
+    if (url->val == NULL) return ERR_NONE;
+
+    const char* const url_end = url->val + url->len;
+    const char* param = memchr(url->val, '?', url->len);
+    if (param == NULL) return ERR_NONE; // No parameters in the URL
+
+    size_t used = 0;
+    for (++param; param < url_end; ++param) {
+        const char* param_end = memchr(param, '&', (size_t) (url_end - param));
+        if (param_end == NULL) param_end = url_end;
+
+        if (param_end > param) {
+            if (query->num_params >= MAX_QUERY_PARAMS) return ERR_RUNTIME;  // Too many parameters
+
+            // A parameter without '=' has an empty value
+            const char* name_end = memchr(param, '=', (size_t) (param_end - param));
+            const char* const value = name_end == NULL ? param_end : name_end + 1;
+            if (name_end == NULL) name_end = param_end;
+
+            struct http_param* const out = &query->params[query->num_params];
+            int err = decode_component(param, (size_t) (name_end - param), query, &used, &out->name);
+            if (err == ERR_NONE) {
+                err = decode_component(value, (size_t) (param_end - value), query, &used, &out->value);
+            }
+            if (err != ERR_NONE) {
+                query->num_params = 0;
+                return err;
+            }
+            query->num_params++;
+        }
+        param = param_end;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * @brief Writes the value of parameter `name` of query to buffer out.
+ *
+ * Return the length of the value.
+ * 0 or negative return values indicate an error.
+ */
+int http_query_get(const struct http_query* query, const char* name, char* out, size_t out_len)
+{
+    M_REQUIRE_NON_NULL(query);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(out);
+
+    const size_t name_len = strlen(name);
+    for (size_t i = 0; i < query->num_params; ++i) {
+        const struct http_param* const param = &query->params[i];
+        if (param->name.len == name_len && memcmp(param->name.val, name, name_len) == 0) {
+            if (param->value.len >= out_len) return ERR_RUNTIME;  // Value is too long for the output buffer
+            memcpy(out, param->value.val, param->value.len + 1);  // With its null terminator
+            return (int) param->value.len;
+        }
+    }
+
+    return 0;  // Parameter not found
+}
+
 /**
  * @brief Writes the value of parameter `name` from URL in message to buffer out.
  *
@@ -58,91 +173,206 @@ int http_get_var(const struct http_string* url, const char* name, char* out, siz
     M_REQUIRE_NON_NULL(name);
     M_REQUIRE_NON_NULL(out);
 
-    // Create the parameter search string
-    char param_name[256];  // Assuming the parameter name won't exceed 255 characters
-    snprintf(param_name, sizeof(param_name), "%s=", name);
+    struct http_query query;
+    const int err = http_parse_query(url, &query);
+    if (err != ERR_NONE) return err;
 
-    // Find the start of the parameters in the URL
-    const char* query_start = strchr(url->val, '?');
-    if (query_start == NULL) return 0;  // No parameters found in the URL
-    query_start++; // Move past the '?'
+    return http_query_get(&query, name, out, out_len);
+}
 
-    // Find the parameter in the URL
-    const char* param_start = strstr(query_start, param_name);
-    while (param_start != NULL) {
-        // Ensure the parameter is either at the start or follows '&'
-        if (param_start == query_start || *(param_start - 1) == '&') {
-            break;
-        }
-        param_start = strstr(param_start + 1, param_name);
-    }
-    if (param_start == NULL) return 0;  // Parameter not found
-    
-    param_start += strlen(param_name); // Move past the parameter name and '='
+/*
+ * Scanning of the headers: the bytes which delimit their tokens are found
+ * SCAN_BLOCK bytes at a time, each block being loaded once and turned into
+ * a bit mask (bit i set if byte i is a delimiter). The parser then takes
+ * the delimiters in order. Up to three delimiters are searched at once:
+ * ' ' and '\r' on the request line, ':' and '\r' on the header lines, and
+ * '\r' alone for the end of the headers.
+ */
+#if defined(__AVX2__) && !defined(HTTP_SCAN_SCALAR)
+#define SCAN_SIMD 1
+#define SCAN_BLOCK 32
+static inline uint32_t delimiters_mask(const char *block, const char delims[3])
+{
+    const void *const bytes_ptr = block; // Unaligned
+    const __m256i bytes = _mm256_loadu_si256(bytes_ptr);
+    const __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(delims[0])),
+                                                         _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(delims[1]))),
+                                         _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(delims[2])));
+    return (uint32_t) _mm256_movemask_epi8(hits);
+}
+#elif defined(__SSE2__) && !defined(HTTP_SCAN_SCALAR)
+#define SCAN_SIMD 1
+#define SCAN_BLOCK 16
+static inline uint32_t delimiters_mask(const char *block, const char delims[3])
+{
+    const void *const bytes_ptr = block; // Unaligned
+    const __m128i bytes = _mm_loadu_si128(bytes_ptr);
+    const __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(delims[0])),
+                                                   _mm_cmpeq_epi8(bytes, _mm_set1_epi8(delims[1]))),
+                                      _mm_cmpeq_epi8(bytes, _mm_set1_epi8(delims[2])));
+    return (uint32_t) _mm_movemask_epi8(hits);
+}
+#else
+#define SCAN_SIMD 0
+#define SCAN_BLOCK 16
+#endif
 
-    // Find the end of the parameter value
-    const char* param_end = strchr(param_start, '&');
-    if (param_end == NULL) param_end = url->val + url->len;  // End of the URL
-    
-    // Calculate the length of the parameter value
-    size_t value_len = (size_t)(param_end - param_start);
-    if (value_len >= out_len) return ERR_RUNTIME;  // Value is too long for the output buffer
+// Bytes of word equal to c (0x80 set in each of them), eight bytes at a time without SIMD
+static inline uint64_t equal_bytes(uint64_t word, char c)
+{
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+    const uint64_t diff = word ^ (0x0101010101010101ULL * (uint8_t) c);
+    return ~(((diff & low7) + low7) | diff | low7);
+}
 
-    // Copy the value into the output buffer and null-terminate it
-    strncpy(out, param_start, value_len);
-    out[value_len] = '\0';
+// Delimiters of a (partial) block, without SIMD
+static uint32_t delimiters_mask_scalar(const char *block, size_t len, const char delims[3])
+{
+    uint32_t mask = 0;
+    size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, block + i, sizeof(word)); // Unaligned
+        uint64_t hits = equal_bytes(word, delims[0]) | equal_bytes(word, delims[1]) | equal_bytes(word, delims[2]);
+        for (; hits != 0; hits &= hits - 1) mask |= 1U << (i + (size_t) __builtin_ctzll(hits) / 8);
+    }
+#endif
+    for (; i < len; ++i) {
+        if (block[i] == delims[0] || block[i] == delims[1] || block[i] == delims[2]) mask |= 1U << i;
+    }
+    return mask;
+}
+
+struct delimiter_scanner {
+    const char *start;  // Start of what is scanned
+    size_t len;         // Length of what is scanned
+    size_t block;       // Offset of the current block (an offset, so that it never points outside)
+    uint32_t mask;      // Delimiters of the current block not taken yet
+    char delims[3];     // Delimiters searched
+};
 
-    return (int)value_len;
+static inline uint32_t block_mask(const struct delimiter_scanner *scanner)
+{
+    const size_t len = scanner->len - scanner->block;
+#if SCAN_SIMD
+    if (len >= SCAN_BLOCK) return delimiters_mask(scanner->start + scanner->block, scanner->delims);
+#endif
+    return delimiters_mask_scalar(scanner->start + scanner->block, len < SCAN_BLOCK ? len : SCAN_BLOCK,
+                                  scanner->delims);
 }
 
-/**
- * @brief Accepts a potentially partial TCP stream and parses an HTTP message.
- *
- * Assumes that all characters of stream that are not filled by reading are set to 0.
- *
- * Places the complete HTTP message in out.
- * Also writes the content of header "Content Length" to content_len upon parsing the header in the stream.
- * content_len can be used by the caller to allocate memory to receive the whole HTTP message.
- *
- * Returns:
- *  a negative int if there was an error
- *  0 if the message has not been received completely (partial treatment)
- *  1 if the message was fully received and parsed
- */
-int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len)
+static void scanner_init(struct delimiter_scanner *scanner, const char *start, const char *end,
+                         char first, char second)
 {
-    M_REQUIRE_NON_NULL(stream);
-    M_REQUIRE_NON_NULL(out);
-    M_REQUIRE_NON_NULL(content_len);
+    scanner->start = start;
+    scanner->len = (size_t) (end - start);
+    scanner->block = 0;
+    scanner->delims[0] = first;
+    scanner->delims[1] = second;
+    scanner->delims[2] = second;
+    scanner->mask = scanner->len > 0 ? block_mask(scanner) : 0;
+}
 
-    // Ensure we have received the complete headers
-    const char *headers_end = strstr(stream, HTTP_HDR_END_DELIM);
-    if (headers_end == NULL) return 0; // Incomplete headers
+// Searches other delimiters, from after taken (the last delimiter returned) on
+static void scanner_change(struct delimiter_scanner *scanner, const char *taken, char first, char second)
+{
+    scanner->delims[0] = first;
+    scanner->delims[1] = second;
+    scanner->delims[2] = second;
+    const size_t next = (size_t) (taken - scanner->start) - scanner->block + 1;
+    scanner->mask = next < SCAN_BLOCK ? block_mask(scanner) & (~0U << next) : 0;
+}
 
-    // Initialize the output structure
-    memset(out, 0, sizeof(struct http_message));
+// Returns the next delimiter, or NULL if there is none left
+static inline const char *next_delimiter(struct delimiter_scanner *scanner)
+{
+    while (scanner->mask == 0) {
+        if (scanner->len - scanner->block <= SCAN_BLOCK) return NULL;
+        scanner->block += SCAN_BLOCK;
+        scanner->mask = block_mask(scanner);
+    }
 
-    // Parse the first line
-    const char *line_start = stream;
-    const char *line_end = strstr(line_start, HTTP_LINE_DELIM);
-    if (line_end == NULL) return ERR_RUNTIME; // Invalid HTTP request line
+    const int bit = __builtin_ctz(scanner->mask);
+    scanner->mask &= scanner->mask - 1; // Taken
+    return scanner->start + scanner->block + (size_t) bit;
+}
 
-    // Extract the method
-    line_start = get_next_token(line_start, " ", &out->method);
-    if (line_start == NULL) return ERR_RUNTIME; // Invalid method token
+// Returns the start of the first HTTP_HDR_END_DELIM between start and end, or NULL
+static const char *find_headers_end(const char *start, const char *end)
+{
+    const size_t delim_len = strlen(HTTP_HDR_END_DELIM);
+    struct delimiter_scanner scanner;
+    scanner_init(&scanner, start, end, '\r', '\r');
 
-    // Extract the URI
-    line_start = get_next_token(line_start, " ", &out->uri);
-    if (line_start == NULL) return ERR_RUNTIME; // Invalid URI token
+    const char *d = NULL;
+    while ((d = next_delimiter(&scanner)) != NULL) {
+        if ((size_t) (end - d) >= delim_len && memcmp(d, HTTP_HDR_END_DELIM, delim_len) == 0) return d;
+    }
+    return NULL;
+}
 
-    // Skip the HTTP version (third token)
-    line_start = get_next_token(line_start, HTTP_LINE_DELIM, NULL);
-    if (line_start == NULL) return ERR_RUNTIME; // Invalid HTTP version token
+/**
+ * @brief Parses the request line and the headers of an HTTP message, the
+ *        header_len first bytes of stream (end delimiter included), in a
+ *        single pass, and finds the length of the body.
+ *
+ * Returns the position of the body, or NULL if the headers are invalid.
+ */
+static const char* parse_headers_block(const char *stream, size_t header_len,
+                                       struct http_message *out, int *content_len)
+{
+    // Initialize the output structure
+    memset(out, 0, sizeof(struct http_message));
 
-    // Parse all the headers
-    const char *headers_start = line_start;
-    const char *body_start = http_parse_headers(headers_start, out);
-    if (body_start == NULL) return ERR_RUNTIME; // Invalid headers
+    const char *const end = stream + header_len;
+    struct delimiter_scanner scanner;
+    scanner_init(&scanner, stream, end, ' ', '\r');
+
+    const char *line = stream;      // Start of the current line
+    size_t request_tokens = 0;      // Tokens of the request line found so far (method, URI, version)
+    const char *key_end = NULL;     // End of the key of the current header (NULL until found)
+    const char *body_start = NULL;
+
+    for (const char *d = next_delimiter(&scanner); d != NULL && body_start == NULL; d = next_delimiter(&scanner)) {
+        if (*d == ' ') {
+            // Method and URI end with the first two spaces of the request line
+            if (request_tokens == 0) {
+                out->method.val = line;
+                out->method.len = (size_t) (d - line);
+                out->uri.val = d + 1;
+                request_tokens = 1;
+            } else if (request_tokens == 1) {
+                out->uri.len = (size_t) (d - out->uri.val);
+                request_tokens = 2;
+            }
+        } else if (*d == ':') {
+            // The key of a header ends with the first ": " of its line
+            if (request_tokens == 3 && key_end == NULL && d + 1 < end && d[1] == ' ') {
+                if (out->num_headers >= MAX_HEADERS) return NULL;  // Too many headers
+                out->headers[out->num_headers].key.val = line;
+                out->headers[out->num_headers].key.len = (size_t) (d - line);
+                key_end = d;
+            }
+        } else if (d + 1 < end && d[1] == '\n') {
+            if (request_tokens < 2) return NULL; // Invalid HTTP request line
+            if (request_tokens == 2) {
+                request_tokens = 3; // The HTTP version is skipped
+                scanner_change(&scanner, d, ':', '\r');
+            } else if (d == line) {
+                body_start = d + 2; // Empty line: end of the headers
+            } else {
+                if (key_end == NULL) return NULL; // Invalid header key
+                out->headers[out->num_headers].value.val = key_end + 2;
+                out->headers[out->num_headers].value.len = (size_t) (d - key_end - 2);
+                out->num_headers++;
+                key_end = NULL;
+            }
+            line = d + 2;
+        }
+        // Else: a '\r' alone is part of the line
+    }
+    if (body_start == NULL) return NULL; // Invalid headers
 
     // Get the "Content-Length" value
     *content_len = 0; // Default to no content
@@ -153,19 +383,131 @@ int http_parse_message(const char *stream, size_t bytes_received, struct http_me
         }
     }
 
-    // If there is a body, ensure we have received all of it
-    size_t header_len = (size_t)(headers_end + strlen(HTTP_HDR_END_DELIM) - stream);
-    if (*content_len > 0) {
-        if (bytes_received < header_len + (size_t)*content_len) {
-            return 0; // Incomplete body
+    return body_start;
+}
+
+/**
+ * @brief Prepares parser for a new message.
+ */
+void http_parser_init(struct http_parser *parser)
+{
+    if (parser == NULL) return;
+    memset(parser, 0, sizeof(struct http_parser));
+}
+
+/**
+ * @brief Parses (more of) an HTTP message received in several parts.
+ *
+ * Returns:
+ *  a negative int if there was an error
+ *  0 if the message has not been received completely (partial treatment)
+ *  1 if the message was fully received and parsed
+ */
+int http_parser_feed(struct http_parser *parser, const char *stream, size_t bytes_received,
+                     struct http_message *out, int *content_len)
+{
+    M_REQUIRE_NON_NULL(parser);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(content_len);
+
+    const size_t delim_len = strlen(HTTP_HDR_END_DELIM);
+    const char *body_start = NULL; // Where the body is, if the headers are parsed by this call
+    if (parser->header_len == 0) {
+        // Search the new bytes only (and the end of the previous ones, the
+        // delimiter possibly being split between two parts)
+        const size_t from = parser->scanned >= delim_len ? parser->scanned - (delim_len - 1) : 0;
+        if (bytes_received < from + delim_len) {
+            parser->scanned = bytes_received;
+            return 0; // Incomplete headers
+        }
+        const char *headers_end = find_headers_end(stream + from, stream + bytes_received);
+        parser->scanned = bytes_received;
+        if (headers_end == NULL) return 0; // Incomplete headers
+
+        // Parse the headers for the length of the body
+        parser->header_len = (size_t) (headers_end - stream) + delim_len;
+        body_start = parse_headers_block(stream, parser->header_len, out, &parser->content_len);
+        if (body_start == NULL) {
+            parser->header_len = 0;
+            return ERR_RUNTIME;
         }
+    }
+    *content_len = parser->content_len;
+
+    // From there on, the body is tracked by its length only
+    if (parser->content_len > 0
+        && bytes_received + parser->body_taken < parser->header_len + (size_t) parser->content_len) {
+        return 0; // Incomplete body
+    }
+
+    // Complete: the message is parsed where the stream now is (unless just done)
+    if (body_start == NULL) {
+        body_start = parse_headers_block(stream, parser->header_len, out, content_len);
+        if (body_start == NULL) return ERR_RUNTIME;
+    }
+    if (*content_len > 0) {
         out->body.val = body_start;
-        out->body.len = (size_t)*content_len;
+        out->body.len = (size_t)*content_len - parser->body_taken;
     }
 
     return 1; // Fully received and parsed
 }
 
+/**
+ * @brief Length of the message once complete.
+ */
+size_t http_parser_message_len(const struct http_parser *parser)
+{
+    if (parser == NULL) return 0;
+    return parser->header_len + (parser->content_len > 0 ? (size_t) parser->content_len : 0)
+           - parser->body_taken;
+}
+
+/**
+ * @brief Parses the headers again, once received.
+ */
+int http_parser_headers(const struct http_parser *parser, const char *stream, struct http_message *out)
+{
+    M_REQUIRE_NON_NULL(parser);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
+    if (parser->header_len == 0) return ERR_INVALID_ARGUMENT;
+
+    int content_len = 0;
+    return parse_headers_block(stream, parser->header_len, out, &content_len) != NULL ? ERR_NONE : ERR_RUNTIME;
+}
+
+/**
+ * @brief Counts bytes of the body taken out of the stream.
+ */
+void http_parser_take_body(struct http_parser *parser, size_t len)
+{
+    if (parser == NULL) return;
+    parser->body_taken += len;
+}
+
+/**
+ * @brief Accepts a potentially partial TCP stream and parses an HTTP message.
+ *
+ * Assumes that all characters of stream that are not filled by reading are set to 0.
+ *
+ * Places the complete HTTP message in out.
+ * Also writes the content of header "Content Length" to content_len upon parsing the header in the stream.
+ * content_len can be used by the caller to allocate memory to receive the whole HTTP message.
+ *
+ * Returns:
+ *  a negative int if there was an error
+ *  0 if the message has not been received completely (partial treatment)
+ *  1 if the message was fully received and parsed
+ */
+int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len)
+{
+    struct http_parser parser;
+    http_parser_init(&parser);
+    return http_parser_feed(&parser, stream, bytes_received, out, content_len);
+}
+
 /**
  * @brief Parses a line of an HTTP message.
  *
@@ -14,6 +14,8 @@
 #endif
 
 #define MAX_HEADERS 40
+#define MAX_QUERY_PARAMS 16
+#define MAX_QUERY_SIZE 1024 // Of the decoded names and values of the query string
 
 #define HTTP_HDR_KV_DELIM  ": "
 #define HTTP_LINE_DELIM    "\r\n"
@@ -42,6 +44,31 @@ struct http_message {
     struct http_string body;
 };
 
+struct http_param {
+    struct http_string name;
+    struct http_string value;
+};
+
+/**
+ * @brief Parameters of the query string of a URI, percent-decoded.
+ */
+struct http_query {
+    struct http_param params[MAX_QUERY_PARAMS]; // Their names and values are in decoded
+    size_t num_params;
+    char decoded[MAX_QUERY_SIZE];               // Each name and value is null-terminated
+};
+
+/**
+ * @brief State of the parsing of a message received in several parts
+ *        (see http_parser_feed()).
+ */
+struct http_parser {
+    size_t scanned;     // Bytes of the stream already searched for the end of the headers
+    size_t header_len;  // Length of the headers, end delimiter included (0 until it is received)
+    int content_len;    // Length of the body, as announced by the headers (once received)
+    size_t body_taken;  // Bytes of the body taken out of the stream (see http_parser_take_body())
+};
+
 /**
  * @brief Checks whether the `message` URI starts with the provided `target_uri`.
  *
@@ -66,8 +93,77 @@ int http_match_uri(const struct http_message *message, const char *target_uri);
  */
 int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len);
 
+/**
+ * @brief Prepares parser for a new message.
+ */
+void http_parser_init(struct http_parser *parser);
+
+/**
+ * @brief Same as http_parse_message(), for a stream received in several
+ *        parts: to be called each time more of it is received, with the
+ *        same parser (which remembers what is already known).
+ *
+ * Only the bytes received since the previous call are searched for the
+ * end of the headers, which are then parsed once; from there on, the
+ * body is only tracked by its length. The stream may move between calls
+ * (e.g. when its buffer grows), as long as its content stays the same.
+ * Once the message is complete, out is filled on each call.
+ *
+ * Returns:
+ *  a negative int if there was an error
+ *  0 if the message has not been received completely (partial treatment)
+ *  1 if the message was fully received and parsed
+ */
+int http_parser_feed(struct http_parser *parser, const char *stream, size_t bytes_received,
+                     struct http_message *out, int *content_len);
+
+/**
+ * @brief Length of the message (headers and body) once http_parser_feed()
+ *        found it complete: what follows it in the stream is the next one.
+ */
+size_t http_parser_message_len(const struct http_parser *parser);
+
+/**
+ * @brief Once the headers are received, parses them again into out (with
+ *        an empty body), e.g. to act on them before the body is complete.
+ *
+ * Returns ERR_NONE, ERR_INVALID_ARGUMENT if the headers are not received
+ * yet, or ERR_RUNTIME if they are invalid.
+ */
+int http_parser_headers(const struct http_parser *parser, const char *stream, struct http_message *out);
+
+/**
+ * @brief Tells the parser that the len bytes right after the headers
+ *        were taken out of the stream (e.g. the start of a body handled
+ *        as it arrives): they count as received, but are no longer part
+ *        of the message, whose body is then what remains of it.
+ */
+void http_parser_take_body(struct http_parser *parser, size_t len);
+
+/**
+ * @brief Parses the query string of url (after '?') into query, once for
+ *        all its parameters: their names and values are percent-decoded
+ *        ('+' being a space), and empty parameters (e.g. "?&a=b") skipped.
+ *
+ * Returns ERR_NONE (also without query string), ERR_INVALID_ARGUMENT if an
+ * escape is invalid (or decodes to '\0'), ERR_RUNTIME if there are more
+ * than MAX_QUERY_PARAMS parameters or MAX_QUERY_SIZE decoded bytes.
+ */
+int http_parse_query(const struct http_string* url, struct http_query* query);
+
+/**
+ * @brief Writes the (decoded) value of parameter `name` of query to buffer
+ *        out (null-terminated); the first one if it is given several times.
+ *
+ * Return the length of the value.
+ * 0 or negative return values indicate an error.
+ */
+int http_query_get(const struct http_query* query, const char* name, char* out, size_t out_len);
+
 /**
  * @brief Writes the value of parameter `name` from URL in message to buffer out.
+ *        Parses the whole query string: use http_parse_query() and
+ *        http_query_get() for several parameters.
  *
  * Return the length of the value.
  * 0 or negative return values indicate an error.
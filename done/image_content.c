@@ -1,16 +1,230 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
+#include "image_content.h"
 #include "error.h"
+#include "util.h" // for _unused
+
+#include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
 #include <vips/vips.h>
 
-int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
+/*******************************************************************
+ * Reads the original content of the image at index into a new buffer.
+ */
+static int read_original(const struct imgfs_file* imgfs_file, size_t index, char** buffer)
+{
+    const struct img_metadata* const metadata = &imgfs_file->metadata[index];
+
+    *buffer = calloc(1, metadata->size[ORIG_RES]);
+    if (*buffer == NULL) return ERR_OUT_OF_MEMORY;
+
+    const int err = imgfs_read_at(imgfs_file, *buffer, metadata->size[ORIG_RES], metadata->offset[ORIG_RES]);
+    if (err != ERR_NONE) {
+        free(*buffer);
+        *buffer = NULL;
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Loads an image resized to fit width x height: the decoder is given
+ * the target size, so that a JPEG gets shrunk while decoded (DCT
+ * scaling) instead of being fully decoded first.
+ */
+static int load_resized(const char* image_buffer, size_t image_size, uint16_t width, uint16_t height,
+                        VipsImage** resized)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    const int err = vips_thumbnail_buffer((void*) image_buffer, image_size, resized, width,
+                                          "height", height, NULL);
+#pragma GCC diagnostic pop
+    return err != 0 ? ERR_IO : ERR_NONE;
+}
+
+/**
+ * @brief Resizes an image to fit width x height.
+ */
+int resize_image(const char* image_buffer, size_t image_size, uint16_t width, uint16_t height,
+                 void** resized_buffer, size_t* resized_size)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(resized_buffer);
+    M_REQUIRE_NON_NULL(resized_size);
+
+    VipsImage* resized = NULL;
+    int err = load_resized(image_buffer, image_size, width, height, &resized);
+    if (err != ERR_NONE) return err;
+
+    // Save the resized image to a buffer
+    err = vips_jpegsave_buffer(resized, resized_buffer, resized_size, NULL) != 0 ? ERR_IO : ERR_NONE;
+    g_object_unref(VIPS_OBJECT(resized));
+
+    return err;
+}
+
+/*******************************************************************
+ * Makes the wanted resolutions of an image out of a single decode: the
+ * largest one is decoded from the original (see load_resized()), the
+ * others are resized from it. The resized contents (NULL for the
+ * resolutions not wanted) are to be freed by the caller.
+ */
+static int resize_variants(const char* image_buffer, size_t image_size, const uint16_t* resized_res,
+                           const int wanted[NB_RES], void* resized[NB_RES], size_t resized_size[NB_RES])
+{
+    int largest = -1;
+    for (int res = 0; res < NB_RES; ++res) {
+        resized[res] = NULL;
+        resized_size[res] = 0;
+        if (res == ORIG_RES || !wanted[res]) continue;
+        if (largest < 0 || (uint32_t) resized_res[2 * res] * resized_res[2 * res + 1]
+            > (uint32_t) resized_res[2 * largest] * resized_res[2 * largest + 1]) {
+            largest = res;
+        }
+    }
+    if (largest < 0) return ERR_NONE;
+
+    VipsImage *loaded = NULL, *decoded = NULL;
+    int err = load_resized(image_buffer, image_size, resized_res[2 * largest], resized_res[2 * largest + 1],
+                           &loaded);
+    if (err != ERR_NONE) return err;
+
+    // Decoded once into memory: otherwise each resolution would run the pipeline, decode included, again
+    decoded = vips_image_copy_memory(loaded);
+    g_object_unref(VIPS_OBJECT(loaded));
+    if (decoded == NULL) return ERR_IO;
+
+    for (int res = 0; res < NB_RES && err == ERR_NONE; ++res) {
+        if (res == ORIG_RES || !wanted[res]) continue;
+
+        VipsImage* image = decoded;
+        if (res != largest && vips_thumbnail_image(decoded, &image, resized_res[2 * res],
+                                                   "height", resized_res[2 * res + 1], NULL) != 0) {
+            err = ERR_IO;
+            break;
+        }
+        if (vips_jpegsave_buffer(image, &resized[res], &resized_size[res], NULL) != 0) err = ERR_IO;
+        if (image != decoded) g_object_unref(VIPS_OBJECT(image));
+    }
+    g_object_unref(VIPS_OBJECT(decoded));
+
+    if (err != ERR_NONE) {
+        for (int res = 0; res < NB_RES; ++res) {
+            free(resized[res]);
+            resized[res] = NULL;
+        }
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Appends the resized contents of the image at index (NULL for the
+ * resolutions it keeps) to the file at once, and updates its metadata
+ * on the disk.
+ */
+static int store_variants(struct imgfs_file* imgfs_file, size_t index,
+                          void* const resized[NB_RES], const size_t resized_size[NB_RES])
+{
+    size_t total = 0;
+    int nb_variants = 0;
+    const void* content = NULL;
+    for (int res = 0; res < NB_RES; ++res) {
+        if (res == ORIG_RES || resized[res] == NULL) continue;
+        total += resized_size[res];
+        content = resized[res];
+        ++nb_variants;
+    }
+    if (nb_variants == 0) return ERR_NONE;
+
+    // Several resolutions: one after the other, in a single append
+    char* joined = NULL;
+    if (nb_variants > 1) {
+        joined = malloc(total);
+        if (joined == NULL) return ERR_OUT_OF_MEMORY;
+        size_t position = 0;
+        for (int res = 0; res < NB_RES; ++res) {
+            if (res == ORIG_RES || resized[res] == NULL) continue;
+            memcpy(joined + position, resized[res], resized_size[res]);
+            position += resized_size[res];
+        }
+        content = joined;
+    }
+
+    // Append the resized images to the file
+    uint64_t offset = 0;
+    const int err = imgfs_append(imgfs_file, content, total, &offset);
+    free(joined);
+    if (err != ERR_NONE) return err;
+
+    // Update the metadata
+    for (int res = 0; res < NB_RES; ++res) {
+        if (res == ORIG_RES || resized[res] == NULL) continue;
+        imgfs_file->metadata[index].offset[res] = offset;
+        imgfs_file->metadata[index].size[res] = (uint32_t)resized_size[res];
+        imgfs_index_ref_blob(imgfs_file, (uint32_t)index, res);
+        offset += resized_size[res];
+    }
+
+    // Write the updated metadata
+    return imgfs_write_metadata(imgfs_file, (uint32_t)index);
+}
+
+/*******************************************************************
+ * Creates the wanted resolutions of the image at index.
+ */
+static int resize_missing(struct imgfs_file* imgfs_file, size_t index, const int wanted[NB_RES])
 {
-    void *buffer = NULL;
-    VipsImage *original = NULL, *resized = NULL;
-    void* resized_buffer = NULL;
-    size_t resized_size = 0;
+    char* buffer = NULL;
+    void* resized[NB_RES] = { NULL };
+    size_t resized_size[NB_RES] = { 0 };
+
+    // --------------------------------------------------------------------------------------------
+    //                                       RESIZE IMAGE
+    // --------------------------------------------------------------------------------------------
+
+    // Read the original image into a buffer
+    int result = read_original(imgfs_file, index, &buffer);
+    if (result != ERR_NONE) {
+        goto cleanup;
+    }
+
+    result = resize_variants(buffer, imgfs_file->metadata[index].size[ORIG_RES],
+                             imgfs_file->header.resized_res, wanted, resized, resized_size);
+    if (result != ERR_NONE) {
+        goto cleanup;
+    }
+
+    // --------------------------------------------------------------------------------------------
+    //                                       WRITE RESIZED IMAGES
+    // --------------------------------------------------------------------------------------------
+
+    result = store_variants(imgfs_file, index, resized, resized_size);
+
+    // --------------------------------------------------------------------------------------------
+    //                                       CLEANUP
+    // --------------------------------------------------------------------------------------------
+
+    /** EXPLANATION OF THE USE OF GOTO STATEMENTS FOR CLEANUP :
+    *   We have decided to use goto statements because it allows us to avoid repeating the same
+    *   cleanup code multiple times in case of errors.
+    *   This way, we can simply jump to the cleanup label, free the memory that has been allocated and
+    *   return the error code.
+    */
 
-    int result = ERR_NONE;  // Default to no error
+cleanup:
+    if (buffer) free(buffer);
+    for (int res = 0; res < NB_RES; ++res) {
+        if (resized[res]) free(resized[res]);
+    }
+
+    return result;
+}
 
+int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
+{
     M_REQUIRE_NON_NULL(imgfs_file);
     M_REQUIRE_NON_NULL(imgfs_file->file);
     M_REQUIRE_NON_NULL(imgfs_file->metadata);
@@ -31,102 +245,373 @@ int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
 
     // Check if the asked resolution is already available and it has not already been resized
     if (resolution == ORIG_RES || imgfs_file->metadata[index].size[resolution] != 0) {
-        return ERR_NONE;  // No need to free anything yet
+        return ERR_NONE;
     }
 
-    // --------------------------------------------------------------------------------------------
-    //                                       RESIZE IMAGE
-    // --------------------------------------------------------------------------------------------
+    int wanted[NB_RES] = { 0 };
+    wanted[resolution] = 1;
+    return resize_missing(imgfs_file, index, wanted);
+}
 
-    // Allocate memory for the original image
-    buffer = calloc(1, imgfs_file->metadata[index].size[ORIG_RES]);
-    if (!buffer) {
-        result = ERR_OUT_OF_MEMORY;
-        goto cleanup;
+int lazily_resize_all(struct imgfs_file* imgfs_file, size_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    if (index >= imgfs_file->header.max_files || imgfs_file->metadata[index].is_valid == 0) {
+        return ERR_INVALID_IMGID;
     }
 
-    // Move to the beginning of the original image
-    if (fseek(imgfs_file->file, (long)imgfs_file->metadata[index].offset[ORIG_RES], SEEK_SET) != 0) {
-        result = ERR_IO;
-        goto cleanup;
+    int wanted[NB_RES] = { 0 };
+    wanted[THUMB_RES] = imgfs_file->metadata[index].size[THUMB_RES] == 0;
+    wanted[SMALL_RES] = imgfs_file->metadata[index].size[SMALL_RES] == 0;
+    return resize_missing(imgfs_file, index, wanted);
+}
+
+// ================================================================================================
+//                                       RESIZE SERVICE
+// ================================================================================================
+
+// Creation of one resolution (or, see all_variants, of all the missing ones) of one image,
+// shared by all who ask for it while it is in flight
+struct resize_job {
+    size_t index;
+    int resolution;
+    int all;                        // Whether it creates all the missing resolutions (see all_variants)
+    char img_id[MAX_IMG_ID + 1];
+    int err;
+    int done;
+    size_t nb_waiters;              // Requesters waiting for the job (the last one, else the worker, frees it)
+    struct resize_job* next_queued; // Queue of the jobs no worker took yet (FIFO)
+    struct resize_job* next;        // Jobs in flight (queued or being run)
+};
+
+static struct {
+    struct imgfs_file* imgfs_file;
+    void (*lock)(int exclusive);
+    void (*unlock)(void);
+    int all_variants;           // Whether a job creates all the missing resolutions of its image
+
+    pthread_t* threads;
+    size_t nb_workers;
+    int stopping;
+
+    pthread_mutex_t mutex;      // Protects everything below, and stopping above
+    pthread_cond_t not_empty;
+    pthread_cond_t done;        // Some job is done
+    struct resize_job* queue;
+    struct resize_job* queue_tail;
+    struct resize_job* in_flight;
+} resizer = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+/*******************************************************************
+ * Whether the entry index still is the image job was made for (with
+ * the lock taken). sha is that of the image seen when the job started.
+ */
+static int same_image(const struct imgfs_file* imgfs_file, const struct resize_job* job,
+                      const unsigned char* sha)
+{
+    if (job->index >= imgfs_file->header.max_files) return 0;
+
+    const struct img_metadata* const metadata = &imgfs_file->metadata[job->index];
+    return metadata->is_valid != EMPTY
+           && strncmp(metadata->img_id, job->img_id, MAX_IMG_ID) == 0
+           && (sha == NULL || memcmp(metadata->SHA, sha, SHA256_DIGEST_LENGTH) == 0);
+}
+
+/*******************************************************************
+ * Runs a job: the original is read with the lock shared, resized
+ * without the lock, and only appended with the lock taken for writing.
+ */
+static int run_job(const struct resize_job* job)
+{
+    struct imgfs_file* const imgfs_file = resizer.imgfs_file;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    char* buffer = NULL;
+    size_t size = 0;
+    int wanted[NB_RES] = { 0 };
+    int nb_wanted = 0;
+
+    resizer.lock(0);
+    int err = same_image(imgfs_file, job, NULL) ? ERR_NONE : ERR_IMAGE_NOT_FOUND;
+    if (err == ERR_NONE) {
+        const struct img_metadata* const metadata = &imgfs_file->metadata[job->index];
+        for (int res = 0; res < NB_RES; ++res) {
+            wanted[res] = res != ORIG_RES && metadata->size[res] == 0
+                          && (job->all || res == job->resolution);
+            nb_wanted += wanted[res];
+        }
+        if (nb_wanted == 0) {
+            resizer.unlock(); // Created meanwhile
+            return ERR_NONE;
+        }
+        memcpy(sha, metadata->SHA, SHA256_DIGEST_LENGTH);
+        size = metadata->size[ORIG_RES];
+        err = read_original(imgfs_file, job->index, &buffer);
     }
+    resizer.unlock();
+    if (err != ERR_NONE) return err;
 
-    // Read the original image into the buffer
-    if (fread(buffer, imgfs_file->metadata[index].size[ORIG_RES], 1, imgfs_file->file) != 1) {
-        result = ERR_IO;
-        goto cleanup;
+    void* resized[NB_RES] = { NULL };
+    size_t resized_size[NB_RES] = { 0 };
+    // resized_res never changes (see struct imgfs_header)
+    err = resize_variants(buffer, size, imgfs_file->header.resized_res, wanted, resized, resized_size);
+    free(buffer);
+    if (err != ERR_NONE) return err;
+
+    resizer.lock(1);
+    // The image may have been deleted (or replaced) meanwhile
+    if (!same_image(imgfs_file, job, sha)) {
+        err = ERR_IMAGE_NOT_FOUND;
+    } else {
+        // Only the resolutions still missing are stored
+        for (int res = 0; res < NB_RES; ++res) {
+            if (resized[res] != NULL && imgfs_file->metadata[job->index].size[res] != 0) {
+                free(resized[res]);
+                resized[res] = NULL;
+            }
+        }
+        err = store_variants(imgfs_file, job->index, resized, resized_size);
     }
+    resizer.unlock();
 
-    // Load the original image into a VipsImage
-    if (vips_jpegload_buffer(buffer, imgfs_file->metadata[index].size[ORIG_RES], &original, NULL) != 0) {
-        result = ERR_IO;
-        goto cleanup;
+    for (int res = 0; res < NB_RES; ++res) free(resized[res]);
+    return err;
+}
+
+/*******************************************************************
+ * Resize worker: runs the queued jobs one after the other, until the
+ * service stops and the queue is empty
+ */
+static void* resize_worker(void* arg _unused)
+{
+    // Signals are for the main thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&resizer.mutex);
+    while (1) {
+        while (resizer.queue == NULL && !resizer.stopping) {
+            pthread_cond_wait(&resizer.not_empty, &resizer.mutex);
+        }
+        if (resizer.queue == NULL) break;
+
+        struct resize_job* const job = resizer.queue;
+        resizer.queue = job->next_queued;
+        if (resizer.queue == NULL) resizer.queue_tail = NULL;
+        // Nobody waits for the queued resizes when stopping: skipped
+        const int skipped = resizer.stopping && job->nb_waiters == 0;
+        pthread_mutex_unlock(&resizer.mutex);
+
+        const int err = skipped ? ERR_NONE : run_job(job);
+
+        // Later requests start a new job
+        pthread_mutex_lock(&resizer.mutex);
+        struct resize_job** link = &resizer.in_flight;
+        while (*link != job) link = &(*link)->next;
+        *link = job->next;
+        job->err = err;
+        job->done = 1;
+        if (job->nb_waiters == 0) free(job);
+        else pthread_cond_broadcast(&resizer.done);
     }
+    pthread_mutex_unlock(&resizer.mutex);
 
-    // Resize the image
-    if (vips_thumbnail_image(original, &resized, imgfs_file->header.resized_res[2 * resolution], "height", imgfs_file->header.resized_res[2 * resolution + 1], NULL) != 0) {
-        result = ERR_IO;
-        goto cleanup;
+    return NULL;
+}
+
+int resize_service_start(struct imgfs_file* imgfs_file, size_t nb_workers, int all_variants,
+                         void (*lock)(int exclusive), void (*unlock)(void))
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(lock);
+    M_REQUIRE_NON_NULL(unlock);
+    if (nb_workers == 0 || resizer.nb_workers > 0) return ERR_INVALID_ARGUMENT;
+
+    resizer.threads = calloc(nb_workers, sizeof(pthread_t));
+    if (resizer.threads == NULL) return ERR_OUT_OF_MEMORY;
+
+    resizer.imgfs_file = imgfs_file;
+    resizer.lock = lock;
+    resizer.unlock = unlock;
+    resizer.all_variants = all_variants;
+    resizer.stopping = 0;
+    for (size_t i = 0; i < nb_workers; ++i) {
+        if (pthread_create(&resizer.threads[i], NULL, resize_worker, NULL) != 0) {
+            resize_service_stop();
+            return ERR_THREADING;
+        }
+        resizer.nb_workers = i + 1;
     }
 
-    // Save the resized image to a buffer
-    if (vips_jpegsave_buffer(resized, &resized_buffer, &resized_size, NULL) != 0) {
-        result = ERR_IO;
-        goto cleanup;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Finds the job in flight that makes resolution (or all of them, if
+ * all) for the image img_id at index, else queues a new one. Called
+ * with the mutex of the service taken.
+ */
+static struct resize_job* find_or_queue_job(const char* img_id, size_t index, int resolution, int all)
+{
+    all = all || resizer.all_variants;
+
+    struct resize_job* job = resizer.in_flight;
+    while (job != NULL && (job->index != index || strncmp(job->img_id, img_id, MAX_IMG_ID) != 0
+                           || (all ? !job->all : !job->all && job->resolution != resolution))) {
+        job = job->next;
     }
+    if (job != NULL) return job;
 
-    // --------------------------------------------------------------------------------------------
-    //                                       WRITE RESIZED IMAGE
-    // --------------------------------------------------------------------------------------------
+    job = calloc(1, sizeof(*job));
+    if (job == NULL) return NULL;
+    job->index = index;
+    job->resolution = resolution;
+    job->all = all;
+    strncpy(job->img_id, img_id, MAX_IMG_ID);
 
-    // Move to the end of the file
-    if (fseek(imgfs_file->file, 0, SEEK_END) != 0) {
-        result = ERR_IO;
-        goto cleanup;
+    job->next = resizer.in_flight;
+    resizer.in_flight = job;
+    if (resizer.queue_tail != NULL) resizer.queue_tail->next_queued = job;
+    else resizer.queue = job;
+    resizer.queue_tail = job;
+    pthread_cond_signal(&resizer.not_empty);
+
+    return job;
+}
+
+int resize_service_request(const char* img_id, size_t index, int resolution)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    if (resolution != THUMB_RES && resolution != SMALL_RES) return ERR_RESOLUTIONS;
+
+    pthread_mutex_lock(&resizer.mutex);
+    if (resizer.nb_workers == 0 || resizer.stopping) {
+        pthread_mutex_unlock(&resizer.mutex);
+        return ERR_THREADING;
     }
 
-    // Write the resized image to the file
-    if (fwrite(resized_buffer, resized_size, 1, imgfs_file->file) != 1) {
-        result = ERR_IO;
-        goto cleanup;
+    // Join the job in flight for the same resolution of the same image, if any
+    struct resize_job* const job = find_or_queue_job(img_id, index, resolution, 0);
+    if (job == NULL) {
+        pthread_mutex_unlock(&resizer.mutex);
+        return ERR_OUT_OF_MEMORY;
     }
 
-    // Update the metadata
-    imgfs_file->metadata[index].offset[resolution] = (size_t)ftell(imgfs_file->file) - resized_size;
-    imgfs_file->metadata[index].size[resolution] = (uint32_t)resized_size;
+    ++job->nb_waiters;
+    while (!job->done) pthread_cond_wait(&resizer.done, &resizer.mutex);
+    const int err = job->err;
+    if (--job->nb_waiters == 0) free(job);
+    pthread_mutex_unlock(&resizer.mutex);
 
-    // Move back to the metadata
-    if (fseek(imgfs_file->file, (long)(sizeof(struct imgfs_header) + index * sizeof(struct img_metadata)), SEEK_SET) != 0) {
-        result = ERR_IO;
-        goto cleanup;
-    }
+    return err;
+}
 
-    // Write the updated metadata
-    if (fwrite(&imgfs_file->metadata[index], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-        result = ERR_IO;
-        goto cleanup;
+int resize_service_queue(const char* img_id, size_t index)
+{
+    M_REQUIRE_NON_NULL(img_id);
+
+    pthread_mutex_lock(&resizer.mutex);
+    int err = ERR_NONE;
+    if (resizer.nb_workers == 0 || resizer.stopping) err = ERR_THREADING;
+    else if (find_or_queue_job(img_id, index, THUMB_RES, 1) == NULL) err = ERR_OUT_OF_MEMORY;
+    pthread_mutex_unlock(&resizer.mutex);
+
+    return err;
+}
+
+void resize_service_stop(void)
+{
+    if (resizer.threads == NULL) return;
+
+    // The workers run the jobs already queued before they return
+    pthread_mutex_lock(&resizer.mutex);
+    resizer.stopping = 1;
+    pthread_cond_broadcast(&resizer.not_empty);
+    pthread_mutex_unlock(&resizer.mutex);
+
+    for (size_t i = 0; i < resizer.nb_workers; ++i) {
+        pthread_join(resizer.threads[i], NULL);
     }
 
-    // --------------------------------------------------------------------------------------------
-    //                                       CLEANUP
-    // --------------------------------------------------------------------------------------------
+    free(resizer.threads);
+    resizer.threads = NULL;
+    resizer.nb_workers = 0;
+    resizer.imgfs_file = NULL;
+}
 
-    /** EXPLANATION OF THE USE OF GOTO STATEMENTS FOR CLEANUP :
-    *   We have decided to use goto statements because it allows us to avoid repeating the same
-    *   cleanup code multiple times in case of errors.
-    *   This way, we can simply jump to the cleanup label, free the memory that has been allocated and
-    *   return the error code.
-    *   At the beginning, we have some parameters checks that return directly and do not need any cleanup,
-    *   which is why they don't have a goto statement.
-    */
+// JPEG markers (ITU T.81, table B.1)
+#define JPEG_MARKER_PREFIX 0xFF
+#define JPEG_SOI           0xD8 // Start of image
+#define JPEG_EOI           0xD9 // End of image
+#define JPEG_SOS           0xDA // Start of scan
+#define JPEG_TEM           0x01
+#define JPEG_RST0          0xD0
+#define JPEG_RST7          0xD7
+#define JPEG_SOF0          0xC0 // Start of frame: baseline,
+#define JPEG_SOF2          0xC2 // to progressive (Huffman coded ones)
+#define JPEG_SOF15         0xCF // Start of the other frames (but DHT, JPG and DAC)
+#define JPEG_DHT           0xC4 // Huffman tables
 
-cleanup:
-    if (buffer) free(buffer);
-    if (original) g_object_unref(VIPS_OBJECT(original));
-    if (resized) g_object_unref(VIPS_OBJECT(resized));
-    if (resized_buffer) free(resized_buffer);
+/*******************************************************************
+ * Reads the resolution of a JPEG image from its frame header (SOFn
+ * segment), walking the segments up to the first scan. Only the usual
+ * frames (baseline, extended sequential and progressive, Huffman coded)
+ * are handled: it fails on anything else or unusual (the caller then
+ * leaves it to the image library).
+ */
+static int jpeg_resolution(uint32_t* height, uint32_t* width,
+                           const unsigned char* image, size_t image_size)
+{
+    if (image_size < 4 || image[0] != JPEG_MARKER_PREFIX || image[1] != JPEG_SOI) return ERR_IMGLIB;
 
-    return result;
+    uint32_t lines = 0, samples = 0;
+    size_t pos = 2;
+    while (pos < image_size) {
+        if (image[pos] != JPEG_MARKER_PREFIX) return ERR_IMGLIB;
+        // Any number of fill bytes may precede a marker
+        while (pos < image_size && image[pos] == JPEG_MARKER_PREFIX) ++pos;
+        if (pos >= image_size) return ERR_IMGLIB;
+        const unsigned char marker = image[pos++];
+
+        // Markers without a segment
+        if (marker == JPEG_TEM || (marker >= JPEG_RST0 && marker <= JPEG_RST7)) continue;
+        if (marker == JPEG_SOI || marker == JPEG_EOI) return ERR_IMGLIB;
+
+        if (image_size - pos < 2) return ERR_IMGLIB;
+        const size_t length = (size_t) image[pos] << 8 | image[pos + 1];
+        if (length < 2 || length > image_size - pos) return ERR_IMGLIB;
+
+        if (marker == JPEG_SOS) {
+            // The first scan: the headers are complete (and must have described the frame)
+            if (lines == 0) return ERR_IMGLIB;
+            *height = lines;
+            *width = samples;
+            return ERR_NONE;
+        }
+
+        if (marker >= JPEG_SOF0 && marker <= JPEG_SOF2) {
+            // Length, precision, then the number of lines and of samples per line
+            if (length < 8 || lines != 0) return ERR_IMGLIB;
+            lines = (uint32_t) image[pos + 3] << 8 | image[pos + 4];
+            samples = (uint32_t) image[pos + 5] << 8 | image[pos + 6];
+            // 0 lines: given by a DNL segment after the first scan
+            if (lines == 0 || samples == 0) return ERR_IMGLIB;
+        } else if (marker > JPEG_SOF2 && marker <= JPEG_SOF15 && marker != JPEG_DHT) {
+            // Lossless, hierarchical or arithmetic coded frame (or the tables of the latter)
+            return ERR_IMGLIB;
+        }
+        pos += length;
+    }
+
+    return ERR_IMGLIB;
 }
 
 /**
@@ -145,6 +630,11 @@ int get_resolution(uint32_t *height, uint32_t *width,
     M_REQUIRE_NON_NULL(width);
     M_REQUIRE_NON_NULL(image_buffer);
 
+    // Only a few hundred bytes to parse, most of the time
+    if (jpeg_resolution(height, width, (const unsigned char*) image_buffer, image_size) == ERR_NONE) {
+        return ERR_NONE;
+    }
+
     VipsImage* original = NULL;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-qual"
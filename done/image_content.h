@@ -17,7 +17,9 @@ extern "C" {
 #endif
 
 /**
- * @brief Gets the resolution of an image.
+ * @brief Gets the resolution of an image. That of a JPEG image is read
+ * from its frame header; the image library is only used for what this
+ * does not handle (which includes what is not a JPEG image).
  *
  * @param height Where to put the calculated image height.
  * @param width Where to put the calculated image width.
@@ -26,6 +28,22 @@ extern "C" {
  */
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size);
 
+/**
+ * @brief Resizes a JPEG image to fit in width x height (keeping its
+ * aspect ratio), shrinking it while it is decoded.
+ *
+ * @param image_buffer The JPEG content of the image
+ * @param image_size Its size
+ * @param width The largest width of the resized image
+ * @param height The largest height of the resized image
+ * @param resized_buffer Where to put the JPEG content of the resized
+ *        image (to be freed by the caller)
+ * @param resized_size Where to put its size
+ * @return Some error code. 0 if no error.
+ */
+int resize_image(const char* image_buffer, size_t image_size, uint16_t width, uint16_t height,
+                 void** resized_buffer, size_t* resized_size);
+
 /**
  * @brief Resize the image to the given resolution, if it does not already
  * exists, and updates the metadata on the disk.
@@ -37,6 +55,72 @@ int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer,
  */
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index);
 
+/**
+ * @brief Creates all the missing resized resolutions (THUMB_RES and
+ * SMALL_RES) of an image out of a single decode of its original, and
+ * stores them with a single append and a single metadata update.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @return Some error code. 0 if no error.
+ */
+int lazily_resize_all(struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Starts the resize service: nb_workers threads creating the
+ * missing resolutions of the images of imgfs_file, for
+ * resize_service_request(). Every request for a resolution already
+ * being created waits for that job instead of starting its own, so an
+ * image is decoded and resized once however many ask for it at the
+ * same time. With all_variants, a job creates all the missing
+ * resolutions of its image at once (as lazily_resize_all() does), and
+ * requests for any of them join it.
+ *
+ * The content is decoded and resized without holding the lock that
+ * guards imgfs_file: the original is read under lock(0) (shared), the
+ * resized content appended under lock(1) (exclusive); unlock() releases
+ * either. Neither must be held by a thread calling resize_service_request().
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param nb_workers Number of threads resizing images
+ * @param all_variants Whether to create all the resolutions of an image at once
+ * @param lock Takes the lock guarding imgfs_file, exclusive or not
+ * @param unlock Releases it
+ * @return Some error code. 0 if no error.
+ */
+int resize_service_start(struct imgfs_file* imgfs_file, size_t nb_workers, int all_variants,
+                         void (*lock)(int exclusive), void (*unlock)(void));
+
+/**
+ * @brief Makes sure the image img_id, found at index, has the given
+ * resolution, waiting for the resize service to create it if needed.
+ *
+ * @param img_id The ID of the image
+ * @param index The index of the image in the metadata array
+ * @param resolution THUMB_RES or SMALL_RES
+ * @return Some error code (ERR_IMAGE_NOT_FOUND if the image got deleted
+ * meanwhile, ERR_THREADING if the service is not running). 0 if no error.
+ */
+int resize_service_request(const char* img_id, size_t index, int resolution);
+
+/**
+ * @brief Queues the creation of all the missing resolutions of the
+ * image img_id, found at index, without waiting for it (requests for
+ * them meanwhile join it). Those still queued when the service stops
+ * are dropped.
+ *
+ * @param img_id The ID of the image
+ * @param index The index of the image in the metadata array
+ * @return Some error code (ERR_THREADING if the service is not
+ * running). 0 if no error.
+ */
+int resize_service_queue(const char* img_id, size_t index);
+
+/**
+ * @brief Stops the resize service, once the jobs already requested are done.
+ */
+void resize_service_stop(void);
+
 #ifdef __cplusplus
 }
 #endif
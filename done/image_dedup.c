@@ -1,5 +1,6 @@
 #include "image_dedup.h"
-#include <string.h> // for strncmp
+#include "imgfs_index.h"
+#include <string.h> // for memcpy
 
 /**
  * @brief Does image deduplication.
@@ -17,21 +18,19 @@ int do_name_and_content_dedup(struct imgfs_file* imgfs_file, uint32_t index)
         return ERR_IMAGE_NOT_FOUND;
     }
 
-    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
-        // If the image is not the same as the one we are looking at and it exists
-        if (i != index && imgfs_file->metadata[i].is_valid == NON_EMPTY) {
-            // If the image has the same ID
-            if (strncmp(imgfs_file->metadata[i].img_id, imgfs_file->metadata[index].img_id, MAX_IMG_ID) == 0) {
-                return ERR_DUPLICATE_ID;
-            } else if (memcmp(imgfs_file->metadata[i].SHA, imgfs_file->metadata[index].SHA, SHA256_DIGEST_LENGTH) == 0) {
-                // If the image has the same SHA, copy the size and offset and invalidate the image
-                memcpy(imgfs_file->metadata[index].size, imgfs_file->metadata[i].size, sizeof(uint32_t) * NB_RES);
-                memcpy(imgfs_file->metadata[index].offset, imgfs_file->metadata[i].offset, sizeof(uint64_t) * NB_RES);
-                imgfs_file->metadata[index].is_valid = EMPTY;
+    // If another image has the same ID
+    if (imgfs_index_find_same_id(imgfs_file, index) != imgfs_file->header.max_files) {
+        return ERR_DUPLICATE_ID;
+    }
+
+    // If another image has the same SHA, copy the size and offset and invalidate the image
+    const uint32_t same = imgfs_index_find_same_sha(imgfs_file, index);
+    if (same != imgfs_file->header.max_files) {
+        memcpy(imgfs_file->metadata[index].size, imgfs_file->metadata[same].size, sizeof(uint32_t) * NB_RES);
+        memcpy(imgfs_file->metadata[index].offset, imgfs_file->metadata[same].offset, sizeof(uint64_t) * NB_RES);
+        imgfs_file->metadata[index].is_valid = EMPTY;
 
-                return ERR_NONE;
-            }
-        }
+        return ERR_NONE;
     }
 
     // If no duplicates were found, set the offset to 0
@@ -21,6 +21,7 @@
                     * all the functions of this lib.
                     */
 #include <openssl/sha.h>   // for SHA256_DIGEST_LENGTH
+#include <stddef.h>        // for size_t
 #include <stdint.h>        // for uint32_t, uint64_t
 #include <stdio.h>         // for FILE
 
@@ -79,6 +80,8 @@ struct img_metadata {
     uint16_t unused_16; // unused
 };
 
+struct imgfs_index; // In-memory lookup tables, see imgfs_index.h
+
 /**
  * @brief An image itself. Each image is stored in a contiguous part of the file, one after the other
  */
@@ -86,6 +89,23 @@ struct imgfs_file {
     FILE* file; // Indicates the FILE* containing everything (on the disk)
     struct imgfs_header header; // The header of the image database
     struct img_metadata* metadata;   // The metadata of the images in the database (dynamic array)
+    struct imgfs_index* index;  // Lookup tables over the metadata, built when opening (may be NULL)
+    void* map;          // Shared mapping of the header and metadata when opened with do_open_mmap(), else NULL
+    size_t map_size;    // Size of the mapping (in bytes)
+    int punch_holes;    // Whether do_delete() frees the content of the deleted image right away (0 after opening)
+    uint32_t nb_uploads;    // Number of contents being written piece by piece (see do_insert_begin())
+    uint64_t uploads_end;   // Where the last of them ends in the file (0 if none)
+};
+
+/**
+ * @brief An image whose content is written piece by piece (see do_insert_begin()).
+ */
+struct imgfs_upload {
+    char img_id[MAX_IMG_ID + 1];    // The ID of the image
+    uint64_t offset;    // Where its content goes in the file
+    uint32_t size;      // The size of its content
+    uint32_t written;   // How many bytes of it were written so far
+    void* sha;          // SHA-256 of these bytes (EVP_MD_CTX), NULL once the upload is over
 };
 
 /**
@@ -113,6 +133,24 @@ int do_open(const char* imgfs_filename,
             const char* open_mode,
             struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Open imgFS file and map its header and metadata into memory.
+ *
+ * Same as do_open(), except that imgfs_file->metadata points straight
+ * into a mapping of the file instead of a copy: nothing is read
+ * upfront, and the pages are shared with every process mapping the
+ * same file. With a writable open_mode ("rb+", ...) updates go to the
+ * file through the mapping (see imgfs_write_metadata()); otherwise the
+ * mapping is private, so in-memory changes never reach the file.
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ */
+int do_open_mmap(const char* imgfs_filename,
+                 const char* open_mode,
+                 struct imgfs_file* imgfs_file);
+
 /**
  * @brief Do some clean-up for imgFS file handling.
  *
@@ -120,6 +158,65 @@ int do_open(const char* imgfs_filename,
  */
 void do_close(struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Writes the (in-memory) header back to the imgFS file.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_header(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Reads size bytes at offset of the imgFS file.
+ *
+ * Uses positional I/O (pread()) on the file descriptor: the position of
+ * imgfs_file->file is neither used nor changed, so several threads may
+ * read the same opened imgFS at once.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param buffer Where to store the bytes read
+ * @param size The number of bytes to read
+ * @param offset The position in the file
+ * @return Some error code (ERR_IO if the file is too short). 0 if no error.
+ */
+int imgfs_read_at(const struct imgfs_file* imgfs_file, void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Writes size bytes at offset of the imgFS file (with pwrite()).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param buffer The bytes to write
+ * @param size The number of bytes to write
+ * @param offset The position in the file
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_at(const struct imgfs_file* imgfs_file, const void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Appends size bytes to the imgFS file (with pwrite()).
+ *
+ * Writers must not run concurrently with each other (they may with readers).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param buffer The bytes to write
+ * @param size The number of bytes to write
+ * @param offset Where to store the position of the bytes in the file
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_append(struct imgfs_file* imgfs_file, const void* buffer, size_t size, uint64_t* offset);
+
+/**
+ * @brief Writes one (in-memory) metadata entry back to the imgFS file.
+ *
+ * If the metadata is mapped, the entry is already in the file's pages:
+ * this only schedules the writeback of the entry's page.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param index The order number in the metadata array
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_metadata(struct imgfs_file* imgfs_file, uint32_t index);
+
 /**
  * @brief List of possible output modes for do_list()
  *
@@ -157,8 +254,14 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file);
  *
  * Effectively, it only invalidates the is_valid field and updates the
  * metadata.  The raw data content is not erased, it stays where it
- * was (and  new content is always appended to the end; no garbage
- * collection).
+ * was (and  new content is always appended to the end; see
+ * do_gbcollect() to reclaim the space).
+ *
+ * If imgfs_file->punch_holes is set, the content of the image (at every
+ * resolution) which no other valid entry shares is also deallocated
+ * right away, by punching holes in the file (the file size is left
+ * unchanged). This is best effort: on a file system without support for
+ * it, the content simply stays until the next compaction.
  *
  * @param img_id The ID of the image to be deleted.
  * @param imgfs_file The main in-memory data structure
@@ -178,6 +281,11 @@ int resolution_atoi(const char* resolution);
 /**
  * @brief Reads the content of an image from a imgFS.
  *
+ * The content is read with imgfs_read_at(), so several threads may read
+ * the same opened imgFS at once, as long as no one modifies it
+ * meanwhile; this includes creating a missing resolution, which
+ * do_read() does itself (see lazily_resize()).
+ *
  * @param img_id The ID of the image to be read.
  * @param resolution The desired resolution for the image read.
  * @param image_buffer Location of the location of the image content
@@ -188,6 +296,21 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, int resolution, char** image_buffer,
             uint32_t* image_size, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Finds where the content of an image is in a imgFS, creating the
+ *        resolution first if needed (as do_read() does), but reading
+ *        nothing: the caller reads size bytes at offset in the file.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param offset Location of the position of the image content in the file
+ * @param size Location of the image size variable
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_location(const char* img_id, int resolution, uint64_t* offset,
+                     uint32_t* size, struct imgfs_file* imgfs_file);
+
 /**
  * @brief Insert image in the imgFS file
  *
@@ -199,9 +322,71 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
 int do_insert(const char* image_buffer, size_t image_size,
               const char* img_id, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Starts the insertion of an image whose content arrives piece by
+ *        piece, so that it never needs to be held in memory.
+ *
+ * Space for the content is reserved at the end of the file right away;
+ * do_insert_write() then fills it while the SHA-256 is computed on the
+ * way, and do_insert_commit() adds the image (or do_insert_abort() gives
+ * the space back). Until then, compaction leaves the reserved space alone.
+ *
+ * do_insert_begin(), do_insert_commit() and do_insert_abort() modify the
+ * imgFS like do_insert(), whereas do_insert_write() only writes to the
+ * reserved space: it may run concurrently with anything but the end of
+ * the same upload.
+ *
+ * @param img_id Image ID
+ * @param image_size Size of the image content
+ * @param imgfs_file The main in-memory data structure
+ * @param upload The upload to start
+ * @return Some error code. 0 if no error (do_insert_commit() or
+ *         do_insert_abort() must then end the upload).
+ */
+int do_insert_begin(const char* img_id, size_t image_size,
+                    struct imgfs_file* imgfs_file, struct imgfs_upload* upload);
+
+/**
+ * @brief Writes the next piece of the content of an upload.
+ *
+ * @param upload The upload (see do_insert_begin())
+ * @param data The next bytes of the content
+ * @param len How many of them
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_write(struct imgfs_upload* upload, const void* data, size_t len,
+                    const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Ends an upload by inserting its image, once all its content is
+ *        written (see do_insert_begin()).
+ *
+ * On error, and if the same content is already stored (see
+ * do_name_and_content_dedup()), the content written is given back.
+ *
+ * @param upload The upload
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_commit(struct imgfs_upload* upload, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Ends an upload without inserting its image, giving back the
+ *        content written (see do_insert_begin()).
+ *
+ * @param upload The upload
+ * @param imgfs_file The main in-memory data structure
+ */
+void do_insert_abort(struct imgfs_upload* upload, struct imgfs_file* imgfs_file);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
+ * Streams the live content (once per blob, even if several entries share
+ * it) into a new imgFS at imgfs_tmp_bkp_path, then renames it over
+ * imgfs_path. The original file is left untouched on error.
+ *
  * @param imgfs_path The path to the imgFS file
  * @param imgfs_tmp_bkp_path The path to the a (to be created) temporary imgFS backup file
  * @return Some error code. 0 if no error.
@@ -0,0 +1,339 @@
+/**
+ * @file imgfs_compact.c
+ * @brief Incremental (online) compaction of an imgFS.
+ */
+
+#include "imgfs_compact.h"
+#include "imgfs_index.h"
+#include "util.h"
+
+#include <stdlib.h>     // for calloc, realloc, qsort, free
+#include <string.h>     // for memset
+#include <sys/mman.h>   // for msync
+#include <sys/stat.h>   // for fstat
+#include <unistd.h>     // for ftruncate, fdatasync
+
+// A part of the file used by at least one valid entry
+struct extent {
+    uint64_t offset;
+    uint32_t size;
+};
+
+static int compare_extents(const void* a, const void* b)
+{
+    const struct extent* x = a;
+    const struct extent* y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    return 0;
+}
+
+static uint64_t metadata_end(const struct imgfs_file* imgfs_file)
+{
+    return sizeof(struct imgfs_header) + (uint64_t) imgfs_file->header.max_files * sizeof(struct img_metadata);
+}
+
+/**********************************************************************
+ * Lists the parts of the file used by valid entries, sorted by offset,
+ * each shared blob once. Only the valid entries are walked (see
+ * imgfs_index_next_valid()), so the sort is the main cost.
+ */
+static int live_extents(const struct imgfs_file* imgfs_file, struct extent** extents, size_t* nb_extents)
+{
+    const uint32_t max_files = imgfs_file->header.max_files;
+    size_t capacity = (size_t) MIN(imgfs_file->header.nb_files, max_files) * NB_RES + 1;
+    *nb_extents = 0;
+    *extents = calloc(capacity, sizeof(struct extent));
+    if (*extents == NULL) return ERR_OUT_OF_MEMORY;
+
+    size_t nb = 0;
+    for (uint32_t i = imgfs_index_next_valid(imgfs_file, 0); i < max_files;
+         i = imgfs_index_next_valid(imgfs_file, i + 1)) {
+        const struct img_metadata* metadata = &imgfs_file->metadata[i];
+        for (int res = 0; res < NB_RES; ++res) {
+            if (metadata->size[res] == 0) continue;
+            if (nb == capacity) {
+                // nb_files in the header was too low
+                struct extent* const more = realloc(*extents, 2 * capacity * sizeof(struct extent));
+                if (more == NULL) return ERR_OUT_OF_MEMORY;
+                *extents = more;
+                capacity *= 2;
+            }
+            (*extents)[nb].offset = metadata->offset[res];
+            (*extents)[nb].size = metadata->size[res];
+            ++nb;
+        }
+    }
+    if (nb == 0) return ERR_NONE;
+
+    qsort(*extents, nb, sizeof(struct extent), compare_extents);
+
+    // Keep one copy of each shared blob
+    size_t unique = 1;
+    for (size_t i = 1; i < nb; ++i) {
+        if (compare_extents(&(*extents)[unique - 1], &(*extents)[i]) != 0) {
+            (*extents)[unique++] = (*extents)[i];
+        }
+    }
+    *nb_extents = unique;
+
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * End of the last content used by a valid entry (or of the metadata).
+ */
+static uint64_t live_end(const struct imgfs_file* imgfs_file)
+{
+    const uint32_t max_files = imgfs_file->header.max_files;
+    uint64_t end = metadata_end(imgfs_file);
+    for (uint32_t i = imgfs_index_next_valid(imgfs_file, 0); i < max_files;
+         i = imgfs_index_next_valid(imgfs_file, i + 1)) {
+        const struct img_metadata* metadata = &imgfs_file->metadata[i];
+        for (int res = 0; res < NB_RES; ++res) {
+            if (metadata->size[res] == 0) continue;
+            end = MAX(end, metadata->offset[res] + metadata->size[res]);
+        }
+    }
+    return end;
+}
+
+/**********************************************************************
+ * Whether some content of a valid entry overlaps [offset, offset + size).
+ */
+static int overlaps_live(const struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size)
+{
+    const uint32_t max_files = imgfs_file->header.max_files;
+    for (uint32_t i = imgfs_index_next_valid(imgfs_file, 0); i < max_files;
+         i = imgfs_index_next_valid(imgfs_file, i + 1)) {
+        const struct img_metadata* metadata = &imgfs_file->metadata[i];
+        for (int res = 0; res < NB_RES; ++res) {
+            if (metadata->size[res] == 0) continue;
+            if (metadata->offset[res] < offset + size && offset < metadata->offset[res] + metadata->size[res]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************
+ * Computes the space usage of an imgFS file.
+ */
+int imgfs_get_stats(const struct imgfs_file* imgfs_file, struct imgfs_stats* stats)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(stats);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->metadata_size = metadata_end(imgfs_file);
+
+    struct stat st;
+    if (fstat(fileno(imgfs_file->file), &st) != 0) return ERR_IO;
+    stats->file_size = (uint64_t) st.st_size;
+
+    // A blob used by refs references adds its size at each of them: the
+    // sizes are summed by number of references, then divided by it
+    const uint32_t max_files = imgfs_file->header.max_files;
+    const size_t max_refs = (size_t) MIN(imgfs_file->header.nb_files, max_files) * NB_RES;
+    uint64_t* by_refs = calloc(max_refs + 1, sizeof(uint64_t));
+    if (by_refs == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (uint32_t i = imgfs_index_next_valid(imgfs_file, 0); i < max_files;
+         i = imgfs_index_next_valid(imgfs_file, i + 1)) {
+        const struct img_metadata* metadata = &imgfs_file->metadata[i];
+        for (int res = 0; res < NB_RES; ++res) {
+            if (metadata->size[res] == 0) continue;
+            const uint32_t refs = imgfs_index_blob_refs(imgfs_file, metadata->offset[res], metadata->size[res]);
+            if (refs <= 1) {
+                stats->live_bytes += metadata->size[res];
+            } else if (refs <= max_refs) {
+                by_refs[refs] += metadata->size[res];
+            } else {
+                stats->live_bytes += metadata->size[res] / refs; // nb_files in the header was too low
+            }
+        }
+    }
+    for (size_t refs = 2; refs <= max_refs; ++refs) {
+        stats->live_bytes += by_refs[refs] / refs;
+    }
+    free(by_refs);
+
+    const uint64_t content_size = stats->file_size > stats->metadata_size
+                                  ? stats->file_size - stats->metadata_size : 0;
+    stats->dead_bytes = content_size > stats->live_bytes ? content_size - stats->live_bytes : 0;
+
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Share of the content which is dead.
+ */
+double imgfs_dead_ratio(const struct imgfs_stats* stats)
+{
+    if (stats == NULL) return 0.0;
+    const uint64_t content_size = stats->live_bytes + stats->dead_bytes;
+    return content_size == 0 ? 0.0 : (double) stats->dead_bytes / (double) content_size;
+}
+
+/**********************************************************************
+ * Plans the next relocation.
+ */
+int imgfs_compact_plan(const struct imgfs_file* imgfs_file, struct imgfs_relocation* relocation)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(relocation);
+
+    memset(relocation, 0, sizeof(*relocation));
+
+    // The content being uploaded looks like holes: nothing moves meanwhile
+    if (imgfs_file->nb_uploads > 0) return ERR_NONE;
+
+    struct extent* extents = NULL;
+    size_t nb_extents = 0;
+    int err = live_extents(imgfs_file, &extents, &nb_extents);
+    if (err != ERR_NONE || nb_extents == 0) {
+        free(extents);
+        return err;
+    }
+
+    // hole_start[i] is where the (possibly empty) hole right before extent i starts,
+    // best_hole[i] the size of the largest hole before extent i
+    uint64_t* hole_start = calloc(nb_extents, sizeof(uint64_t));
+    uint64_t* best_hole = calloc(nb_extents, sizeof(uint64_t));
+    if (hole_start == NULL || best_hole == NULL) {
+        err = ERR_OUT_OF_MEMORY;
+        goto cleanup;
+    }
+
+    uint64_t end = metadata_end(imgfs_file);
+    for (size_t i = 0; i < nb_extents; ++i) {
+        hole_start[i] = end;
+        const uint64_t hole = extents[i].offset > end ? extents[i].offset - end : 0;
+        best_hole[i] = MAX(hole, i > 0 ? best_hole[i - 1] : 0);
+        end = MAX(end, extents[i].offset + extents[i].size);
+    }
+
+    // The last blob which fits in an earlier hole...
+    size_t candidate = nb_extents;
+    while (candidate > 0 && best_hole[candidate - 1] < extents[candidate - 1].size) --candidate;
+    if (candidate == 0) goto cleanup;
+    --candidate;
+
+    // ...moves to the first of these holes
+    for (size_t i = 0; i <= candidate; ++i) {
+        if (extents[i].offset >= hole_start[i] + extents[candidate].size) {
+            relocation->from = extents[candidate].offset;
+            relocation->to = hole_start[i];
+            relocation->size = extents[candidate].size;
+            break;
+        }
+    }
+
+cleanup:
+    free(best_hole);
+    free(hole_start);
+    free(extents);
+
+    return err;
+}
+
+/**********************************************************************
+ * Copies the next chunk of the planned blob.
+ */
+int imgfs_compact_copy(const struct imgfs_file* imgfs_file, const struct imgfs_relocation* relocation,
+                       uint32_t* copied, size_t max_bytes)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(relocation);
+    M_REQUIRE_NON_NULL(copied);
+    if (max_bytes == 0) return ERR_INVALID_ARGUMENT;
+
+    if (*copied >= relocation->size) return ERR_NONE;
+
+    const size_t len = MIN(max_bytes, (size_t) (relocation->size - *copied));
+    char* buffer = malloc(len);
+    if (buffer == NULL) return ERR_OUT_OF_MEMORY;
+
+    int err = imgfs_read_at(imgfs_file, buffer, len, relocation->from + *copied);
+    if (err == ERR_NONE) err = imgfs_write_at(imgfs_file, buffer, len, relocation->to + *copied);
+
+    free(buffer);
+    if (err == ERR_NONE) *copied += (uint32_t) len;
+
+    return err;
+}
+
+/**********************************************************************
+ * Makes the metadata durable, then cuts the file after its last used byte.
+ */
+static int truncate_dead_end(struct imgfs_file* imgfs_file)
+{
+    const int fd = fileno(imgfs_file->file);
+    const uint64_t end = MAX(live_end(imgfs_file), imgfs_file->uploads_end);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) return ERR_IO;
+    if ((uint64_t) st.st_size <= end) return ERR_NONE;
+
+    // No entry may still point to the content being cut off once on disk
+    if (imgfs_file->map != NULL && msync(imgfs_file->map, imgfs_file->map_size, MS_SYNC) != 0) return ERR_IO;
+    if (fdatasync(fd) != 0) return ERR_IO;
+
+    if (ftruncate(fd, (off_t) end) != 0) return ERR_IO;
+
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Switches the entries to the relocated blob.
+ */
+int imgfs_compact_commit(struct imgfs_file* imgfs_file, const struct imgfs_relocation* relocation)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(relocation);
+
+    const uint32_t max_files = imgfs_file->header.max_files;
+    struct img_metadata* metadata = imgfs_file->metadata;
+    const uint64_t from = relocation->from;
+    const uint64_t to = relocation->to;
+    const uint32_t size = relocation->size;
+
+    // The blob must still be used...
+    uint32_t refs = size > 0 ? imgfs_index_blob_refs(imgfs_file, from, size) : 0;
+
+    // ...and its destination still unused
+    if (refs > 0 && overlaps_live(imgfs_file, to, size)) return truncate_dead_end(imgfs_file);
+
+    if (refs > 0) {
+        // The copy must be on disk before anything refers to it
+        if (fdatasync(fileno(imgfs_file->file)) != 0) return ERR_IO;
+
+        // Stops as soon as every reference is switched
+        for (uint32_t i = imgfs_index_next_valid(imgfs_file, 0); i < max_files && refs > 0;
+             i = imgfs_index_next_valid(imgfs_file, i + 1)) {
+            int moved = 0;
+            for (int res = 0; res < NB_RES; ++res) {
+                if (metadata[i].offset[res] == from && metadata[i].size[res] == size) {
+                    imgfs_index_unref_blob(imgfs_file, i, res);
+                    metadata[i].offset[res] = to;
+                    imgfs_index_ref_blob(imgfs_file, i, res);
+                    moved = 1;
+                    --refs;
+                }
+            }
+            if (moved) {
+                const int err = imgfs_write_metadata(imgfs_file, i);
+                if (err != ERR_NONE) return err;
+            }
+        }
+    }
+
+    return truncate_dead_end(imgfs_file);
+}
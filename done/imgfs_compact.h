@@ -0,0 +1,126 @@
+/**
+ * @file imgfs_compact.h
+ * @brief Incremental (online) compaction of an imgFS.
+ *
+ * Unlike do_gbcollect(), which rewrites the whole file, a compaction step
+ * moves a single blob (image content at one resolution, possibly shared
+ * by several entries) from the end of the file into an earlier hole left
+ * by deleted content, then shrinks the file if its end is dead.
+ *
+ * A step is split so that a server can keep serving meanwhile:
+ *   1. imgfs_compact_plan() chooses the blob and the hole. It only reads
+ *      the metadata, so a shared lock is enough: commit checks the plan
+ *      again;
+ *   2. imgfs_compact_copy() copies the blob into the hole, in bounded
+ *      chunks. The hole is dead space, so readers are never disturbed
+ *      and no lock is needed (positional I/O only);
+ *   3. imgfs_compact_commit() switches the offsets of every entry using
+ *      the blob, then truncates the dead end of the file. Both must be
+ *      done under the same lock as do_read() and friends.
+ * Since the blob never overlaps its destination, a crash at any point
+ * leaves a consistent file.
+ *
+ * imgfs_get_stats() tells how much of the file is dead (content of
+ * deleted images, orphaned resized content), i.e. what a compaction
+ * would reclaim.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief One planned relocation.
+ */
+struct imgfs_relocation {
+    uint64_t from;  // Current offset of the blob in the file
+    uint64_t to;    // Offset of the hole the blob moves to
+    uint32_t size;  // Size of the blob (0 if there is nothing to relocate)
+};
+
+/**
+ * @brief Space usage of an imgFS file.
+ */
+struct imgfs_stats {
+    uint64_t file_size;     // Size of the file
+    uint64_t metadata_size; // Size of the header and of the metadata array
+    uint64_t live_bytes;    // Content used by at least one valid entry (shared content counted once)
+    uint64_t dead_bytes;    // Any other content: reclaimable by a compaction
+};
+
+/**
+ * @brief Computes the space usage of an imgFS file.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param stats Where to store the statistics
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_get_stats(const struct imgfs_file* imgfs_file, struct imgfs_stats* stats);
+
+/**
+ * @brief Share of the content (everything after the metadata) which is dead.
+ *
+ * @param stats The statistics of an imgFS file
+ * @return The dead ratio, between 0 and 1 (0 for a file without content).
+ */
+double imgfs_dead_ratio(const struct imgfs_stats* stats);
+
+/**
+ * @brief Displays (on stdout) or formats (in JSON) the space usage of an imgFS file.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param output_mode What style to use for displaying the statistics
+ * @param json A pointer to a string containing the statistics in JSON format if output_mode
+ *      is JSON. It will be dynamically allocated by the function. Ignored for other output modes.
+ * @return Some error code. 0 if no error.
+ */
+int do_stats(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode, char** json);
+
+/**
+ * @brief Chooses the next relocation: the last blob of the file that
+ *        fits in an earlier hole, moved to the first such hole.
+ *
+ * There is none while uploads are in progress (see do_insert_begin()),
+ * and imgfs_compact_commit() never truncates their content.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param relocation Where to store the plan (size 0 if there is none)
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_compact_plan(const struct imgfs_file* imgfs_file, struct imgfs_relocation* relocation);
+
+/**
+ * @brief Copies (at most max_bytes of) the planned blob to its destination.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param relocation The planned relocation
+ * @param copied Number of bytes already copied, updated by the call
+ * @param max_bytes Maximum number of bytes to copy in this call (> 0)
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_compact_copy(const struct imgfs_file* imgfs_file, const struct imgfs_relocation* relocation,
+                       uint32_t* copied, size_t max_bytes);
+
+/**
+ * @brief Switches every entry using the (fully copied) blob to its new
+ *        offset, then truncates the dead end of the file.
+ *
+ * Does nothing but the truncation if the blob is no longer used, or if
+ * its destination got used meanwhile.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param relocation The planned relocation (size may be 0: truncation only)
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_compact_commit(struct imgfs_file* imgfs_file, const struct imgfs_relocation* relocation);
+
+#ifdef __cplusplus
+}
+#endif
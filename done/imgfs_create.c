@@ -1,4 +1,5 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +18,14 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
     M_REQUIRE_NON_NULL(imgfs_filename);
     M_REQUIRE_NON_NULL(imgfs_file);
 
+    imgfs_file->metadata = NULL;
+    imgfs_file->index = NULL;
+    imgfs_file->map = NULL;
+    imgfs_file->map_size = 0;
+    imgfs_file->punch_holes = 0;
+    imgfs_file->nb_uploads = 0;
+    imgfs_file->uploads_end = 0;
+
     // Open the file for writing, create it if it does not exist
     imgfs_file->file = fopen(imgfs_filename, "wb");
     if (imgfs_file->file == NULL) {
@@ -54,8 +63,21 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
         return ERR_IO;
     }
 
+    // Any later access is positional (see imgfs_read_at()): nothing may stay in the stdio buffer
+    if (fflush(imgfs_file->file) != 0) {
+        do_close(imgfs_file);
+        return ERR_IO;
+    }
+
     // Output the number of items written to the file (max_files + 1 to account for the header)
     printf("%zu item(s) written\n", max_files + 1);
 
+    // The new imgFS is immediately usable: build its (empty) lookup tables
+    const int err = imgfs_index_build(imgfs_file);
+    if (err != ERR_NONE) {
+        do_close(imgfs_file);
+        return err;
+    }
+
     return ERR_NONE;
 }
@@ -1,16 +1,54 @@
+#define _GNU_SOURCE // for fallocate
+
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "util.h"
 
+#include <fcntl.h>        // for fallocate
+#include <linux/falloc.h> // for FALLOC_FL_PUNCH_HOLE, FALLOC_FL_KEEP_SIZE
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>     // for msync
+#include <unistd.h>       // for fdatasync
+
+/**
+ * @brief Deallocates the content of a deleted entry that no valid entry
+ *        shares. Best effort: the content stays dead if this fails.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param index The order number of the deleted entry in the metadata array
+ */
+static void punch_content(struct imgfs_file* imgfs_file, uint32_t index)
+{
+    const struct img_metadata* metadata = &imgfs_file->metadata[index];
+
+    // The invalidated entry must be on disk first
+    const int fd = fileno(imgfs_file->file);
+    if (imgfs_file->map != NULL && msync(imgfs_file->map, imgfs_file->map_size, MS_SYNC) != 0) return;
+    if (fdatasync(fd) != 0) return;
+
+    for (int res = 0; res < NB_RES; ++res) {
+        if (metadata->size[res] == 0) continue;
+        if (imgfs_index_blob_refs(imgfs_file, metadata->offset[res], metadata->size[res]) > 0) continue;
+
+        (void) fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         (off_t) metadata->offset[res], (off_t) metadata->size[res]);
+    }
+}
 
 /**
  * @brief Deletes an image from a imgFS imgFS.
  *
  * Effectively, it only invalidates the is_valid field and updates the
  * metadata.  The raw data content is not erased, it stays where it
- * was (and  new content is always appended to the end; no garbage
- * collection).
+ * was (and  new content is always appended to the end; see
+ * do_gbcollect() to reclaim the space).
+ *
+ * If imgfs_file->punch_holes is set, the content of the image (at every
+ * resolution) which no other valid entry shares is also deallocated
+ * right away, by punching holes in the file (the file size is left
+ * unchanged). This is best effort: on a file system without support for
+ * it, the content simply stays until the next compaction.
  *
  * @param img_id The ID of the image to be deleted.
  * @param imgfs_file The main in-memory data structure
@@ -28,13 +66,7 @@ int do_delete(const char* img_id, struct imgfs_file* imgfs_file)
     }
 
     // Find the image in the metadata
-    size_t index = imgfs_file->header.max_files; // Invalid index, will be modified if the image is found
-    for (uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
-        if (strcmp(imgfs_file->metadata[i].img_id, img_id) == 0 && imgfs_file->metadata[i].is_valid != EMPTY) {
-            index = i;
-            break;
-        }
-    }
+    const uint32_t index = imgfs_index_find_id(imgfs_file, img_id);
 
     // The image does not exist or is already deleted
     if (index == imgfs_file->header.max_files) {
@@ -42,31 +74,27 @@ int do_delete(const char* img_id, struct imgfs_file* imgfs_file)
     }
 
     // Invalidate the metadata entry
+    imgfs_index_remove(imgfs_file, index);
     imgfs_file->metadata[index].is_valid = EMPTY;
 
-    // Find the offset of the metadata in the file
-    size_t offset = sizeof(struct imgfs_header) + sizeof(struct img_metadata) * index;
-    if(fseek(imgfs_file->file, (long)offset, SEEK_SET) != 0) {
-        return ERR_IO;
-    }
-
     // Write the updated metadata to disk
-    if(fwrite(&imgfs_file->metadata[index], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+    int err = imgfs_write_metadata(imgfs_file, index);
+    if (err != ERR_NONE) {
+        return err;
     }
 
     // Update the header
     imgfs_file->header.nb_files--;
     imgfs_file->header.version++;
 
-    // Find the offset of the header in the file
-    if(fseek(imgfs_file->file, 0, SEEK_SET) != 0) {
-        return ERR_IO;
+    // Write the updated header to disk
+    err = imgfs_write_header(imgfs_file);
+    if (err != ERR_NONE) {
+        return err;
     }
 
-    // Write the updated header to disk
-    if(fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+    if (imgfs_file->punch_holes) {
+        punch_content(imgfs_file, index);
     }
 
     return ERR_NONE;
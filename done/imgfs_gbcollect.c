@@ -0,0 +1,192 @@
+/**
+ * @file imgfs_gbcollect.c
+ * @brief Garbage collection of an imgFS: drops the content of deleted
+ *        images by streaming the live content into a fresh file.
+ */
+
+#include "imgfs.h"
+#include "util.h"
+
+#include <fcntl.h>     // for open
+#include <stdio.h>     // for rename, remove, fseeko
+#include <stdlib.h>    // for calloc, qsort
+#include <string.h>    // for strrchr, strndup
+#include <sys/types.h> // for off_t
+#include <unistd.h>    // for fsync, close
+
+// Size of the copy buffer (and of the output stdio buffer)
+#define GC_BUFFER_SIZE (1 << 20)
+
+// One (image, resolution) whose content must be kept
+struct live_blob {
+    uint64_t offset;    // Position in the original file
+    uint32_t size;      // Size of the content
+    uint32_t slot;      // Order number in the metadata array
+    int resolution;     // Resolution of the image content
+};
+
+/**********************************************************************
+ * Orders blobs by position in the original file (then size), so that the
+ * original file is read sequentially and copies of one same blob are
+ * next to each other.
+ */
+static int compare_blobs(const void* a, const void* b)
+{
+    const struct live_blob* x = a;
+    const struct live_blob* y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    return 0;
+}
+
+/**********************************************************************
+ * Copies size bytes at offset of in to the current position of out.
+ */
+static int copy_blob(FILE* in, FILE* out, uint64_t offset, uint32_t size, char* buffer)
+{
+    if (fseeko(in, (off_t) offset, SEEK_SET) != 0) return ERR_IO;
+
+    size_t remaining = size;
+    while (remaining > 0) {
+        const size_t chunk = MIN(remaining, (size_t) GC_BUFFER_SIZE);
+        if (fread(buffer, chunk, 1, in) != 1) return ERR_IO;
+        if (fwrite(buffer, chunk, 1, out) != 1) return ERR_IO;
+        remaining -= chunk;
+    }
+
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Writes the compacted imgFS to out. The header and metadata are written
+ * first (the new offsets are known beforehand), then every live blob once.
+ */
+static int write_compacted(const struct imgfs_file* imgfs_file, FILE* out,
+                           struct img_metadata* metadata, struct live_blob* blobs,
+                           size_t nb_blobs, char* buffer)
+{
+    // New offsets: live blobs are packed right after the metadata
+    uint64_t end = sizeof(struct imgfs_header) + imgfs_file->header.max_files * sizeof(struct img_metadata);
+    for (size_t i = 0; i < nb_blobs; ++i) {
+        // A blob shared by several entries (deduplication) is copied once
+        const int shared = i > 0 && compare_blobs(&blobs[i - 1], &blobs[i]) == 0;
+        if (!shared) end += blobs[i].size;
+        metadata[blobs[i].slot].offset[blobs[i].resolution] = end - blobs[i].size;
+    }
+
+    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, out) != 1) return ERR_IO;
+    if (fwrite(metadata, sizeof(struct img_metadata), imgfs_file->header.max_files, out)
+        != imgfs_file->header.max_files) {
+        return ERR_IO;
+    }
+
+    for (size_t i = 0; i < nb_blobs; ++i) {
+        if (i > 0 && compare_blobs(&blobs[i - 1], &blobs[i]) == 0) continue;
+        const int err = copy_blob(imgfs_file->file, out, blobs[i].offset, blobs[i].size, buffer);
+        if (err != ERR_NONE) return err;
+    }
+
+    // The new file must be on disk before it replaces the original one
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0) return ERR_IO;
+
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Makes a rename to path durable, by syncing the directory holding it.
+ */
+static int sync_parent_dir(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    char* dir = slash == NULL ? strndup(".", 1)
+                : strndup(path, slash == path ? 1 : (size_t) (slash - path));
+    if (dir == NULL) return ERR_OUT_OF_MEMORY;
+
+    const int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0) return ERR_IO;
+
+    const int err = fsync(fd) != 0 ? ERR_IO : ERR_NONE;
+    close(fd);
+    return err;
+}
+
+/**
+ * @brief Removes the deleted images by moving the existing ones
+ *
+ * @param imgfs_path The path to the imgFS file
+ * @param imgfs_tmp_bkp_path The path to the a (to be created) temporary imgFS backup file
+ * @return Some error code. 0 if no error.
+ */
+int do_gbcollect(const char* imgfs_path, const char* imgfs_tmp_bkp_path)
+{
+    M_REQUIRE_NON_NULL(imgfs_path);
+    M_REQUIRE_NON_NULL(imgfs_tmp_bkp_path);
+
+    struct imgfs_file imgfs_file;
+    int err = do_open(imgfs_path, "rb", &imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    const uint32_t max_files = imgfs_file.header.max_files;
+    struct img_metadata* metadata = calloc(max_files, sizeof(struct img_metadata));
+    struct live_blob* blobs = calloc((size_t) max_files * NB_RES, sizeof(struct live_blob));
+    char* buffer = malloc(GC_BUFFER_SIZE);
+    size_t nb_blobs = 0;
+    FILE* out = NULL;
+    int created = 0;
+
+    if (((metadata == NULL || blobs == NULL) && max_files > 0) || buffer == NULL) {
+        err = ERR_OUT_OF_MEMORY;
+        goto cleanup;
+    }
+
+    // Keep the valid entries only, and list the content they refer to
+    for (uint32_t i = 0; i < max_files; ++i) {
+        if (imgfs_file.metadata[i].is_valid != NON_EMPTY) continue;
+
+        metadata[i] = imgfs_file.metadata[i];
+        for (int res = 0; res < NB_RES; ++res) {
+            if (metadata[i].size[res] == 0) continue;
+            blobs[nb_blobs].offset = metadata[i].offset[res];
+            blobs[nb_blobs].size = metadata[i].size[res];
+            blobs[nb_blobs].slot = i;
+            blobs[nb_blobs].resolution = res;
+            ++nb_blobs;
+        }
+    }
+    if (nb_blobs > 0) qsort(blobs, nb_blobs, sizeof(struct live_blob), compare_blobs);
+
+    out = fopen(imgfs_tmp_bkp_path, "wb");
+    if (out == NULL) {
+        err = ERR_IO;
+        goto cleanup;
+    }
+    created = 1;
+
+    // Blobs are read and written by large chunks; the remaining small writes
+    // (header, metadata) are gathered in a large buffer too
+    setvbuf(out, NULL, _IOFBF, GC_BUFFER_SIZE);
+
+    err = write_compacted(&imgfs_file, out, metadata, blobs, nb_blobs, buffer);
+    if (fclose(out) != 0 && err == ERR_NONE) err = ERR_IO;
+    out = NULL;
+    if (err != ERR_NONE) goto cleanup;
+
+    // Atomically replace the original file, and make it last
+    if (rename(imgfs_tmp_bkp_path, imgfs_path) != 0) {
+        err = ERR_IO;
+        goto cleanup;
+    }
+    created = 0;
+    err = sync_parent_dir(imgfs_path);
+
+cleanup:
+    if (out != NULL) fclose(out);
+    if (err != ERR_NONE && created) remove(imgfs_tmp_bkp_path);
+    free(buffer);
+    free(blobs);
+    free(metadata);
+    do_close(&imgfs_file);
+
+    return err;
+}
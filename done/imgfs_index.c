@@ -0,0 +1,482 @@
+/**
+ * @file imgfs_index.c
+ * @brief In-memory lookup tables over the metadata array.
+ */
+
+#include "imgfs_index.h"
+
+#include <stdlib.h>  // for calloc, free
+#include <string.h>  // for strncmp, memcmp, memcpy
+
+// Hash of the key of a metadata entry
+typedef uint64_t (*slot_hash)(const struct img_metadata* metadata);
+
+// Whether a metadata entry has the given key
+typedef int (*slot_match)(const struct img_metadata* metadata, const void* key);
+
+/**********************************************************************
+ * FNV-1a hash of an image ID (up to MAX_IMG_ID characters, as strncmp).
+ */
+static uint64_t hash_img_id(const char* img_id)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash ^= (unsigned char) img_id[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**********************************************************************
+ * A SHA-256 digest is already uniformly distributed: use its first bytes.
+ */
+static uint64_t hash_sha(const unsigned char* SHA)
+{
+    uint64_t hash;
+    memcpy(&hash, SHA, sizeof(hash));
+    return hash;
+}
+
+static uint64_t hash_of_id(const struct img_metadata* metadata)
+{
+    return hash_img_id(metadata->img_id);
+}
+
+static uint64_t hash_of_sha(const struct img_metadata* metadata)
+{
+    return hash_sha(metadata->SHA);
+}
+
+/**********************************************************************
+ * Blob positions are close to each other: mix all their bits
+ * (finalizer of MurmurHash3).
+ */
+static uint64_t hash_blob(uint64_t offset, uint32_t size)
+{
+    uint64_t hash = offset ^ ((uint64_t) size << 32);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int match_id(const struct img_metadata* metadata, const void* img_id)
+{
+    return strncmp(metadata->img_id, img_id, MAX_IMG_ID) == 0;
+}
+
+static int match_sha(const struct img_metadata* metadata, const void* SHA)
+{
+    return memcmp(metadata->SHA, SHA, SHA256_DIGEST_LENGTH) == 0;
+}
+
+/**********************************************************************
+ * Adds slot to a table, in the first empty bucket from its home bucket.
+ */
+static void table_add(uint32_t* table, size_t mask, uint64_t hash, uint32_t slot)
+{
+    size_t bucket = (size_t) hash & mask;
+    while (table[bucket] != 0) {
+        bucket = (bucket + 1) & mask;
+    }
+    table[bucket] = slot + 1;
+}
+
+/**********************************************************************
+ * Whether the entry of bucket next, whose home bucket is home, must stay
+ * after a hole in its probe run, i.e. home lies cyclically in (hole, next].
+ */
+static int stays_after_hole(size_t hole, size_t home, size_t next)
+{
+    return hole <= next ? (hole < home && home <= next)
+           : (hole < home || home <= next);
+}
+
+/**********************************************************************
+ * Removes slot from a table, shifting back the rest of its probe run
+ * so that no tombstone is ever needed.
+ */
+static void table_remove(uint32_t* table, size_t mask, const struct img_metadata* metadata,
+                         slot_hash hash, uint32_t slot)
+{
+    size_t hole = (size_t) hash(&metadata[slot]) & mask;
+    while (table[hole] != slot + 1) {
+        if (table[hole] == 0) return; // Not registered
+        hole = (hole + 1) & mask;
+    }
+
+    for (size_t next = (hole + 1) & mask; table[next] != 0; next = (next + 1) & mask) {
+        const size_t home = (size_t) hash(&metadata[table[next] - 1]) & mask;
+        if (!stays_after_hole(hole, home, next)) {
+            table[hole] = table[next];
+            hole = next;
+        }
+    }
+    table[hole] = 0;
+}
+
+/**********************************************************************
+ * Blob table helpers. The table is never full: it has at least twice
+ * as many buckets as there can be blobs.
+ */
+static struct imgfs_blob_ref* blob_find(const struct imgfs_index* index, uint64_t offset, uint32_t size)
+{
+    const size_t mask = index->blob_mask;
+    for (size_t bucket = (size_t) hash_blob(offset, size) & mask; index->blobs[bucket].refs != 0;
+         bucket = (bucket + 1) & mask) {
+        if (index->blobs[bucket].offset == offset && index->blobs[bucket].size == size) {
+            return &index->blobs[bucket];
+        }
+    }
+    return NULL;
+}
+
+static void blob_ref(struct imgfs_index* index, uint64_t offset, uint32_t size)
+{
+    const size_t mask = index->blob_mask;
+    size_t bucket = (size_t) hash_blob(offset, size) & mask;
+    while (index->blobs[bucket].refs != 0
+           && (index->blobs[bucket].offset != offset || index->blobs[bucket].size != size)) {
+        bucket = (bucket + 1) & mask;
+    }
+    index->blobs[bucket].offset = offset;
+    index->blobs[bucket].size = size;
+    ++index->blobs[bucket].refs;
+}
+
+static void blob_unref(struct imgfs_index* index, uint64_t offset, uint32_t size)
+{
+    struct imgfs_blob_ref* blob = blob_find(index, offset, size);
+    if (blob == NULL) return; // Not registered
+    if (--blob->refs > 0) return;
+
+    // Last reference: shift back the rest of the probe run, as table_remove()
+    const size_t mask = index->blob_mask;
+    size_t hole = (size_t) (blob - index->blobs);
+    for (size_t next = (hole + 1) & mask; index->blobs[next].refs != 0; next = (next + 1) & mask) {
+        const size_t home = (size_t) hash_blob(index->blobs[next].offset, index->blobs[next].size) & mask;
+        if (!stays_after_hole(hole, home, next)) {
+            index->blobs[hole] = index->blobs[next];
+            hole = next;
+        }
+    }
+    index->blobs[hole].refs = 0;
+}
+
+/**********************************************************************
+ * Occupancy bitmap helpers.
+ */
+#define BITS_PER_WORD 64
+
+static int is_occupied(const struct imgfs_index* index, uint32_t slot)
+{
+    return (index->occupied[slot / BITS_PER_WORD] >> (slot % BITS_PER_WORD)) & 1;
+}
+
+static void set_occupied(struct imgfs_index* index, uint32_t slot, int occupied)
+{
+    const uint64_t bit = (uint64_t) 1 << (slot % BITS_PER_WORD);
+    if (occupied) {
+        index->occupied[slot / BITS_PER_WORD] |= bit;
+    } else {
+        index->occupied[slot / BITS_PER_WORD] &= ~bit;
+    }
+}
+
+/**********************************************************************
+ * Refills the free-slot stack from the bitmap (lowest slot on top).
+ */
+static void refill_free_slots(struct imgfs_index* index, uint32_t max_files)
+{
+    index->nb_free = 0;
+    for (uint32_t slot = max_files; slot > 0; --slot) {
+        if (!is_occupied(index, slot - 1)) {
+            index->free_slots[index->nb_free++] = slot - 1;
+        }
+    }
+}
+
+/**********************************************************************
+ * Finds a valid entry, other than skip, matching key. Scans the whole
+ * metadata array if there is no table.
+ */
+static uint32_t table_find(const struct imgfs_file* imgfs_file, const uint32_t* table,
+                           uint64_t hash, slot_match match, const void* key, uint32_t skip)
+{
+    const uint32_t max_files = imgfs_file->header.max_files;
+    const struct img_metadata* metadata = imgfs_file->metadata;
+
+    if (table == NULL) {
+        for (uint32_t i = 0; i < max_files; ++i) {
+            if (i != skip && metadata[i].is_valid == NON_EMPTY && match(&metadata[i], key)) {
+                return i;
+            }
+        }
+        return max_files;
+    }
+
+    const size_t mask = imgfs_file->index->mask;
+    for (size_t bucket = (size_t) hash & mask; table[bucket] != 0; bucket = (bucket + 1) & mask) {
+        const uint32_t slot = table[bucket] - 1;
+        if (slot != skip && metadata[slot].is_valid == NON_EMPTY && match(&metadata[slot], key)) {
+            return slot;
+        }
+    }
+    return max_files;
+}
+
+/**********************************************************************
+ * Builds the lookup tables.
+ */
+int imgfs_index_build(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    imgfs_index_free(imgfs_file);
+
+    const uint32_t max_files = imgfs_file->header.max_files;
+    // Slots are stored as slot + 1 in 32 bits; huge tables are simply not indexed
+    if (max_files >= UINT32_MAX / 2) return ERR_NONE;
+
+    size_t nb_buckets = 16;
+    while (nb_buckets < 2 * (size_t) max_files) nb_buckets *= 2;
+
+    struct imgfs_index* index = calloc(1, sizeof(struct imgfs_index));
+    if (index == NULL) return ERR_OUT_OF_MEMORY;
+    imgfs_file->index = index;
+
+    index->mask = nb_buckets - 1;
+    index->by_id = calloc(nb_buckets, sizeof(uint32_t));
+    index->by_sha = calloc(nb_buckets, sizeof(uint32_t));
+    // One more word/slot than needed, so that an empty imgFS still gets valid pointers
+    index->occupied = calloc(max_files / BITS_PER_WORD + 1, sizeof(uint64_t));
+    index->free_slots = calloc((size_t) max_files + 1, sizeof(uint32_t));
+
+    size_t nb_blob_buckets = 16;
+    while (nb_blob_buckets < 2 * NB_RES * (size_t) max_files) nb_blob_buckets *= 2;
+    index->blob_mask = nb_blob_buckets - 1;
+    index->blobs = calloc(nb_blob_buckets, sizeof(struct imgfs_blob_ref));
+
+    if (index->by_id == NULL || index->by_sha == NULL
+        || index->occupied == NULL || index->free_slots == NULL || index->blobs == NULL) {
+        imgfs_index_free(imgfs_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid == NON_EMPTY) {
+            imgfs_index_add(imgfs_file, i);
+        }
+    }
+    refill_free_slots(index, max_files);
+
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Frees the lookup tables.
+ */
+void imgfs_index_free(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file == NULL || imgfs_file->index == NULL) return;
+
+    free(imgfs_file->index->by_id);
+    free(imgfs_file->index->by_sha);
+    free(imgfs_file->index->occupied);
+    free(imgfs_file->index->free_slots);
+    free(imgfs_file->index->blobs);
+    free(imgfs_file->index);
+    imgfs_file->index = NULL;
+}
+
+/**********************************************************************
+ * Finds the valid entry with the given image ID.
+ */
+uint32_t imgfs_index_find_id(const struct imgfs_file* imgfs_file, const char* img_id)
+{
+    const uint32_t* table = imgfs_file->index == NULL ? NULL : imgfs_file->index->by_id;
+    return table_find(imgfs_file, table, hash_img_id(img_id), match_id, img_id,
+                      imgfs_file->header.max_files);
+}
+
+/**********************************************************************
+ * Finds another valid entry with the same image ID.
+ */
+uint32_t imgfs_index_find_same_id(const struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    const char* img_id = imgfs_file->metadata[slot].img_id;
+    const uint32_t* table = imgfs_file->index == NULL ? NULL : imgfs_file->index->by_id;
+    return table_find(imgfs_file, table, hash_img_id(img_id), match_id, img_id, slot);
+}
+
+/**********************************************************************
+ * Finds another valid entry with the same content.
+ */
+uint32_t imgfs_index_find_same_sha(const struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    const unsigned char* SHA = imgfs_file->metadata[slot].SHA;
+    const uint32_t* table = imgfs_file->index == NULL ? NULL : imgfs_file->index->by_sha;
+    return table_find(imgfs_file, table, hash_sha(SHA), match_sha, SHA, slot);
+}
+
+/**********************************************************************
+ * Counts the references to a blob.
+ */
+uint32_t imgfs_index_blob_refs(const struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size)
+{
+    if (size == 0) return 0; // No content
+
+    if (imgfs_file->index != NULL) {
+        const struct imgfs_blob_ref* blob = blob_find(imgfs_file->index, offset, size);
+        return blob == NULL ? 0 : blob->refs;
+    }
+
+    uint32_t refs = 0;
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        const struct img_metadata* metadata = &imgfs_file->metadata[i];
+        if (metadata->is_valid != NON_EMPTY) continue;
+        for (int res = 0; res < NB_RES; ++res) {
+            if (metadata->size[res] == size && metadata->offset[res] == offset) ++refs;
+        }
+    }
+    return refs;
+}
+
+/**********************************************************************
+ * Finds the first valid entry from a given slot on.
+ */
+uint32_t imgfs_index_next_valid(const struct imgfs_file* imgfs_file, uint32_t from)
+{
+    const uint32_t max_files = imgfs_file->header.max_files;
+    const struct img_metadata* metadata = imgfs_file->metadata;
+
+    if (imgfs_file->index == NULL) {
+        for (uint32_t i = from; i < max_files; ++i) {
+            if (metadata[i].is_valid == NON_EMPTY) return i;
+        }
+        return max_files;
+    }
+
+    const uint64_t* occupied = imgfs_file->index->occupied;
+    const size_t nb_words = max_files / BITS_PER_WORD + 1;
+    while (from < max_files) {
+        size_t word = from / BITS_PER_WORD;
+        uint64_t bits = occupied[word] & (~(uint64_t) 0 << (from % BITS_PER_WORD));
+        while (bits == 0) {
+            if (++word >= nb_words) return max_files;
+            bits = occupied[word];
+        }
+
+        const uint32_t slot = (uint32_t) (word * BITS_PER_WORD + (size_t) __builtin_ctzll(bits));
+        if (slot >= max_files) break;
+        if (metadata[slot].is_valid == NON_EMPTY) return slot;
+        from = slot + 1; // Stale bit: go on
+    }
+    return max_files;
+}
+
+/**********************************************************************
+ * Finds an empty entry.
+ */
+uint32_t imgfs_index_free_slot(struct imgfs_file* imgfs_file)
+{
+    const uint32_t max_files = imgfs_file->header.max_files;
+    struct imgfs_index* index = imgfs_file->index;
+
+    if (index != NULL) {
+        // Drop the stale slots (reused since they were freed)
+        while (index->nb_free > 0) {
+            const uint32_t slot = index->free_slots[index->nb_free - 1];
+            if (!is_occupied(index, slot) && imgfs_file->metadata[slot].is_valid == EMPTY) {
+                return slot;
+            }
+            --index->nb_free;
+        }
+    }
+
+    for (uint32_t i = 0; i < max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid == EMPTY) return i;
+    }
+    return max_files;
+}
+
+/**********************************************************************
+ * Registers an entry.
+ */
+void imgfs_index_add(struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    if (imgfs_file == NULL || imgfs_file->index == NULL) return;
+    if (slot >= imgfs_file->header.max_files) return;
+
+    struct imgfs_index* index = imgfs_file->index;
+    const struct img_metadata* metadata = &imgfs_file->metadata[slot];
+    table_add(index->by_id, index->mask, hash_of_id(metadata), slot);
+    table_add(index->by_sha, index->mask, hash_of_sha(metadata), slot);
+
+    if (!is_occupied(index, slot)) {
+        set_occupied(index, slot, 1);
+        for (int res = 0; res < NB_RES; ++res) {
+            imgfs_index_ref_blob(imgfs_file, slot, res);
+        }
+    }
+    if (index->nb_free > 0 && index->free_slots[index->nb_free - 1] == slot) {
+        --index->nb_free;
+    }
+}
+
+/**********************************************************************
+ * Unregisters an entry.
+ */
+void imgfs_index_remove(struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    if (imgfs_file == NULL || imgfs_file->index == NULL) return;
+    if (slot >= imgfs_file->header.max_files) return;
+
+    struct imgfs_index* index = imgfs_file->index;
+    table_remove(index->by_id, index->mask, imgfs_file->metadata, hash_of_id, slot);
+    table_remove(index->by_sha, index->mask, imgfs_file->metadata, hash_of_sha, slot);
+
+    if (is_occupied(index, slot)) {
+        for (int res = 0; res < NB_RES; ++res) {
+            imgfs_index_unref_blob(imgfs_file, slot, res);
+        }
+        set_occupied(index, slot, 0);
+        if (index->nb_free == imgfs_file->header.max_files) {
+            // Full of stale slots: start again from the bitmap (which includes slot)
+            refill_free_slots(index, imgfs_file->header.max_files);
+        } else {
+            index->free_slots[index->nb_free++] = slot;
+        }
+    }
+}
+
+/**********************************************************************
+ * Counts a reference to the content of an entry.
+ */
+void imgfs_index_ref_blob(struct imgfs_file* imgfs_file, uint32_t slot, int resolution)
+{
+    if (imgfs_file == NULL || imgfs_file->index == NULL) return;
+    if (slot >= imgfs_file->header.max_files || resolution < 0 || resolution >= NB_RES) return;
+    if (!is_occupied(imgfs_file->index, slot)) return;
+
+    const struct img_metadata* metadata = &imgfs_file->metadata[slot];
+    if (metadata->size[resolution] == 0) return;
+    blob_ref(imgfs_file->index, metadata->offset[resolution], metadata->size[resolution]);
+}
+
+/**********************************************************************
+ * Drops a reference to the content of an entry.
+ */
+void imgfs_index_unref_blob(struct imgfs_file* imgfs_file, uint32_t slot, int resolution)
+{
+    if (imgfs_file == NULL || imgfs_file->index == NULL) return;
+    if (slot >= imgfs_file->header.max_files || resolution < 0 || resolution >= NB_RES) return;
+    if (!is_occupied(imgfs_file->index, slot)) return;
+
+    const struct img_metadata* metadata = &imgfs_file->metadata[slot];
+    if (metadata->size[resolution] == 0) return;
+    blob_unref(imgfs_file->index, metadata->offset[resolution], metadata->size[resolution]);
+}
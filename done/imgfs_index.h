@@ -0,0 +1,199 @@
+/**
+ * @file imgfs_index.h
+ * @brief In-memory lookup tables over the metadata array.
+ *
+ * The tables are never written to disk: do_open() (and do_create())
+ * builds them from the metadata, and do_insert()/do_delete() keep them
+ * in sync. Every table stores metadata slot numbers, and every lookup
+ * double-checks the slot against the metadata itself, so a stale bucket
+ * can never yield a wrong answer.
+ *
+ * The reference counts of the blobs (content shared by deduplication)
+ * are not persisted either: the header has no room for them, and a
+ * sidecar table would have to be kept crash-consistent with the
+ * metadata they are derived from. Rebuilding them costs no more than
+ * the other tables.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Reference count of one blob (image content at one resolution),
+ *        identified by its offset and size.
+ */
+struct imgfs_blob_ref {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t refs; // Number of valid entries using the blob (0 for an empty bucket)
+};
+
+/**
+ * @brief Lookup tables attached to an opened imgFS (see imgfs_file.index).
+ *
+ * The hash tables use open addressing with linear probing. A bucket holds
+ * (slot + 1), so that 0 can mark an empty bucket. The number of buckets
+ * is a power of two at least twice max_files, hence probes always end on
+ * an empty bucket.
+ *
+ * The blob table (same probing, blob_mask + 1 buckets, at least twice
+ * NB_RES * max_files) counts the valid entries using each blob.
+ *
+ * The occupancy bitmap has one bit per slot, set for valid entries. The
+ * free-slot stack holds empty slots (lowest on top right after building,
+ * then last freed on top); it may also hold stale slots, since reused,
+ * which are skipped thanks to the bitmap.
+ */
+struct imgfs_index {
+    size_t mask;          // Number of buckets minus one (same for every table)
+    uint32_t* by_id;      // img_id -> slot, for valid entries only
+    uint32_t* by_sha;     // SHA -> slot, for valid entries only (several entries may share a SHA)
+    uint64_t* occupied;   // Bit (slot % 64) of word (slot / 64) is set iff the entry is valid
+    uint32_t* free_slots; // Stack of empty slots (max_files capacity)
+    uint32_t nb_free;     // Number of slots on the stack
+    struct imgfs_blob_ref* blobs; // (offset, size) -> number of valid entries using the blob
+    size_t blob_mask;     // Number of buckets of the blob table minus one
+};
+
+/**
+ * @brief Allocates and fills the lookup tables from the metadata.
+ *
+ * imgfs_file->index must be NULL or point to previously built tables
+ * (which are then freed first).
+ *
+ * @param imgfs_file The main in-memory structure, with metadata loaded
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_index_build(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Frees the lookup tables (if any) and resets imgfs_file->index.
+ *
+ * @param imgfs_file The main in-memory structure
+ */
+void imgfs_index_free(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Finds the valid metadata entry with the given image ID.
+ *
+ * Falls back to a linear scan if no index has been built.
+ *
+ * @param imgfs_file The main in-memory structure (non-NULL)
+ * @param img_id The image ID to look for (non-NULL)
+ * @return The slot of the entry, or header.max_files if there is none.
+ */
+uint32_t imgfs_index_find_id(const struct imgfs_file* imgfs_file, const char* img_id);
+
+/**
+ * @brief Finds another valid metadata entry with the same image ID as slot.
+ *
+ * @param imgfs_file The main in-memory structure (non-NULL)
+ * @param slot The order number in the metadata array (< header.max_files)
+ * @return The slot of the other entry, or header.max_files if there is none.
+ */
+uint32_t imgfs_index_find_same_id(const struct imgfs_file* imgfs_file, uint32_t slot);
+
+/**
+ * @brief Finds another valid metadata entry with the same content (SHA) as slot.
+ *
+ * @param imgfs_file The main in-memory structure (non-NULL)
+ * @param slot The order number in the metadata array (< header.max_files)
+ * @return The slot of the other entry, or header.max_files if there is none.
+ */
+uint32_t imgfs_index_find_same_sha(const struct imgfs_file* imgfs_file, uint32_t slot);
+
+/**
+ * @brief Counts the valid metadata entries using a blob, in O(1).
+ *
+ * Falls back to a linear scan if no index has been built.
+ *
+ * @param imgfs_file The main in-memory structure (non-NULL)
+ * @param offset The offset of the blob in the file
+ * @param size The size of the blob
+ * @return The number of references to the blob, one per (valid entry, resolution) using it.
+ */
+uint32_t imgfs_index_blob_refs(const struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size);
+
+/**
+ * @brief Finds the first valid metadata entry at or after slot from.
+ *
+ * Skips 64 empty slots at a time thanks to the occupancy bitmap, so that
+ * walking over all valid entries costs O(nb_files + max_files / 64).
+ * Falls back to a linear scan if no index has been built.
+ *
+ * Typical use:
+ *     for (uint32_t i = imgfs_index_next_valid(file, 0); i < max_files;
+ *          i = imgfs_index_next_valid(file, i + 1)) { ... }
+ *
+ * @param imgfs_file The main in-memory structure (non-NULL)
+ * @param from The first slot to consider
+ * @return The slot of the entry, or header.max_files if there is none.
+ */
+uint32_t imgfs_index_next_valid(const struct imgfs_file* imgfs_file, uint32_t from);
+
+/**
+ * @brief Finds an empty metadata entry in O(1), from the free-slot stack.
+ *
+ * The slot is only taken off the free-slot stack once registered with
+ * imgfs_index_add(), so a failed insertion does not lose it.
+ * Falls back to a linear scan if no index has been built.
+ *
+ * @param imgfs_file The main in-memory structure (non-NULL)
+ * @return The slot of the entry, or header.max_files if there is none.
+ */
+uint32_t imgfs_index_free_slot(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Registers a (newly valid) metadata entry in the lookup tables.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param slot The order number in the metadata array
+ */
+void imgfs_index_add(struct imgfs_file* imgfs_file, uint32_t slot);
+
+/**
+ * @brief Unregisters a metadata entry from the lookup tables.
+ *
+ * Must be called while the entry still holds the img_id and SHA it was
+ * registered with.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param slot The order number in the metadata array
+ */
+void imgfs_index_remove(struct imgfs_file* imgfs_file, uint32_t slot);
+
+/**
+ * @brief Counts one more reference to the content of a registered entry
+ *        at a resolution, once set (e.g. by lazily_resize()).
+ *
+ * Does nothing if the entry is not registered or has no such content.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param slot The order number in the metadata array
+ * @param resolution The resolution of the content
+ */
+void imgfs_index_ref_blob(struct imgfs_file* imgfs_file, uint32_t slot, int resolution);
+
+/**
+ * @brief Counts one reference less to the content of a registered entry
+ *        at a resolution, before it changes (e.g. when it is relocated).
+ *
+ * Does nothing if the entry is not registered or has no such content.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param slot The order number in the metadata array
+ * @param resolution The resolution of the content
+ */
+void imgfs_index_unref_blob(struct imgfs_file* imgfs_file, uint32_t slot, int resolution);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,26 +1,25 @@
+#define _GNU_SOURCE // for fallocate
+
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "util.h"
 #include "image_dedup.h"
 #include "image_content.h"
 
+#include <fcntl.h>        // for fallocate
+#include <linux/falloc.h> // for FALLOC_FL_PUNCH_HOLE, FALLOC_FL_KEEP_SIZE
 #include <string.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <sys/mman.h>     // for mmap
+#include <sys/stat.h>     // for fstat
+#include <unistd.h>       // for ftruncate, sysconf
 
-/**
- * @brief Insert image in the imgFS file
- *
- * @param buffer Pointer to the raw image content
- * @param size Image size
- * @param img_id Image ID
- * @return Some error code. 0 if no error.
+/*******************************************************************
+ * Checks that an image img_id may be added, and finds a free entry for it.
  */
-int do_insert(const char* image_buffer, size_t image_size,
-              const char* img_id, struct imgfs_file* imgfs_file)
+static int find_free_entry(struct imgfs_file* imgfs_file, const char* img_id, size_t* index)
 {
-    M_REQUIRE_NON_NULL(image_buffer);
-    M_REQUIRE_NON_NULL(img_id);
-    M_REQUIRE_NON_NULL(imgfs_file);
-
     if (imgfs_file->header.nb_files >= imgfs_file->header.max_files) {
         return ERR_IMGFS_FULL;
     }
@@ -28,52 +27,106 @@ int do_insert(const char* image_buffer, size_t image_size,
     //-----------------------------------------------------------------
     // Check if there is an image with the same ID
     //-----------------------------------------------------------------
-    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
-        if (imgfs_file->metadata[i].is_valid == NON_EMPTY &&
-            strncmp(imgfs_file->metadata[i].img_id, img_id, MAX_IMG_ID) == 0) {
-            return ERR_DUPLICATE_ID;
-        }
+    if (imgfs_index_find_id(imgfs_file, img_id) != imgfs_file->header.max_files) {
+        return ERR_DUPLICATE_ID;
     }
 
     //-----------------------------------------------------------------
     //              Find a free position in the index
     //-----------------------------------------------------------------
-    size_t index = imgfs_file->header.max_files;
-    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
-        // Find empty metadata
-        if (imgfs_file->metadata[i].is_valid == EMPTY) {
-            index = i;
-            break;
-        }
-    }
+    *index = imgfs_index_free_slot(imgfs_file);
 
     // No empty metadata found
-    if (index == imgfs_file->header.max_files) return ERR_IMGFS_FULL;
-
-    // -----------------------------------------------------------------
-    //                     Update metadata fields
-    // -----------------------------------------------------------------
+    if (*index == imgfs_file->header.max_files) return ERR_IMGFS_FULL;
 
-    unsigned char sha_digest[SHA256_DIGEST_LENGTH];
-    SHA256((const unsigned char*) image_buffer, image_size, sha_digest);
-    memcpy(imgfs_file->metadata[index].SHA, sha_digest, SHA256_DIGEST_LENGTH);
+    return ERR_NONE;
+}
 
-    strncpy(imgfs_file->metadata[index].img_id, img_id, MAX_IMG_ID);
+/*******************************************************************
+ * Fills the free entry index for the image, then deduplicates it: its
+ * offset[ORIG_RES] is left to 0 if no other image has the same content.
+ */
+static int describe_image(struct imgfs_file* imgfs_file, size_t index, const char* img_id,
+                          const unsigned char* sha_digest, const char* image_buffer, size_t image_size)
+{
+    struct img_metadata* metadata = &imgfs_file->metadata[index];
 
-    imgfs_file->metadata[index].size[ORIG_RES] = (uint32_t)image_size;
+    memcpy(metadata->SHA, sha_digest, SHA256_DIGEST_LENGTH);
+    strncpy(metadata->img_id, img_id, MAX_IMG_ID);
+    metadata->size[ORIG_RES] = (uint32_t)image_size;
 
     uint32_t width, height;
     int resolution_error = get_resolution(&height, &width, image_buffer, image_size);
     if (resolution_error != ERR_NONE) return resolution_error;
-    imgfs_file->metadata[index].orig_res[0] = width;
-    imgfs_file->metadata[index].orig_res[1] = height;
+    metadata->orig_res[0] = width;
+    metadata->orig_res[1] = height;
 
     //-----------------------------------------------------------------
     //                      Image deduplication
     //-----------------------------------------------------------------
 
-    int dedup_error = do_name_and_content_dedup(imgfs_file, (uint32_t)index);
-    if (dedup_error != ERR_NONE) return dedup_error;
+    return do_name_and_content_dedup(imgfs_file, (uint32_t)index);
+}
+
+/*******************************************************************
+ * Makes the entry index point to its own content, stored at offset.
+ */
+static void set_content(struct img_metadata* metadata, uint64_t offset, size_t image_size)
+{
+    metadata->offset[ORIG_RES] = offset;
+    metadata->size[ORIG_RES] = (uint32_t)image_size;
+
+    metadata->offset[THUMB_RES] = 0;
+    metadata->size[THUMB_RES] = 0;
+    metadata->offset[SMALL_RES] = 0;
+    metadata->size[SMALL_RES] = 0;
+}
+
+/*******************************************************************
+ * Makes the described entry index valid, and writes it back with the header.
+ */
+static int add_entry(struct imgfs_file* imgfs_file, size_t index)
+{
+    imgfs_file->metadata[index].is_valid = NON_EMPTY;
+    imgfs_index_add(imgfs_file, (uint32_t)index);
+
+    //-----------------------------------------------------------------
+    //                  Update image database data
+    //-----------------------------------------------------------------
+
+    imgfs_file->header.nb_files++;
+    imgfs_file->header.version++;
+
+    const int err = imgfs_write_header(imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    return imgfs_write_metadata(imgfs_file, (uint32_t)index);
+}
+
+/**
+ * @brief Insert image in the imgFS file
+ *
+ * @param buffer Pointer to the raw image content
+ * @param size Image size
+ * @param img_id Image ID
+ * @return Some error code. 0 if no error.
+ */
+int do_insert(const char* image_buffer, size_t image_size,
+              const char* img_id, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    size_t index = 0;
+    int err = find_free_entry(imgfs_file, img_id, &index);
+    if (err != ERR_NONE) return err;
+
+    unsigned char sha_digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*) image_buffer, image_size, sha_digest);
+
+    err = describe_image(imgfs_file, index, img_id, sha_digest, image_buffer, image_size);
+    if (err != ERR_NONE) return err;
 
     //-----------------------------------------------------------------
     //                Writing the image to the disk
@@ -81,34 +134,172 @@ int do_insert(const char* image_buffer, size_t image_size,
 
     // Write the image to the disk if it does not exist yet
     if (imgfs_file->metadata[index].offset[ORIG_RES] == 0) {
-        if (fseek(imgfs_file->file, 0, SEEK_END) != 0) return ERR_IO;
-        long file_offset = ftell(imgfs_file->file);
-        if (fwrite(image_buffer, image_size, 1, imgfs_file->file) != 1) return ERR_IO;
+        uint64_t file_offset = 0;
+        err = imgfs_append(imgfs_file, image_buffer, image_size, &file_offset);
+        if (err != ERR_NONE) return err;
+
+        set_content(&imgfs_file->metadata[index], file_offset, image_size);
+    }
 
-        imgfs_file->metadata[index].offset[ORIG_RES] = (uint64_t)file_offset;
-        imgfs_file->metadata[index].size[ORIG_RES] = (uint32_t)image_size;
+    return add_entry(imgfs_file, index);
+}
 
-        imgfs_file->metadata[index].offset[THUMB_RES] = 0;
-        imgfs_file->metadata[index].size[THUMB_RES] = 0;
-        imgfs_file->metadata[index].offset[SMALL_RES] = 0;
-        imgfs_file->metadata[index].size[SMALL_RES] = 0;
+/*******************************************************************
+ * Starts the insertion of an image whose content arrives piece by piece.
+ */
+int do_insert_begin(const char* img_id, size_t image_size,
+                    struct imgfs_file* imgfs_file, struct imgfs_upload* upload)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(upload);
+
+    memset(upload, 0, sizeof(*upload));
+    if (image_size == 0 || image_size > UINT32_MAX) return ERR_INVALID_ARGUMENT;
+
+    // Fail early, before the content is sent; do_insert_commit() checks again
+    size_t index = 0;
+    const int err = find_free_entry(imgfs_file, img_id, &index);
+    if (err != ERR_NONE) return err;
+
+    // Reserves the space right after the end of the file
+    const int fd = fileno(imgfs_file->file);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 0) return ERR_IO;
+    const uint64_t offset = (uint64_t) st.st_size;
+    if (ftruncate(fd, (off_t) (offset + image_size)) != 0) return ERR_IO;
+
+    EVP_MD_CTX* sha = EVP_MD_CTX_new();
+    if (sha == NULL || EVP_DigestInit_ex(sha, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(sha);
+        (void) ftruncate(fd, (off_t) offset);
+        return ERR_OUT_OF_MEMORY;
     }
 
-    imgfs_file->metadata[index].is_valid = NON_EMPTY;
+    strncpy(upload->img_id, img_id, MAX_IMG_ID);
+    upload->offset = offset;
+    upload->size = (uint32_t) image_size;
+    upload->sha = sha;
 
-    //-----------------------------------------------------------------
-    //                  Update image database data
-    //-----------------------------------------------------------------
+    ++imgfs_file->nb_uploads;
+    imgfs_file->uploads_end = MAX(imgfs_file->uploads_end, offset + image_size);
 
-    imgfs_file->header.nb_files++;
-    imgfs_file->header.version++;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Writes the next piece of the content of an upload.
+ */
+int do_insert_write(struct imgfs_upload* upload, const void* data, size_t len,
+                    const struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(upload);
+    M_REQUIRE_NON_NULL(upload->sha);
+    M_REQUIRE_NON_NULL(data);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    if (len > upload->size - upload->written) return ERR_INVALID_ARGUMENT;
+
+    const int err = imgfs_write_at(imgfs_file, data, len, upload->offset + upload->written);
+    if (err != ERR_NONE) return err;
+
+    if (EVP_DigestUpdate(upload->sha, data, len) != 1) return ERR_RUNTIME;
+    upload->written += (uint32_t) len;
+
+    return ERR_NONE;
+}
 
-    if (fseek(imgfs_file->file, 0, SEEK_SET) != 0) return ERR_IO;
-    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) return ERR_IO;
+/*******************************************************************
+ * Ends an upload, giving its space back unless its content is kept:
+ * cut off if it ends the file, else freed (best effort: it stays dead
+ * if this fails, until compacted).
+ */
+static void end_upload(struct imgfs_upload* upload, struct imgfs_file* imgfs_file, int keep)
+{
+    EVP_MD_CTX_free(upload->sha);
+    upload->sha = NULL;
 
-    if (fseek(imgfs_file->file, (long)(sizeof(struct imgfs_header) + index * sizeof(struct img_metadata)), SEEK_SET) != 0) return ERR_IO;
-    if (fwrite(&imgfs_file->metadata[index], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) return ERR_IO;
+    if (!keep) {
+        const int fd = fileno(imgfs_file->file);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (uint64_t) st.st_size == upload->offset + upload->size) {
+            (void) ftruncate(fd, (off_t) upload->offset);
+        } else {
+            // No entry ever referred to it: no need to sync anything first
+            (void) fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                             (off_t) upload->offset, (off_t) upload->size);
+        }
+    }
 
+    if (imgfs_file->nb_uploads > 0 && --imgfs_file->nb_uploads == 0) {
+        imgfs_file->uploads_end = 0;
+    }
+}
+
+/*******************************************************************
+ * Maps the content of an upload to read it (its start being page aligned).
+ */
+static int map_upload(const struct imgfs_upload* upload, const struct imgfs_file* imgfs_file,
+                      void** map, size_t* map_size)
+{
+    const uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    const uint64_t start = upload->offset - upload->offset % page_size;
+    *map_size = (size_t) (upload->offset + upload->size - start);
+    *map = mmap(NULL, *map_size, PROT_READ, MAP_SHARED, fileno(imgfs_file->file), (off_t) start);
+    if (*map == MAP_FAILED) {
+        *map = NULL;
+        return ERR_IO;
+    }
     return ERR_NONE;
 }
 
+/*******************************************************************
+ * Ends an upload by inserting its image.
+ */
+int do_insert_commit(struct imgfs_upload* upload, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(upload);
+    M_REQUIRE_NON_NULL(upload->sha);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    int err = upload->written == upload->size ? ERR_NONE : ERR_INVALID_ARGUMENT;
+
+    unsigned char sha_digest[SHA256_DIGEST_LENGTH];
+    if (err == ERR_NONE && EVP_DigestFinal_ex(upload->sha, sha_digest, NULL) != 1) err = ERR_RUNTIME;
+
+    size_t index = 0;
+    if (err == ERR_NONE) err = find_free_entry(imgfs_file, upload->img_id, &index);
+
+    // The resolution is read from the file: the content is never copied
+    void* map = NULL;
+    size_t map_size = 0;
+    if (err == ERR_NONE) err = map_upload(upload, imgfs_file, &map, &map_size);
+    if (err == ERR_NONE) {
+        const char* content = (const char*) map + (map_size - upload->size);
+        err = describe_image(imgfs_file, index, upload->img_id, sha_digest, content, upload->size);
+        munmap(map, map_size);
+    }
+
+    int keep = 0;
+    if (err == ERR_NONE) {
+        if (imgfs_file->metadata[index].offset[ORIG_RES] == 0) {
+            set_content(&imgfs_file->metadata[index], upload->offset, upload->size);
+            keep = 1;
+        }
+        err = add_entry(imgfs_file, index);
+    }
+
+    end_upload(upload, imgfs_file, keep);
+    return err;
+}
+
+/*******************************************************************
+ * Ends an upload without inserting its image.
+ */
+void do_insert_abort(struct imgfs_upload* upload, struct imgfs_file* imgfs_file)
+{
+    if (upload == NULL || upload->sha == NULL || imgfs_file == NULL || imgfs_file->file == NULL) return;
+    end_upload(upload, imgfs_file, 0);
+}
@@ -1,4 +1,5 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "util.h"
 
 #include <stdio.h>
@@ -25,11 +26,10 @@ int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode,
         if(imgfs_file->header.nb_files <= 0) {
             printf("<< empty imgFS >>\n");
         } else {
-            for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
-                // Print only valid metadata
-                if (imgfs_file->metadata[i].is_valid == NON_EMPTY) {
-                    print_metadata(&imgfs_file->metadata[i]);
-                }
+            // Print only valid metadata
+            for (uint32_t i = imgfs_index_next_valid(imgfs_file, 0); i < imgfs_file->header.max_files;
+                 i = imgfs_index_next_valid(imgfs_file, i + 1)) {
+                print_metadata(&imgfs_file->metadata[i]);
             }
         }
         break;
@@ -43,17 +43,16 @@ int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode,
             return ERR_RUNTIME;
         }
 
-        for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
-            // Add only valid metadata
-            if (imgfs_file->metadata[i].is_valid == NON_EMPTY) {
-                json_object* jstring = json_object_new_string(imgfs_file->metadata[i].img_id);
-                if (jstring == NULL) {
-                    json_object_put(jobj);  // Free the JSON object
-                    json_object_put(jarray);  // Free the JSON array
-                    return ERR_RUNTIME;
-                }
-                json_object_array_add(jarray, jstring);
+        // Add only valid metadata
+        for (uint32_t i = imgfs_index_next_valid(imgfs_file, 0); i < imgfs_file->header.max_files;
+             i = imgfs_index_next_valid(imgfs_file, i + 1)) {
+            json_object* jstring = json_object_new_string(imgfs_file->metadata[i].img_id);
+            if (jstring == NULL) {
+                json_object_put(jobj);  // Free the JSON object
+                json_object_put(jarray);  // Free the JSON array
+                return ERR_RUNTIME;
             }
+            json_object_array_add(jarray, jstring);
         }
 
         json_object_object_add(jobj, "Images", jarray);
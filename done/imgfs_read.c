@@ -1,35 +1,31 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "image_content.h"
 
 #include <stdlib.h>
 #include <string.h>
 
 /**
- * @brief Reads the content of an image from a imgFS.
+ * @brief Finds where the content of an image is in a imgFS.
  *
  * @param img_id The ID of the image to be read.
  * @param resolution The desired resolution for the image read.
- * @param image_buffer Location of the location of the image content
- * @param image_size Location of the image size variable
+ * @param offset Location of the position of the image content in the file
+ * @param size Location of the image size variable
  * @param imgfs_file The main in-memory data structure
  * @return Some error code. 0 if no error.
  */
-int do_read(const char* img_id, int resolution, char** image_buffer,
-            uint32_t* image_size, struct imgfs_file* imgfs_file)
+int do_read_location(const char* img_id, int resolution, uint64_t* offset,
+                     uint32_t* size, struct imgfs_file* imgfs_file)
 {
     M_REQUIRE_NON_NULL(img_id);
-    M_REQUIRE_NON_NULL(image_buffer);
-    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(offset);
+    M_REQUIRE_NON_NULL(size);
     M_REQUIRE_NON_NULL(imgfs_file);
+    if (resolution < 0 || resolution >= NB_RES) return ERR_RESOLUTIONS;
 
     // Find the image with the right img_id
-    size_t index = imgfs_file->header.max_files;
-    for (size_t i = 0; i < imgfs_file->header.max_files; ++i) {
-        if (strncmp(img_id, imgfs_file->metadata[i].img_id, MAX_IMG_ID) == 0) {
-            index = i;
-            break;
-        }
-    }
+    const size_t index = imgfs_index_find_id(imgfs_file, img_id);
 
     // There is no image with the requested img_id
     if (index == imgfs_file->header.max_files) return ERR_IMAGE_NOT_FOUND;
@@ -37,32 +33,54 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
     // Check if the image already exists in the requested resolution
     // If not, resize it to the resolution
     if (imgfs_file->metadata[index].size[resolution] == 0) {
-        lazily_resize(resolution, imgfs_file, index);
+        const int err = lazily_resize(resolution, imgfs_file, index);
+        if (err != ERR_NONE) return err;
     }
 
     // At this point, the position of the image in the file is known and so is its size
-    size_t offset = imgfs_file->metadata[index].offset[resolution];
-    size_t size = imgfs_file->metadata[index].size[resolution];
+    *offset = imgfs_file->metadata[index].offset[resolution];
+    *size = imgfs_file->metadata[index].size[resolution];
+
+    return ERR_NONE;
+}
+
+/**
+ * @brief Reads the content of an image from a imgFS.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param image_buffer Location of the location of the image content
+ * @param image_size Location of the image size variable
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read(const char* img_id, int resolution, char** image_buffer,
+            uint32_t* image_size, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    int err = do_read_location(img_id, resolution, &offset, &size, imgfs_file);
+    if (err != ERR_NONE) return err;
 
     // Allocate memory for the image content
     *image_buffer = calloc(1, size);
     if (*image_buffer == NULL) return ERR_OUT_OF_MEMORY;
 
-    // Read the image content from the file
-    // Move the file pointer to the right position
-    if (fseek(imgfs_file->file, (long)offset, SEEK_SET) != 0) {
-        free(*image_buffer);
-        return ERR_IO;
-    }
-
-    // Read the image content into the buffer
-    if (fread(*image_buffer, size, 1, imgfs_file->file) != 1) {
+    // Read the image content from the file (positional: concurrent readers do not interfere)
+    err = imgfs_read_at(imgfs_file, *image_buffer, size, offset);
+    if (err != ERR_NONE) {
         free(*image_buffer);
-        return ERR_IO;
+        *image_buffer = NULL;
+        return err;
     }
 
     // Update the output parameter
-    *image_size = (uint32_t)size;
+    *image_size = size;
 
     return ERR_NONE;
 }
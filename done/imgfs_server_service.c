@@ -9,10 +9,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // uint16_t
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
+#include "imgfs_index.h"
+#include "imgfs_compact.h"
+#include "image_content.h"
 #include "http_net.h"
 #include "imgfs_server_service.h"
 
@@ -20,13 +27,321 @@
 static struct imgfs_file fs_file;
 static uint16_t server_port;
 
+// Guards fs_file: reads share it, while insert, delete, the storage of a
+// missing resolution and the compaction commits own it
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Image contents being read for a reply after fs_lock is released (see
+// http_reply_file()): writers wait for them, as they may move or free content
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t none;
+    size_t count;
+} file_reads = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+
+// Insert whose content goes to the imgFS file as it arrives (see struct http_body_stream)
+struct insert_stream {
+    int err;            // First error, replied once all the content is received
+    int started;        // Whether upload is in progress
+    int eager_variants; // Whether to create the resized resolutions once inserted (see get_variants_mode())
+    struct imgfs_upload upload;
+    struct insert_stream* next;
+};
+
+// Inserts whose connection got closed: aborting them takes fs_lock, which
+// the thread receiving the requests must never wait for, so the next
+// holder of fs_lock for writing does it
+static struct {
+    pthread_mutex_t lock;
+    struct insert_stream* list;
+} aborted_inserts = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+// Online compaction (see imgfs_compact.h), enabled with -compact and/or -compact_threshold
+#define COMPACT_DEFAULT_BUDGET_MS    50 // p99 read latency budget if only -compact_threshold is given
+#define COMPACT_STEP_SIZE    (256 * 1024) // Bytes copied between two pauses
+#define COMPACT_PAUSE_MIN_US       1000 // Pause between two steps while reads are fast enough
+#define COMPACT_PAUSE_MAX_US    1000000 // Longest pause while reads are too slow
+#define COMPACT_IDLE_US         5000000 // Pause when there is nothing to compact
+#define NB_LATENCY_SAMPLES          128 // Number of recent reads the p99 is computed on
+
+static struct {
+    pthread_t thread;
+    int running;
+    atomic_int stop;
+    uint64_t budget_us;     // Budget for the p99 read latency
+    uint32_t threshold;     // Dead ratio (in %) from which a compaction pass starts (0: always)
+
+    pthread_mutex_t samples_lock;
+    uint64_t latencies_us[NB_LATENCY_SAMPLES]; // Ring buffer of the latest read latencies
+    size_t nb_samples;
+    size_t next_sample;
+} compaction = { .samples_lock = PTHREAD_MUTEX_INITIALIZER };
+
 #define MAX_RESOLUTION 10
+#define MAX_VARIANTS_MODE 8
 
 #define URI_ROOT "/imgfs"
 
+/**********************************************************************
+ * Monotonic time, in microseconds.
+ ********************************************************************** */
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/**********************************************************************
+ * Records the latency of one read call (lock wait included).
+ ********************************************************************** */
+static void record_read_latency(uint64_t latency_us)
+{
+    pthread_mutex_lock(&compaction.samples_lock);
+    compaction.latencies_us[compaction.next_sample] = latency_us;
+    compaction.next_sample = (compaction.next_sample + 1) % NB_LATENCY_SAMPLES;
+    if (compaction.nb_samples < NB_LATENCY_SAMPLES) ++compaction.nb_samples;
+    pthread_mutex_unlock(&compaction.samples_lock);
+}
+
+static int compare_latencies(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a;
+    const uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**********************************************************************
+ * 99th percentile of the recent read latencies (0 if none).
+ ********************************************************************** */
+static uint64_t read_latency_p99(void)
+{
+    uint64_t samples[NB_LATENCY_SAMPLES];
+
+    pthread_mutex_lock(&compaction.samples_lock);
+    const size_t nb_samples = compaction.nb_samples;
+    memcpy(samples, compaction.latencies_us, nb_samples * sizeof(uint64_t));
+    pthread_mutex_unlock(&compaction.samples_lock);
+
+    if (nb_samples == 0) return 0;
+    qsort(samples, nb_samples, sizeof(uint64_t), compare_latencies);
+    return samples[(nb_samples * 99 + 99) / 100 - 1];
+}
+
+/**********************************************************************
+ * Waits until no image content is being read for a reply. Called with
+ * fs_lock taken for writing, so that no new read starts meanwhile. The
+ * pending ones never wait for fs_lock nor for the client: in the event
+ * loop modes they complete in the thread running http_receive() (the
+ * handlers run in the workers), in blocking mode http_reply_file() ends
+ * them before sending anything blocking.
+ ********************************************************************** */
+static void wait_file_reads(void)
+{
+    pthread_mutex_lock(&file_reads.lock);
+    while (file_reads.count > 0) pthread_cond_wait(&file_reads.none, &file_reads.lock);
+    pthread_mutex_unlock(&file_reads.lock);
+}
+
+/**********************************************************************
+ * Gives back the content of the aborted inserts. Called with fs_lock
+ * taken for writing.
+ ********************************************************************** */
+static void end_aborted_inserts(void)
+{
+    pthread_mutex_lock(&aborted_inserts.lock);
+    struct insert_stream* stream = aborted_inserts.list;
+    aborted_inserts.list = NULL;
+    pthread_mutex_unlock(&aborted_inserts.lock);
+
+    while (stream != NULL) {
+        struct insert_stream* const next = stream->next;
+        do_insert_abort(&stream->upload, &fs_file);
+        free(stream);
+        stream = next;
+    }
+}
+
+/**********************************************************************
+ * Takes fs_lock for writing.
+ ********************************************************************** */
+static void fs_write_lock(void)
+{
+    pthread_rwlock_wrlock(&fs_lock);
+    wait_file_reads();
+    end_aborted_inserts();
+}
+
+/**********************************************************************
+ * Takes fs_lock for the resize service (see resize_service_start()).
+ ********************************************************************** */
+static void resize_lock(int exclusive)
+{
+    if (exclusive) fs_write_lock();
+    else pthread_rwlock_rdlock(&fs_lock);
+}
+
+/**********************************************************************
+ * Releases fs_lock for the resize service.
+ ********************************************************************** */
+static void resize_unlock(void)
+{
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+/**********************************************************************
+ * Called once the content of a read call is read (arg being when the
+ * call started).
+ ********************************************************************** */
+static void file_read_done(void* arg)
+{
+    record_read_latency(now_us() - (uint64_t) (uintptr_t) arg);
+
+    pthread_mutex_lock(&file_reads.lock);
+    if (--file_reads.count == 0) pthread_cond_broadcast(&file_reads.none);
+    pthread_mutex_unlock(&file_reads.lock);
+}
+
+/**********************************************************************
+ * Sleeps (by slices, so that a shutdown is not delayed).
+ ********************************************************************** */
+static void compaction_pause(uint64_t pause_us)
+{
+    while (pause_us > 0 && !atomic_load(&compaction.stop)) {
+        const uint64_t slice = MIN(pause_us, (uint64_t) 100000);
+        const struct timespec ts = { .tv_sec = 0, .tv_nsec = (long) slice * 1000 };
+        nanosleep(&ts, NULL);
+        pause_us -= slice;
+    }
+}
+
+/**********************************************************************
+ * Takes fs_lock (for writing if exclusive, else for reading), unless the
+ * server shuts down meanwhile. Returns whether the lock is taken.
+ ********************************************************************** */
+static int compaction_lock(int exclusive)
+{
+    while (!atomic_load(&compaction.stop)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (!exclusive && pthread_rwlock_timedrdlock(&fs_lock, &deadline) == 0) return 1;
+        if (exclusive && pthread_rwlock_timedwrlock(&fs_lock, &deadline) == 0) {
+            wait_file_reads();
+            end_aborted_inserts();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************
+ * Online compaction: relocates one blob at a time, copying it by bounded
+ * steps without the lock, and backs off while the p99 read latency is
+ * over budget.
+ ********************************************************************** */
+static void* compaction_thread(void* arg _unused)
+{
+    uint64_t pause_us = COMPACT_PAUSE_MIN_US;
+    int pass = 0; // Whether a compaction pass is running (until nothing is left to relocate)
+
+    while (!atomic_load(&compaction.stop)) {
+        struct imgfs_relocation relocation;
+        int err = ERR_NONE;
+
+        // The statistics and the plan only read the metadata
+        if (!compaction_lock(0)) break;
+        if (!pass && compaction.threshold > 0) {
+            // Start a pass only once it pays off
+            struct imgfs_stats stats;
+            err = imgfs_get_stats(&fs_file, &stats);
+            const double dead_ratio = imgfs_dead_ratio(&stats);
+            if (err == ERR_NONE && 100.0 * dead_ratio >= compaction.threshold) {
+                fprintf(stderr, "Compaction: %.1f%% of the content is dead, starting\n", 100.0 * dead_ratio);
+                pass = 1;
+            }
+        } else {
+            pass = 1;
+        }
+        if (!pass) {
+            pthread_rwlock_unlock(&fs_lock);
+            if (err != ERR_NONE) fprintf(stderr, "Compaction: %s\n", ERR_MSG(err));
+            compaction_pause(COMPACT_IDLE_US);
+            continue;
+        }
+
+        err = imgfs_compact_plan(&fs_file, &relocation);
+        pthread_rwlock_unlock(&fs_lock);
+        if (err == ERR_NONE && relocation.size == 0) {
+            if (!compaction_lock(1)) break;
+            err = imgfs_compact_commit(&fs_file, &relocation); // Dead end of the file only
+            pthread_rwlock_unlock(&fs_lock);
+            pass = 0;
+        }
+
+        if (err != ERR_NONE || relocation.size == 0) {
+            if (err != ERR_NONE) fprintf(stderr, "Compaction: %s\n", ERR_MSG(err));
+            compaction_pause(COMPACT_IDLE_US);
+            continue;
+        }
+
+        uint32_t copied = 0;
+        while (err == ERR_NONE && copied < relocation.size && !atomic_load(&compaction.stop)) {
+            err = imgfs_compact_copy(&fs_file, &relocation, &copied, COMPACT_STEP_SIZE);
+
+            pause_us = read_latency_p99() > compaction.budget_us
+                       ? MIN(2 * pause_us, (uint64_t) COMPACT_PAUSE_MAX_US)
+                       : COMPACT_PAUSE_MIN_US;
+            compaction_pause(pause_us);
+        }
+        if (err != ERR_NONE) {
+            fprintf(stderr, "Compaction: %s\n", ERR_MSG(err));
+            compaction_pause(COMPACT_IDLE_US);
+            continue;
+        }
+
+        if (!compaction_lock(1)) break;
+        if (copied == relocation.size) err = imgfs_compact_commit(&fs_file, &relocation);
+        pthread_rwlock_unlock(&fs_lock);
+        if (err != ERR_NONE) fprintf(stderr, "Compaction: %s\n", ERR_MSG(err));
+    }
+
+    return NULL;
+}
+
+/**********************************************************************
+ * Starts the compaction thread (which never handles the signals).
+ ********************************************************************** */
+static int start_compaction(void)
+{
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    const int err = pthread_create(&compaction.thread, NULL, compaction_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (err != 0) return ERR_THREADING;
+    compaction.running = 1;
+    return ERR_NONE;
+}
+
 /********************************************************************//**
  * Startup function. Create imgFS file and load in-memory structure.
- * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+ * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2],
+ * then options: -compact <p99 read latency budget (ms)> enables online
+ * compaction, -compact_threshold <dead ratio (%)> runs it only from
+ * this share of dead content on, -punch frees the content of deleted
+ * images right away, -workers <n> sets the number of threads serving
+ * the connections (or, with -epoll, the requests of the connections
+ * an event loop handles), -resize_workers <n> the number of threads
+ * creating the missing resolutions, -all_variants creates all of them
+ * at once (from a single decode) when one is first read, -io_uring serves through io_uring if the
+ * kernel provides it (falling back to -epoll if given, else to
+ * blocking I/O)
  ********************************************************************** */
 int server_startup (int argc, char **argv)
 {
@@ -34,23 +349,83 @@ int server_startup (int argc, char **argv)
 
     const char* imgfs_file_name = argv[1];
 
+    // Handle the port number and the options
+    int punch_holes = 0;
+    size_t nb_workers = DEFAULT_NB_WORKERS;
+    size_t nb_resize_workers = DEFAULT_NB_RESIZE_WORKERS;
+    int all_variants = 0;
+    int event_loop = 0;
+    int io_uring = 0;
+    int i = 2;
+    server_port = DEFAULT_LISTENING_PORT;
+    if (argc > 2 && argv[2] != NULL && argv[2][0] != '-') {
+        server_port = atouint16(argv[2]);
+        ++i;
+    }
+    for (; i < argc; ++i) {
+        if (strcmp(argv[i], "-compact") == 0 && i + 1 < argc) {
+            // p99 read latency budget, in milliseconds
+            compaction.budget_us = (uint64_t) atouint32(argv[++i]) * 1000;
+            if (compaction.budget_us == 0) return ERR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[i], "-punch") == 0) {
+            punch_holes = 1;
+        } else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc) {
+            nb_workers = atouint16(argv[++i]);
+            if (nb_workers == 0) return ERR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[i], "-resize_workers") == 0 && i + 1 < argc) {
+            nb_resize_workers = atouint16(argv[++i]);
+            if (nb_resize_workers == 0) return ERR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[i], "-all_variants") == 0) {
+            all_variants = 1;
+        } else if (strcmp(argv[i], "-epoll") == 0) {
+            event_loop = 1;
+        } else if (strcmp(argv[i], "-io_uring") == 0) {
+            io_uring = 1;
+        } else if (strcmp(argv[i], "-compact_threshold") == 0 && i + 1 < argc) {
+            // Dead ratio, in percent
+            compaction.threshold = atouint32(argv[++i]);
+            if (compaction.threshold == 0 || compaction.threshold > 100) return ERR_INVALID_ARGUMENT;
+            if (compaction.budget_us == 0) compaction.budget_us = COMPACT_DEFAULT_BUDGET_MS * 1000;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
     // Open the imgFS file
-    int err = do_open(imgfs_file_name, "rb+", &fs_file);
+    int err = do_open_mmap(imgfs_file_name, "rb+", &fs_file);
     if (err < 0) return err;
+    fs_file.punch_holes = punch_holes;
 
     // Print the header of the imgFS file
     print_header(&fs_file.header);
 
-    // Handle the port number
-    if (argc == 3 && argv[2] != NULL) {
-        server_port = atouint16(argv[2]);
-    } else {
-        server_port = DEFAULT_LISTENING_PORT;
+    err = resize_service_start(&fs_file, nb_resize_workers, all_variants, resize_lock, resize_unlock);
+    if (err != ERR_NONE) return err;
+
+    if (compaction.budget_us > 0) {
+        err = start_compaction();
+        if (err != ERR_NONE) return err;
     }
 
     // Initialize the HTTP connection
     err = http_init(server_port, &handle_http_message);
     if (err <0) return err;
+    const struct http_body_stream insert_streaming = {
+        insert_stream_start, insert_stream_write, insert_stream_finish, insert_stream_abort
+    };
+    err = http_stream_bodies(&insert_streaming);
+    if (err != ERR_NONE) return err;
+    if (io_uring) {
+        err = http_use_io_uring();
+        if (err == ERR_NONE) event_loop = 0;
+        else fprintf(stderr, "io_uring unavailable, using %s\n", event_loop ? "epoll" : "blocking I/O");
+    }
+    if (event_loop) {
+        err = http_use_event_loop();
+        if (err != ERR_NONE) return err;
+    }
+    err = http_start_workers(nb_workers);
+    if (err != ERR_NONE) return err;
 
     printf("ImgFS server started on http://localhost:%u\n", server_port);
 
@@ -63,7 +438,14 @@ int server_startup (int argc, char **argv)
 void server_shutdown (void)
 {
     fprintf(stderr, "Shutting down...\n");
+    if (compaction.running) {
+        atomic_store(&compaction.stop, 1);
+        pthread_join(compaction.thread, NULL);
+        compaction.running = 0;
+    }
     http_close();
+    resize_service_stop(); // After the workers, which may wait for it
+    end_aborted_inserts();
     do_close(&fs_file);
 }
 
@@ -72,14 +454,14 @@ void server_shutdown (void)
  ********************************************************************** */
 static int reply_error_msg(int connection, int error)
 {
-#define ERR_MSG_SIZE 256
-    char err_msg[ERR_MSG_SIZE]; // enough for any reasonable err_msg
-    if (snprintf(err_msg, ERR_MSG_SIZE, "Error: %s\n", ERR_MSG(error)) < 0) {
-        fprintf(stderr, "reply_error_msg(): sprintf() failed...\n");
-        return ERR_RUNTIME;
-    }
-    return http_reply(connection, "500 Internal Server Error", "",
-                      err_msg, strlen(err_msg));
+    // "Error: <message>\n", sent as it is
+    const char* const err_msg = ERR_MSG(error);
+    const struct iovec body[] = {
+        { .iov_base = (char*) (uintptr_t) "Error: ", .iov_len = strlen("Error: ") },
+        { .iov_base = (char*) (uintptr_t) err_msg, .iov_len = strlen(err_msg) },
+        { .iov_base = (char*) (uintptr_t) "\n", .iov_len = 1 }
+    };
+    return http_reply_iov(connection, "500 Internal Server Error", "", body, 3);
 }
 
 /**********************************************************************
@@ -87,8 +469,9 @@ static int reply_error_msg(int connection, int error)
  ********************************************************************** */
 static int reply_302_msg(int connection)
 {
-    char location[ERR_MSG_SIZE];
-    if (snprintf(location, ERR_MSG_SIZE, "Location: http://localhost:%d/" BASE_FILE HTTP_LINE_DELIM,
+#define LOCATION_SIZE 256
+    char location[LOCATION_SIZE]; // enough for any port
+    if (snprintf(location, LOCATION_SIZE, "Location: http://localhost:%d/" BASE_FILE HTTP_LINE_DELIM,
                  server_port) < 0) {
         fprintf(stderr, "reply_302_msg(): sprintf() failed...\n");
         return ERR_RUNTIME;
@@ -110,6 +493,10 @@ int handle_http_message(struct http_message* msg, int connection)
         return http_serve_file(connection, BASE_FILE);
     }
 
+    if (http_match_uri(msg, URI_ROOT "/stats")) {
+        return handle_stats_call(connection);
+    }
+
     if (http_match_uri(msg, URI_ROOT "/list")      ||
         (http_match_uri(msg, URI_ROOT "/insert")
          && http_match_verb(&msg->method, "POST")) ||
@@ -118,12 +505,19 @@ int handle_http_message(struct http_message* msg, int connection)
         
         if (http_match_uri(msg, URI_ROOT "/list")) {
             return handle_list_call(connection);
-        } else if (http_match_uri(msg, URI_ROOT "/read")) {
-            return handle_read_call(msg, connection);
+        }
+
+        // The parameters are decoded once for all
+        struct http_query query;
+        const int err = http_parse_query(&msg->uri, &query);
+        if (err != ERR_NONE) return reply_error_msg(connection, err);
+
+        if (http_match_uri(msg, URI_ROOT "/read")) {
+            return handle_read_call(&query, connection);
         } else if (http_match_uri(msg, URI_ROOT "/insert")) {
-            return handle_insert_call(msg, connection);
+            return handle_insert_call(msg, &query, connection);
         } else if (http_match_uri(msg, URI_ROOT "/delete")) {
-            return handle_delete_call(msg, connection);
+            return handle_delete_call(&query, connection);
         }
         return reply_302_msg(connection);
         }
@@ -138,7 +532,9 @@ static int handle_list_call(int connection) {
     char *json_output;
     const char *header = "Content-Type: application/json" HTTP_LINE_DELIM;
     
+    pthread_rwlock_rdlock(&fs_lock);
     int err = do_list(&fs_file, JSON, &json_output);
+    pthread_rwlock_unlock(&fs_lock);
     if (err != ERR_NONE) {
         free(json_output);
         return reply_error_msg(connection, err);
@@ -149,14 +545,45 @@ static int handle_list_call(int connection) {
     return err;
 }
 
+/**********************************************************************
+ * Handles the stats call.
+ ********************************************************************** */
+static int handle_stats_call(int connection)
+{
+    char *json_output = NULL;
+    const char *header = "Content-Type: application/json" HTTP_LINE_DELIM;
+
+    pthread_rwlock_rdlock(&fs_lock);
+    int err = do_stats(&fs_file, JSON, &json_output);
+    pthread_rwlock_unlock(&fs_lock);
+    if (err != ERR_NONE) {
+        free(json_output);
+        return reply_error_msg(connection, err);
+    }
+
+    err = http_reply(connection, HTTP_OK, header, json_output, strlen(json_output));
+    free(json_output);
+    return err;
+}
+
+/**********************************************************************
+ * Gets the name of the image to insert (or the error to reply).
+ ********************************************************************** */
+static int get_image_name(const struct http_query* query, char img_name[MAX_IMGFS_NAME])
+{
+    const int ret = http_query_get(query, "name", img_name, MAX_IMGFS_NAME);
+    if (ret == 0) return ERR_NOT_ENOUGH_ARGUMENTS;
+    return ret < 0 ? ret : ERR_NONE;
+}
+
 /**********************************************************************
  * Handles the read call.
  ********************************************************************** */
-static int handle_read_call(struct http_message* msg, int connection)
+static int handle_read_call(const struct http_query* query, int connection)
 {
     // Get the resolution parameter
     char str_resolution[MAX_RESOLUTION];
-    int get_resolution_error = http_get_var(&msg->uri, "res", str_resolution, MAX_RESOLUTION);
+    int get_resolution_error = http_query_get(query, "res", str_resolution, MAX_RESOLUTION);
     if (get_resolution_error == 0) return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
     else if (get_resolution_error < 0) return reply_error_msg(connection, get_resolution_error);
     
@@ -165,52 +592,113 @@ static int handle_read_call(struct http_message* msg, int connection)
 
     // Get the identificator parameter
     char img_id[MAX_IMG_ID];
-    int get_id_error = http_get_var(&msg->uri, "img_id", img_id, MAX_IMG_ID);
+    int get_id_error = http_query_get(query, "img_id", img_id, MAX_IMG_ID);
     if (get_id_error == 0) return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
     else if (get_id_error < 0) return reply_error_msg(connection, get_id_error);
 
-    // Display the image to read
-    char *image_buffer = NULL;
+    // Find the image to read
+    uint64_t offset = 0;
     uint32_t image_size = 0;
-    
-    int do_read_error = do_read(img_id, resolution, &image_buffer, &image_size, &fs_file);
+
+    const uint64_t start = now_us();
+    pthread_rwlock_rdlock(&fs_lock);
+    size_t index = imgfs_index_find_id(&fs_file, img_id);
+    if (index < fs_file.header.max_files && fs_file.metadata[index].size[resolution] == 0) {
+        // The resolution has to be created first, by the resize service
+        // (along with the other calls asking for it meanwhile)
+        pthread_rwlock_unlock(&fs_lock);
+        const int resize_error = resize_service_request(img_id, index, resolution);
+        if (resize_error != ERR_NONE) {
+            record_read_latency(now_us() - start);
+            return reply_error_msg(connection, resize_error);
+        }
+
+        pthread_rwlock_rdlock(&fs_lock);
+        index = imgfs_index_find_id(&fs_file, img_id);
+        if (index < fs_file.header.max_files && fs_file.metadata[index].size[resolution] == 0) {
+            // Replaced meanwhile by an image of the same name: created here, which modifies the imgFS
+            pthread_rwlock_unlock(&fs_lock);
+            fs_write_lock();
+        }
+    }
+    int do_read_error = do_read_location(img_id, resolution, &offset, &image_size, &fs_file);
+    if (do_read_error == ERR_NONE) {
+        pthread_mutex_lock(&file_reads.lock);
+        ++file_reads.count;
+        pthread_mutex_unlock(&file_reads.lock);
+    }
+    pthread_rwlock_unlock(&fs_lock);
 
     if (do_read_error != 0) {
-        free(image_buffer);
+        record_read_latency(now_us() - start);
         return reply_error_msg(connection, do_read_error);
     }
 
     // Prepare the HTTP response
     char headers[] = "Content-Type: image/jpeg" HTTP_LINE_DELIM;
 
-    // Send the response
-    int error = http_reply(connection, HTTP_OK, headers, image_buffer, image_size);
-    free(image_buffer);
-    return error;
+    // Send the response, the content being read meanwhile (see file_read_done())
+    return http_reply_file(connection, HTTP_OK, headers, fileno(fs_file.file), offset, image_size,
+                           file_read_done, (void*) (uintptr_t) start);
 }
 
 /**********************************************************************
  * Handles the delete call.
  ********************************************************************** */
-static int handle_delete_call(struct http_message *msg, int connection)
+static int handle_delete_call(const struct http_query* query, int connection)
 {
     // Get the identificator parameter
     char img_id[MAX_IMG_ID];
-    int get_id_error = http_get_var(&msg->uri, "img_id", img_id, MAX_IMG_ID);
+    int get_id_error = http_query_get(query, "img_id", img_id, MAX_IMG_ID);
     if (get_id_error == 0) return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
     else if (get_id_error < 0) return reply_error_msg(connection, get_id_error);
 
+    fs_write_lock();
     int do_delete_error = do_delete(img_id, &fs_file);
+    pthread_rwlock_unlock(&fs_lock);
 
     if (do_delete_error != 0) return reply_error_msg(connection, do_delete_error);
 
     return reply_302_msg(connection);
 }
 
+/**********************************************************************
+ * Gets the optional variants parameter of an insert: "eager" queues
+ * the creation of the resized resolutions of the image right after it
+ * is inserted (see resize_service_queue()), "lazy" (the default)
+ * leaves it to their first read.
+ ********************************************************************** */
+static int get_variants_mode(const struct http_query* query, int* eager)
+{
+    char mode[MAX_VARIANTS_MODE];
+    const int ret = http_query_get(query, "variants", mode, sizeof(mode));
+    *eager = 0;
+    if (ret == 0) return ERR_NONE;
+    if (ret < 0) return ret;
+
+    if (strcmp(mode, "eager") == 0) *eager = 1;
+    else if (strcmp(mode, "lazy") != 0) return ERR_INVALID_ARGUMENT;
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Queues the creation of the resized resolutions of the image img_id,
+ * just inserted. Called with fs_lock taken; does not wait for them.
+ ********************************************************************** */
+static void queue_variants(const char* img_id)
+{
+    const size_t index = imgfs_index_find_id(&fs_file, img_id);
+    if (index == fs_file.header.max_files) return;
+
+    // Best effort: they are created when first read otherwise
+    const int err = resize_service_queue(img_id, index);
+    if (err != ERR_NONE) fprintf(stderr, "resize_service_queue() failed: %s\n", ERR_MSG(err));
+}
+
 /**********************************************************************
  * Handles the insert call.
  ********************************************************************** */
-static int handle_insert_call(struct http_message *msg, int connection)
+static int handle_insert_call(struct http_message *msg, const struct http_query* query, int connection)
 {
     size_t content_len = msg->body.len;
     if (content_len == 0 || msg->body.val == NULL)
@@ -220,20 +708,96 @@ static int handle_insert_call(struct http_message *msg, int connection)
     
     // Get the image name parameter
     char img_name[MAX_IMGFS_NAME];
-    int get_name_error = http_get_var(&msg->uri, "name", img_name, MAX_IMGFS_NAME);
-    if (get_name_error == 0) return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
-    else if (get_name_error < 0) return reply_error_msg(connection, get_name_error);
+    const int get_name_error = get_image_name(query, img_name);
+    if (get_name_error != ERR_NONE) return reply_error_msg(connection, get_name_error);
 
-    // Allocate memory on the heap for the image content
-    char *img_content = malloc(content_len);
-    if (img_content == NULL) return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
-    memcpy(img_content, msg->body.val, content_len);
+    int eager_variants = 0;
+    const int get_variants_error = get_variants_mode(query, &eager_variants);
+    if (get_variants_error != ERR_NONE) return reply_error_msg(connection, get_variants_error);
 
-    // Insert the image into the image file system
-    int do_insert_error = do_insert(img_content, content_len, img_name, &fs_file);
+    // Insert the image into the image file system (straight from the request)
+    fs_write_lock();
+    int do_insert_error = do_insert(msg->body.val, content_len, img_name, &fs_file);
+    if (do_insert_error == ERR_NONE && eager_variants) queue_variants(img_name);
+    pthread_rwlock_unlock(&fs_lock);
 
-    free(img_content);
     if (do_insert_error != 0) return reply_error_msg(connection, do_insert_error);
 
     return reply_302_msg(connection);
 }
+
+/**********************************************************************
+ * Starts an insert whose content is streamed (those with a content
+ * received whole are left to handle_insert_call()).
+ ********************************************************************** */
+static void* insert_stream_start(const struct http_message* msg, size_t content_len)
+{
+    if (!http_match_uri(msg, URI_ROOT "/insert") || !http_match_verb(&msg->method, "POST")) return NULL;
+
+    struct insert_stream* const stream = calloc(1, sizeof(struct insert_stream));
+    if (stream == NULL) return NULL;
+
+    // An error is replied once the content is received (and ignored)
+    struct http_query query;
+    char img_name[MAX_IMGFS_NAME];
+    stream->err = http_parse_query(&msg->uri, &query);
+    if (stream->err == ERR_NONE) stream->err = get_image_name(&query, img_name);
+    if (stream->err == ERR_NONE) stream->err = get_variants_mode(&query, &stream->eager_variants);
+    if (stream->err == ERR_NONE) {
+        fs_write_lock();
+        stream->err = do_insert_begin(img_name, content_len, &fs_file, &stream->upload);
+        pthread_rwlock_unlock(&fs_lock);
+        stream->started = stream->err == ERR_NONE;
+    }
+
+    return stream;
+}
+
+/**********************************************************************
+ * Writes the next piece of the content of a streamed insert (without
+ * fs_lock: only the space reserved for it is written).
+ ********************************************************************** */
+static int insert_stream_write(void* state, const char* data, size_t len)
+{
+    struct insert_stream* const stream = state;
+    if (stream->err == ERR_NONE) stream->err = do_insert_write(&stream->upload, data, len, &fs_file);
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Ends a streamed insert, once its content is received.
+ ********************************************************************** */
+static int insert_stream_finish(void* state, struct http_message* msg _unused, int connection)
+{
+    struct insert_stream* const stream = state;
+    int err = stream->err;
+    if (stream->started) {
+        fs_write_lock();
+        if (err == ERR_NONE) err = do_insert_commit(&stream->upload, &fs_file);
+        else do_insert_abort(&stream->upload, &fs_file);
+        if (err == ERR_NONE && stream->eager_variants) queue_variants(stream->upload.img_id);
+        pthread_rwlock_unlock(&fs_lock);
+    }
+    free(stream);
+
+    if (err != ERR_NONE) return reply_error_msg(connection, err);
+    return reply_302_msg(connection);
+}
+
+/**********************************************************************
+ * Aborts a streamed insert whose connection got closed (see
+ * aborted_inserts).
+ ********************************************************************** */
+static void insert_stream_abort(void* state)
+{
+    struct insert_stream* const stream = state;
+    if (!stream->started) {
+        free(stream);
+        return;
+    }
+
+    pthread_mutex_lock(&aborted_inserts.lock);
+    stream->next = aborted_inserts.list;
+    aborted_inserts.list = stream;
+    pthread_mutex_unlock(&aborted_inserts.lock);
+}
@@ -11,6 +11,8 @@
 
 #define BASE_FILE "index.html"
 #define DEFAULT_LISTENING_PORT 8000
+#define DEFAULT_NB_WORKERS 8 // Threads serving the connections
+#define DEFAULT_NB_RESIZE_WORKERS 2 // Threads creating the missing resolutions
 
 int server_startup (int argc, char **argv);
 
@@ -20,8 +22,18 @@ int handle_http_message(struct http_message* msg, int connection);
 
 static int handle_list_call(int connection);
 
-static int handle_read_call(struct http_message* msg, int connection);
+static int handle_stats_call(int connection);
 
-static int handle_delete_call(struct http_message* msg, int connection);
+static int handle_read_call(const struct http_query* query, int connection);
 
-static int handle_insert_call(struct http_message* msg, int connection);
+static int handle_delete_call(const struct http_query* query, int connection);
+
+static int handle_insert_call(struct http_message* msg, const struct http_query* query, int connection);
+
+static void* insert_stream_start(const struct http_message* msg, size_t content_len);
+
+static int insert_stream_write(void* state, const char* data, size_t len);
+
+static int insert_stream_finish(void* state, struct http_message* msg, int connection);
+
+static void insert_stream_abort(void* state);
@@ -0,0 +1,64 @@
+#include "imgfs.h"
+#include "imgfs_compact.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <json-c/json.h>
+
+/**
+ * @brief Displays (on stdout) or formats (in JSON) the space usage of an imgFS file.
+ *
+ * @param imgfs_file In memory structure with header and metadata.
+ * @param output_mode What style to use for displaying the statistics.
+ * @param json A pointer to a string containing the statistics in JSON format if output_mode is JSON.
+ *      It will be dynamically allocated by the function. Ignored for other output modes.
+ * @return some error code.
+ */
+int do_stats(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode, char** json)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    struct imgfs_stats stats;
+    int err = imgfs_get_stats(imgfs_file, &stats);
+    if (err != ERR_NONE) return err;
+
+    const double dead_ratio = imgfs_dead_ratio(&stats);
+
+    switch (output_mode) {
+    case STDOUT:
+        printf("FILE SIZE: %" PRIu64 "\t\tMETADATA: %" PRIu64 "\n"
+               "LIVE: %" PRIu64 "\t\tDEAD: %" PRIu64 " (%.1f%%)\n",
+               stats.file_size, stats.metadata_size, stats.live_bytes, stats.dead_bytes,
+               100.0 * dead_ratio);
+        break;
+    case JSON: {
+        M_REQUIRE_NON_NULL(json);
+
+        json_object* jobj = json_object_new_object();
+        if (jobj == NULL) return ERR_RUNTIME;
+
+        json_object_object_add(jobj, "file_size", json_object_new_int64((int64_t) stats.file_size));
+        json_object_object_add(jobj, "metadata_size", json_object_new_int64((int64_t) stats.metadata_size));
+        json_object_object_add(jobj, "live_bytes", json_object_new_int64((int64_t) stats.live_bytes));
+        json_object_object_add(jobj, "dead_bytes", json_object_new_int64((int64_t) stats.dead_bytes));
+        json_object_object_add(jobj, "dead_ratio", json_object_new_double(dead_ratio));
+
+        // Duplicate the JSON string to return
+        *json = strdup(json_object_to_json_string(jobj));
+
+        // Free the JSON object (as well as the values within it)
+        json_object_put(jobj);
+
+        if (*json == NULL) return ERR_RUNTIME;
+
+        break;
+    }
+    default:
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    return ERR_NONE;
+}
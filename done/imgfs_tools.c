@@ -6,14 +6,19 @@
  */
 
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "util.h"
 
+#include <fcntl.h>         // for fcntl
 #include <inttypes.h>      // for PRIxN macros
 #include <openssl/sha.h>   // for SHA256_DIGEST_LENGTH
 #include <stdint.h>        // for uint8_t
 #include <stdio.h>         // for sprintf
 #include <stdlib.h>        // for calloc
 #include <string.h>        // for strcmp
+#include <sys/mman.h>      // for mmap
+#include <sys/stat.h>      // for fstat
+#include <unistd.h>        // for sysconf, pread, pwrite
 
 /*******************************************************************
  * Human-readable SHA
@@ -67,22 +72,26 @@ ORIGINAL: %" PRIu32 " x %" PRIu32 "\n",
     printf("*****************************************\n");
 }
 
-/**
- * @brief Open imgFS file, read the header and all the metadata.
- *
- * @param imgfs_filename Path to the imgFS file
- * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
- * @param imgfs_file Structure for header, metadata and file pointer.
+/*******************************************************************
+ * Opens the file and reads its header (common part of the do_open*).
  */
-int do_open(const char* imgfs_filename,
-            const char* open_mode,
-            struct imgfs_file* imgfs_file)
+static int open_and_read_header(const char* imgfs_filename,
+                                const char* open_mode,
+                                struct imgfs_file* imgfs_file)
 {
     // Check for NULL pointers
     M_REQUIRE_NON_NULL(imgfs_filename);
     M_REQUIRE_NON_NULL(open_mode);
     M_REQUIRE_NON_NULL(imgfs_file);
 
+    imgfs_file->metadata = NULL;
+    imgfs_file->index = NULL;
+    imgfs_file->map = NULL;
+    imgfs_file->map_size = 0;
+    imgfs_file->punch_holes = 0;
+    imgfs_file->nb_uploads = 0;
+    imgfs_file->uploads_end = 0;
+
     // Open the file
     imgfs_file->file = fopen(imgfs_filename, open_mode);
     if (imgfs_file->file == NULL) {
@@ -95,6 +104,23 @@ int do_open(const char* imgfs_filename,
         return ERR_IO;
     }
 
+    return ERR_NONE;
+}
+
+/**
+ * @brief Open imgFS file, read the header and all the metadata.
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ */
+int do_open(const char* imgfs_filename,
+            const char* open_mode,
+            struct imgfs_file* imgfs_file)
+{
+    int err = open_and_read_header(imgfs_filename, open_mode, imgfs_file);
+    if (err != ERR_NONE) return err;
+
     // Allocate the metadata
     imgfs_file->metadata = calloc(imgfs_file->header.max_files, sizeof(struct img_metadata));
     if (imgfs_file->metadata == NULL) {
@@ -108,6 +134,60 @@ int do_open(const char* imgfs_filename,
         return ERR_IO;
     }
 
+    // Build the in-memory lookup tables
+    err = imgfs_index_build(imgfs_file);
+    if (err != ERR_NONE) {
+        do_close(imgfs_file);
+        return err;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * @brief Open imgFS file and map its header and metadata into memory.
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ */
+int do_open_mmap(const char* imgfs_filename,
+                 const char* open_mode,
+                 struct imgfs_file* imgfs_file)
+{
+    int err = open_and_read_header(imgfs_filename, open_mode, imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    const size_t map_size = sizeof(struct imgfs_header)
+                            + (size_t) imgfs_file->header.max_files * sizeof(struct img_metadata);
+
+    // Accessing a mapping past the end of the file would raise SIGBUS
+    struct stat st;
+    const int fd = fileno(imgfs_file->file);
+    if (fstat(fd, &st) != 0 || st.st_size < 0 || (size_t) st.st_size < map_size) {
+        do_close(imgfs_file);
+        return ERR_IO;
+    }
+
+    // Read-only files get a private (copy-on-write) mapping, so that in-memory
+    // changes never crash, just as with do_open()
+    const int writable = strchr(open_mode, '+') != NULL;
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        do_close(imgfs_file);
+        return ERR_IO;
+    }
+    imgfs_file->map = map;
+    imgfs_file->map_size = map_size;
+    imgfs_file->metadata = (void*) ((char*) map + sizeof(struct imgfs_header));
+
+    // Build the in-memory lookup tables
+    err = imgfs_index_build(imgfs_file);
+    if (err != ERR_NONE) {
+        do_close(imgfs_file);
+        return err;
+    }
+
     return ERR_NONE;
 }
 
@@ -119,6 +199,15 @@ int do_open(const char* imgfs_filename,
 void do_close(struct imgfs_file* imgfs_file)
 {
     if (imgfs_file != NULL) {
+        imgfs_index_free(imgfs_file);
+        if (imgfs_file->map != NULL) {
+            // Last msync point: every change made through the mapping is on disk
+            msync(imgfs_file->map, imgfs_file->map_size, MS_SYNC);
+            munmap(imgfs_file->map, imgfs_file->map_size);
+            imgfs_file->map = NULL;
+            imgfs_file->map_size = 0;
+            imgfs_file->metadata = NULL;
+        }
         if (imgfs_file->metadata != NULL) {
             free(imgfs_file->metadata);
             imgfs_file->metadata = NULL;
@@ -130,6 +219,151 @@ void do_close(struct imgfs_file* imgfs_file)
     }
 }
 
+/*******************************************************************
+ * Whether the file was opened for writing (writes through a private
+ * mapping must fail as fwrite() would).
+ */
+static int is_writable(FILE* file)
+{
+    const int flags = fcntl(fileno(file), F_GETFL);
+    return flags != -1 && (flags & O_ACCMODE) != O_RDONLY;
+}
+
+/**
+ * @brief Reads size bytes at offset of the imgFS file.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param buffer Where to store the bytes read
+ * @param size The number of bytes to read
+ * @param offset The position in the file
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_read_at(const struct imgfs_file* imgfs_file, void* buffer, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    const int fd = fileno(imgfs_file->file);
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = pread(fd, (char*) buffer + done, size - done, (off_t) (offset + done));
+        if (n <= 0) return ERR_IO; // Error, or end of file
+        done += (size_t) n;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * @brief Writes size bytes at offset of the imgFS file.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param buffer The bytes to write
+ * @param size The number of bytes to write
+ * @param offset The position in the file
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_at(const struct imgfs_file* imgfs_file, const void* buffer, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    const int fd = fileno(imgfs_file->file);
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = pwrite(fd, (const char*) buffer + done, size - done, (off_t) (offset + done));
+        if (n <= 0) return ERR_IO;
+        done += (size_t) n;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * @brief Appends size bytes to the imgFS file.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param buffer The bytes to write
+ * @param size The number of bytes to write
+ * @param offset Where to store the position of the bytes in the file
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_append(struct imgfs_file* imgfs_file, const void* buffer, size_t size, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(offset);
+
+    struct stat st;
+    if (fstat(fileno(imgfs_file->file), &st) != 0 || st.st_size < 0) return ERR_IO;
+
+    const int err = imgfs_write_at(imgfs_file, buffer, size, (uint64_t) st.st_size);
+    if (err != ERR_NONE) return err;
+
+    *offset = (uint64_t) st.st_size;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Schedules the writeback of the mapped bytes [offset, offset + size[.
+ */
+static int sync_mapped(struct imgfs_file* imgfs_file, size_t offset, size_t size)
+{
+    // msync() wants a page-aligned start
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t start = offset - offset % page_size;
+    if (msync((char*) imgfs_file->map + start, offset + size - start, MS_ASYNC) != 0) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Writes the (in-memory) header back to the imgFS file.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_header(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    if (imgfs_file->map != NULL) {
+        if (!is_writable(imgfs_file->file)) return ERR_IO;
+        memcpy(imgfs_file->map, &imgfs_file->header, sizeof(struct imgfs_header));
+        return sync_mapped(imgfs_file, 0, sizeof(struct imgfs_header));
+    }
+
+    return imgfs_write_at(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0);
+}
+
+/**
+ * @brief Writes one (in-memory) metadata entry back to the imgFS file.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param index The order number in the metadata array
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_metadata(struct imgfs_file* imgfs_file, uint32_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (index >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    const size_t offset = sizeof(struct imgfs_header) + index * sizeof(struct img_metadata);
+
+    if (imgfs_file->map != NULL) {
+        if (!is_writable(imgfs_file->file)) return ERR_IO;
+        return sync_mapped(imgfs_file, offset, sizeof(struct img_metadata));
+    }
+
+    return imgfs_write_at(imgfs_file, &imgfs_file->metadata[index], sizeof(struct img_metadata), offset);
+}
+
 /**
  * @brief Convert a string to a resolution.
  *
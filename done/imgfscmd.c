@@ -14,7 +14,7 @@
 #include <vips/vips.h>
 #include <string.h>
 
-#define N_COMMANDS 7
+#define N_COMMANDS 9
 
 const command_mapping commands[N_COMMANDS] = {
     {"list", do_list_cmd},
@@ -23,7 +23,9 @@ const command_mapping commands[N_COMMANDS] = {
     {"delete", do_delete_cmd},
     {"create", do_create_cmd},
     {"read", do_read_cmd},
-    {"insert", do_insert_cmd}
+    {"insert", do_insert_cmd},
+    {"gc", do_gbcollect_cmd},
+    {"stats", do_stats_cmd}
 };
 
 /*******************************************************************************
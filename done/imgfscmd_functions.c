@@ -7,6 +7,7 @@
 
 #include "imgfs.h"
 #include "imgfscmd_functions.h"
+#include "imgfs_compact.h" // for do_stats
 #include "util.h"   // for _unused
 
 #include <stdlib.h>
@@ -145,6 +146,10 @@ int help(int useless _unused, char** useless_too _unused)
     printf("      default resolution is \"original\".\n");
     printf("  insert <imgFS_filename> <imgID> <filename>: insert a new image in the imgFS.\n");
     printf("  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n");
+    printf("      option -punch (after imgID): also free the disk space of its content right away.\n");
+    printf("  gc <imgFS_filename> <tmp imgFS_filename>: performs garbage collecting on imgFS.\n");
+    printf("      requires a temporary filename for copying the imgFS.\n");
+    printf("  stats <imgFS_filename>: display the live and dead (reclaimable) bytes of imgFS.\n");
 
     return ERR_NONE;
 }
@@ -166,7 +171,7 @@ int do_list_cmd(int argc, char** argv)
     M_REQUIRE_NON_NULL(dbFilename);
 
     struct imgfs_file imgfsFile;
-    int result = do_open(dbFilename, "r", &imgfsFile);
+    int result = do_open_mmap(dbFilename, "r", &imgfsFile);
 
     if (result != ERR_NONE) return result;
     
@@ -266,14 +271,14 @@ int do_create_cmd(int argc, char** argv)
 /**********************************************************************
  * Deletes an image from the imgFS.
  **********************************************************************/
-// Two arguments: imgFS_filename + imgID
+// Two arguments: imgFS_filename + imgID, then optionally -punch
 int do_delete_cmd(int argc, char** argv)
 {
     // Validate arguments
     M_REQUIRE_NON_NULL(argv); // We need exactly an imgFS filename and an image ID
     if (argc < 2) {
         return ERR_NOT_ENOUGH_ARGUMENTS;
-    } else if (argc > 2) {
+    } else if (argc > 3 || (argc == 3 && strcmp(argv[2], "-punch") != 0)) {
         return ERR_INVALID_ARGUMENT;
     }
 
@@ -294,6 +299,7 @@ int do_delete_cmd(int argc, char** argv)
     if (err != ERR_NONE) {
         return err;
     }
+    imgfs_file.punch_holes = (argc == 3);
 
     // Perform the delete operation
     int result = do_delete(imgID, &imgfs_file);
@@ -369,3 +375,36 @@ int do_insert_cmd(int argc, char **argv)
     do_close(&myfile);
     return error;
 }
+
+/**********************************************************************
+ * Removes the content of the deleted images from the imgFS.
+ **********************************************************************/
+// Two arguments: imgFS_filename + tmp imgFS_filename
+int do_gbcollect_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc > 2) return ERR_INVALID_COMMAND;
+
+    return do_gbcollect(argv[0], argv[1]);
+}
+
+/**********************************************************************
+ * Displays the space usage (live and dead bytes) of the imgFS.
+ **********************************************************************/
+// One argument: imgFS_filename
+int do_stats_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < 1) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc > 1) return ERR_INVALID_COMMAND;
+
+    struct imgfs_file imgfs_file;
+    int err = do_open_mmap(argv[0], "r", &imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    err = do_stats(&imgfs_file, STDOUT, NULL);
+
+    do_close(&imgfs_file);
+    return err;
+}
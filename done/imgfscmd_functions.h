@@ -37,6 +37,16 @@ int do_insert_cmd(int argc, char* argv[]);
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
 
+/********************************************************************
+ * Removes the content of the deleted images from the imgFS.
+ *******************************************************************/
+int do_gbcollect_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Displays the space usage (live and dead bytes) of the imgFS.
+ *******************************************************************/
+int do_stats_cmd(int argc, char* argv[]);
+
 
 // Command function pointer
 typedef int (*command)(int argc, char* argv[]);
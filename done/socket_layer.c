@@ -1,14 +1,19 @@
+#define _GNU_SOURCE // accept4()
+
 #include "imgfs.h"
 #include "socket_layer.h"
 
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 
 
-#define MAX_PENDING_CONNECTIONS 5
+#define MAX_PENDING_CONNECTIONS SOMAXCONN
 
 int tcp_server_init(uint16_t port)
 {
@@ -37,8 +42,16 @@ int tcp_server_init(uint16_t port)
     }
     printf("[+] Server socket binded %d\n", port);
 
+    // Replies are written in one go (or corked, see tcp_set_cork()): no need
+    // for Nagle's algorithm to hold back their last segment, which is what
+    // uncorking would otherwise do (accepted sockets inherit the option)
+    const int nodelay = 1;
+    if (setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1) {
+        perror("[-] Error setting TCP_NODELAY");
+    }
+
     // Listen for incoming connections
-    if (listen(socket_fd, MAX_PENDING_CONNECTIONS) == -1) { // Allow up to 5 connections to wait in the queue
+    if (listen(socket_fd, MAX_PENDING_CONNECTIONS) == -1) { // Allow as many connections to wait in the queue as the system does
         perror("[-] Error listening on socket");
         close(socket_fd);
         return ERR_IO;
@@ -56,6 +69,34 @@ int tcp_accept(int passive_socket)
     return accept(passive_socket, NULL, NULL);
 }
 
+/**
+ * @brief Non-blocking call that accepts a new TCP connection, itself non-blocking
+ */
+int tcp_accept_nonblocking(int passive_socket)
+{
+    return accept4(passive_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+/**
+ * @brief Makes a socket non-blocking
+ */
+int tcp_set_nonblocking(int socket_fd)
+{
+    const int flags = fcntl(socket_fd, F_GETFL);
+    if (flags == -1 || fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK) == -1) return ERR_IO;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Makes a socket blocking again
+ */
+int tcp_set_blocking(int socket_fd)
+{
+    const int flags = fcntl(socket_fd, F_GETFL);
+    if (flags == -1 || fcntl(socket_fd, F_SETFL, flags & ~O_NONBLOCK) == -1) return ERR_IO;
+    return ERR_NONE;
+}
+
 /**
  * @brief Blocking call that reads the active socket once and stores the output in buf
  */
@@ -70,3 +111,26 @@ ssize_t tcp_send(int active_socket, const char* response, size_t response_len)
     M_REQUIRE_NON_NULL(response);
     return send(active_socket, response, response_len, 0);
 }
+
+ssize_t tcp_writev(int active_socket, const struct iovec* iov, size_t iovcnt)
+{
+    M_REQUIRE_NON_NULL(iov);
+    struct msghdr message = {
+        .msg_iov = (struct iovec*) (uintptr_t) iov,
+        .msg_iovlen = iovcnt
+    };
+    return sendmsg(active_socket, &message, MSG_NOSIGNAL);
+}
+
+int tcp_set_cork(int socket_fd, int on)
+{
+    const int value = on ? 1 : 0;
+    if (setsockopt(socket_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == -1) return ERR_IO;
+    return ERR_NONE;
+}
+
+ssize_t tcp_sendfile(int active_socket, int fd, uint64_t offset, size_t count)
+{
+    off_t file_offset = (off_t) offset;
+    return sendfile(active_socket, fd, &file_offset, count);
+}
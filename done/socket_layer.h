@@ -10,6 +10,7 @@
 #include <stddef.h> // size_t
 #include <stdint.h> // uint16_t
 #include <sys/types.h> // ssize_t
+#include <sys/uio.h> // struct iovec
 
 int tcp_server_init(uint16_t port);
 
@@ -18,9 +19,51 @@ int tcp_server_init(uint16_t port);
  */
 int tcp_accept(int passive_socket);
 
+/**
+ * @brief Non-blocking call that accepts a new TCP connection.
+ *
+ * The new socket is non-blocking as well. Returns -1 with errno set to
+ * EAGAIN (or EWOULDBLOCK) if no connection is pending.
+ */
+int tcp_accept_nonblocking(int passive_socket);
+
+/**
+ * @brief Makes a socket non-blocking: tcp_accept(), tcp_read() and
+ *        tcp_send() then fail with errno EAGAIN instead of waiting.
+ */
+int tcp_set_nonblocking(int socket_fd);
+
+/**
+ * @brief Makes a socket blocking again (see tcp_set_nonblocking()).
+ */
+int tcp_set_blocking(int socket_fd);
+
 /**
  * @brief Blocking call that reads the active socket once and stores the output in buf
  */
 ssize_t tcp_read(int active_socket, char* buf, size_t buflen);
 
 ssize_t tcp_send(int active_socket, const char* response, size_t response_len);
+
+/**
+ * @brief Sends (as much as the socket takes of) the iovcnt buffers of iov
+ *        at once, in this order. A client leaving does not raise SIGPIPE.
+ *        Returns the number of bytes sent, or -1 (with errno set).
+ */
+ssize_t tcp_writev(int active_socket, const struct iovec* iov, size_t iovcnt);
+
+/**
+ * @brief Corks (on set) or uncorks a socket: while corked, what is sent
+ *        is held back to go out in full packets, e.g. the headers of a
+ *        reply along with its body (see tcp_sendfile()). Uncorking sends
+ *        what is left right away.
+ */
+int tcp_set_cork(int socket_fd, int on);
+
+/**
+ * @brief Sends (at most) count bytes at offset in the file fd, straight
+ *        from the file (with sendfile(): the content is not copied to
+ *        user memory). Returns the number of bytes sent, or -1 (with
+ *        errno set, e.g. to EAGAIN on a non-blocking socket).
+ */
+ssize_t tcp_sendfile(int active_socket, int fd, uint64_t offset, size_t count);
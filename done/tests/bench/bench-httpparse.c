@@ -0,0 +1,99 @@
+/**
+ * @file bench-httpparse.c
+ * @brief Parsing cost of the headers of realistic browser requests, by
+ *        http_parse_message() (single pass over the delimiters) and by the
+ *        token by token reference (a strstr() per token).
+ *
+ * Built twice: with the SIMD scanner and with the scalar fallback
+ * (HTTP_SCAN_SCALAR); the label given as first argument tells them apart.
+ */
+
+#include "bench.h"
+#include "error.h"
+#include "http_prot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NB_PARSES 1000000
+
+// Requests as sent by a current desktop browser to the ImgFS server
+static const char* const requests[] = {
+    "GET /imgfs/read?res=thumb&img_id=papillon HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:131.0) Gecko/20100101 Firefox/131.0\r\n"
+    "Accept: image/avif,image/webp,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://localhost:8000/index.html\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Priority: u=5, i\r\n"
+    "\r\n",
+
+    "POST /imgfs/insert?name=coquelicot.jpg HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/129.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Content-Type: image/jpeg\r\n"
+    "Content-Length: 0\r\n"
+    "Origin: http://localhost:8000\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://localhost:8000/index.html\r\n"
+    "Sec-Fetch-Dest: empty\r\n"
+    "Sec-Fetch-Mode: cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n"
+};
+
+// Token by token parsing of the request line and headers, as it was done before the single pass
+static int reference_parse(const char* stream, struct http_message* out)
+{
+    if (strstr(stream, HTTP_HDR_END_DELIM) == NULL) return 0;
+    memset(out, 0, sizeof(*out));
+
+    const char* line = get_next_token(stream, " ", &out->method);
+    if (line != NULL) line = get_next_token(line, " ", &out->uri);
+    if (line != NULL) line = get_next_token(line, HTTP_LINE_DELIM, NULL);
+    if (line == NULL || http_parse_headers(line, out) == NULL) return ERR_RUNTIME;
+    return 1;
+}
+
+// Average time (in ns) of a parse of request, by http_parse_message() or by the reference
+static double time_parses(const char* request, int reference)
+{
+    const size_t len = strlen(request);
+    struct http_message message;
+    int content_len = 0;
+    size_t parsed = 0;
+
+    const double start = bench_now_ns();
+    for (size_t i = 0; i < NB_PARSES; ++i) {
+        const int ret = reference ? reference_parse(request, &message)
+                        : http_parse_message(request, len, &message, &content_len);
+        parsed += ret > 0 && message.num_headers > 0;
+    }
+    const double elapsed = bench_now_ns() - start;
+
+    if (parsed != NB_PARSES) fprintf(stderr, "unexpected parse result\n");
+    return elapsed / NB_PARSES;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* const label = argc > 1 ? argv[1] : "";
+
+    printf("%8s %8s %20s %20s\n", "scanner", "bytes", "single pass (ns/op)", "reference (ns/op)");
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); ++i) {
+        const double single_pass = time_parses(requests[i], 0);
+        const double reference = time_parses(requests[i], 1);
+        printf("%8s %8zu %20.1f %20.1f\n", label, strlen(requests[i]), single_pass, reference);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file bench-imgfsindex.c
+ * @brief Lookup cost of an image ID, with and without the in-memory index,
+ *        for growing values of max_files.
+ *
+ * The imgFS is built in memory only (half of the slots are valid), so
+ * that only the lookup itself is measured.
+ */
+
+#include "bench.h"
+#include "imgfs.h"
+#include "imgfs_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NB_INDEXED_LOOKUPS 1000000
+#define NB_LINEAR_LOOKUPS     2000
+
+static int make_memory_imgfs(struct imgfs_file* file, uint32_t max_files)
+{
+    const struct imgfs_file empty = { .header.max_files = max_files };
+    memcpy(file, &empty, sizeof(empty));
+
+    file->metadata = calloc(max_files, sizeof(struct img_metadata));
+    if (file->metadata == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (uint32_t i = 0; i < max_files; i += 2) {
+        snprintf(file->metadata[i].img_id, MAX_IMG_ID, "gallery/%08u.jpg", i);
+        file->metadata[i].is_valid = NON_EMPTY;
+        file->header.nb_files++;
+    }
+    return ERR_NONE;
+}
+
+// Average time (in ns) of nb_lookups lookups of random (existing) image IDs
+static double time_lookups(const struct imgfs_file* file, size_t nb_lookups)
+{
+    char img_id[MAX_IMG_ID + 1];
+    size_t found = 0;
+
+    const double start = bench_now_ns();
+    for (size_t i = 0; i < nb_lookups; ++i) {
+        const uint32_t slot = (uint32_t) (bench_random() % file->header.max_files) & ~1U;
+        snprintf(img_id, MAX_IMG_ID, "gallery/%08u.jpg", slot);
+        found += imgfs_index_find_id(file, img_id) == slot;
+    }
+    const double elapsed = bench_now_ns() - start;
+
+    if (found != nb_lookups) fprintf(stderr, "unexpected lookup result\n");
+    return elapsed / (double) nb_lookups;
+}
+
+int main(void)
+{
+    static const uint32_t sizes[] = { 1000, 10000, 100000, 1000000 };
+
+    printf("%12s %18s %18s\n", "max_files", "indexed (ns/op)", "linear (ns/op)");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        struct imgfs_file file;
+        if (make_memory_imgfs(&file, sizes[i]) != ERR_NONE) return EXIT_FAILURE;
+
+        const double linear = time_lookups(&file, NB_LINEAR_LOOKUPS);
+
+        if (imgfs_index_build(&file) != ERR_NONE) return EXIT_FAILURE;
+        const double indexed = time_lookups(&file, NB_INDEXED_LOOKUPS);
+
+        printf("%12u %18.1f %18.1f\n", sizes[i], indexed, linear);
+        do_close(&file);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+/**
+ * @file bench-resize.c
+ * @brief CPU time and peak memory of the creation of a resolution of the
+ *        test images, by resize_image() (shrink-on-load) and by the full
+ *        decode reference (the whole original decoded, then resized).
+ *
+ * Each measurement runs in a child process, so that its CPU time and
+ * peak RSS are its own (see wait4()).
+ */
+
+#include "bench.h"
+#include "error.h"
+#include "image_content.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#define NB_RESIZES 20
+
+static const char* const images[] = {
+    "papillon.jpg", "coquelicots.jpg", "brouillard.jpg", "foret.jpg", "mure.jpg"
+};
+
+// Default resolutions of a new imgFS (see imgfscmd_functions.c)
+static const struct {
+    const char* name;
+    uint16_t width;
+    uint16_t height;
+} resolutions[] = { { "thumb", 64, 64 }, { "small", 256, 256 } };
+
+// Resizing as it was done before shrink-on-load
+static int reference_resize(const char* image_buffer, size_t image_size, uint16_t width, uint16_t height,
+                            void** resized_buffer, size_t* resized_size)
+{
+    VipsImage *original = NULL, *resized = NULL;
+    int err = ERR_IO;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_jpegload_buffer((void*) image_buffer, image_size, &original, NULL) == 0
+        && vips_thumbnail_image(original, &resized, width, "height", height, NULL) == 0
+        && vips_jpegsave_buffer(resized, resized_buffer, resized_size, NULL) == 0) {
+        err = ERR_NONE;
+    }
+#pragma GCC diagnostic pop
+
+    if (original) g_object_unref(VIPS_OBJECT(original));
+    if (resized) g_object_unref(VIPS_OBJECT(resized));
+    return err;
+}
+
+static char* read_image(const char* name, size_t* size)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", DATA_DIR, name);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    char* buffer = NULL;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        const long len = ftell(file);
+        buffer = len > 0 ? malloc((size_t) len) : NULL;
+        if (buffer != NULL && (fseek(file, 0, SEEK_SET) != 0
+                               || fread(buffer, 1, (size_t) len, file) != (size_t) len)) {
+            free(buffer);
+            buffer = NULL;
+        }
+        *size = (size_t) len;
+    }
+    fclose(file);
+    return buffer;
+}
+
+// Child: NB_RESIZES resizes of image, by resize_image() or by the reference
+static int run_resizes(const char* image_buffer, size_t image_size, size_t res, int reference)
+{
+    if (VIPS_INIT("bench-resize")) return EXIT_FAILURE;
+    vips_cache_set_max(0); // Each resize really decodes
+
+    for (size_t i = 0; i < NB_RESIZES; ++i) {
+        void* resized = NULL;
+        size_t resized_size = 0;
+        const int err = (reference ? reference_resize : resize_image)
+                        (image_buffer, image_size, resolutions[res].width, resolutions[res].height,
+                         &resized, &resized_size);
+        if (err != ERR_NONE) return EXIT_FAILURE;
+        free(resized);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Average CPU time (in ms) of a resize, and peak RSS (in MiB) of the child running them
+static int measure(const char* image_buffer, size_t image_size, size_t res, int reference,
+                   double* cpu_ms, double* peak_mib)
+{
+    fflush(stdout);
+    const pid_t child = fork();
+    if (child < 0) return ERR_RUNTIME;
+    if (child == 0) _exit(run_resizes(image_buffer, image_size, res, reference));
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return ERR_RUNTIME;
+    }
+
+    const double cpu_us = (double) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6
+                          + (double) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+    *cpu_ms = cpu_us / 1e3 / NB_RESIZES;
+    *peak_mib = (double) usage.ru_maxrss / 1024.0;
+    return ERR_NONE;
+}
+
+int main(void)
+{
+    // vips is only initialized in the children (fork() and threads do not mix)
+    printf("%16s %9s %6s %23s %23s %8s\n", "image", "KiB", "res",
+           "shrink-on-load ms / MiB", "full decode ms / MiB", "speedup");
+
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+        size_t size = 0;
+        char* image = read_image(images[i], &size);
+        if (image == NULL) {
+            fprintf(stderr, "cannot read %s%s\n", DATA_DIR, images[i]);
+            return EXIT_FAILURE;
+        }
+
+        for (size_t res = 0; res < sizeof(resolutions) / sizeof(resolutions[0]); ++res) {
+            double shrink_ms = 0, shrink_mib = 0, full_ms = 0, full_mib = 0;
+            if (measure(image, size, res, 0, &shrink_ms, &shrink_mib) != ERR_NONE
+                || measure(image, size, res, 1, &full_ms, &full_mib) != ERR_NONE) {
+                fprintf(stderr, "cannot resize %s\n", images[i]);
+                free(image);
+                return EXIT_FAILURE;
+            }
+            printf("%16s %9zu %6s %13.2f / %7.1f %13.2f / %7.1f %7.1fx\n", images[i], size / 1024,
+                   resolutions[res].name, shrink_ms, shrink_mib, full_ms, full_mib,
+                   shrink_ms > 0 ? full_ms / shrink_ms : 0.0);
+        }
+        free(image);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file bench-resolution.c
+ * @brief Cost of get_resolution() on the test images, which parses the
+ *        JPEG frame header, and of the image library reference (a
+ *        VipsImage loaded from the buffer), as done on every insert.
+ */
+
+#include "bench.h"
+#include "error.h"
+#include "image_content.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vips/vips.h>
+
+#define NB_CALLS 10000
+
+static const char* const images[] = {
+    "papillon.jpg", "coquelicots.jpg", "brouillard.jpg", "foret.jpg", "mure.jpg"
+};
+
+// Resolution as it was read before the frame header parser
+static int reference_resolution(uint32_t* height, uint32_t* width, const char* image_buffer, size_t image_size)
+{
+    VipsImage* original = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_jpegload_buffer((void*) image_buffer, image_size, &original, NULL) != 0) return ERR_IMGLIB;
+#pragma GCC diagnostic pop
+
+    *height = (uint32_t) vips_image_get_height(original);
+    *width = (uint32_t) vips_image_get_width(original);
+    g_object_unref(VIPS_OBJECT(original));
+    return ERR_NONE;
+}
+
+static char* read_image(const char* name, size_t* size)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", DATA_DIR, name);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    char* buffer = NULL;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        const long len = ftell(file);
+        buffer = len > 0 ? malloc((size_t) len) : NULL;
+        if (buffer != NULL && (fseek(file, 0, SEEK_SET) != 0
+                               || fread(buffer, 1, (size_t) len, file) != (size_t) len)) {
+            free(buffer);
+            buffer = NULL;
+        }
+        *size = (size_t) len;
+    }
+    fclose(file);
+    return buffer;
+}
+
+// Average time (in ns) of a call, by get_resolution() or by the reference
+static double time_calls(const char* image, size_t size, int reference)
+{
+    uint32_t height = 0, width = 0;
+    size_t found = 0;
+
+    const double start = bench_now_ns();
+    for (size_t i = 0; i < NB_CALLS; ++i) {
+        const int err = reference ? reference_resolution(&height, &width, image, size)
+                        : get_resolution(&height, &width, image, size);
+        found += err == ERR_NONE && width > 0;
+    }
+    const double elapsed = bench_now_ns() - start;
+
+    if (found != NB_CALLS) fprintf(stderr, "unexpected get_resolution() result\n");
+    return elapsed / NB_CALLS;
+}
+
+int main(void)
+{
+    if (VIPS_INIT("bench-resolution")) return EXIT_FAILURE;
+    vips_cache_set_max(0); // Each load really creates its VipsImage
+
+    printf("%16s %9s %22s %22s\n", "image", "KiB", "frame header (ns/op)", "reference (ns/op)");
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+        size_t size = 0;
+        char* image = read_image(images[i], &size);
+        if (image == NULL) {
+            fprintf(stderr, "cannot read %s%s\n", DATA_DIR, images[i]);
+            return EXIT_FAILURE;
+        }
+
+        const double parsed = time_calls(image, size, 0);
+        const double reference = time_calls(image, size, 1);
+        printf("%16s %9zu %22.1f %22.1f\n", images[i], size / 1024, parsed, reference);
+        free(image);
+    }
+
+    vips_shutdown();
+    return EXIT_SUCCESS;
+}
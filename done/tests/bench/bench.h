@@ -0,0 +1,31 @@
+#pragma once
+
+/**
+ * @file bench.h
+ * @brief Small helpers shared by the micro-benchmarks
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Monotonic clock, in nanoseconds
+ */
+static inline double bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/**
+ * @brief Cheap deterministic pseudo-random generator (xorshift64)
+ */
+static inline uint64_t bench_random(void)
+{
+    static uint64_t state = 88172645463325252ULL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
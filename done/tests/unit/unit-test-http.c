@@ -298,6 +298,102 @@ START_TEST(http_get_var_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_parse_query_null_params)
+{
+    start_test_print;
+
+    struct http_query query;
+    struct http_string http_str = { .val = "", .len = 0 };
+    char buf;
+
+    ck_assert_invalid_arg(http_parse_query(NULL, &query));
+    ck_assert_invalid_arg(http_parse_query(&http_str, NULL));
+    ck_assert_invalid_arg(http_query_get(NULL, "", &buf, 1));
+    ck_assert_invalid_arg(http_query_get(&query, NULL, &buf, 1));
+    ck_assert_invalid_arg(http_query_get(&query, "", NULL, 1));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_query_decoded)
+{
+    start_test_print;
+
+    // As sent by index.html (encodeURIComponent()), but not null-terminated
+    const char str[] = "/imgfs/insert?&name=my%20photo%2B1.jpg&res=orig&flag&a+b=c%3d%26d&res=thumb" "#junk";
+    struct http_string http_str = { .val = str, .len = strlen(str) - strlen("#junk") };
+    struct http_query query;
+    char buf[32];
+
+    ck_assert_err_none(http_parse_query(&http_str, &query));
+    ck_assert_uint_eq(query.num_params, 5);
+    ck_assert_http_str_eq(query.params[0].name, "name");
+    ck_assert_http_str_eq(query.params[0].value, "my photo+1.jpg");
+    ck_assert_http_str_eq(query.params[2].name, "flag");
+    ck_assert_http_str_eq(query.params[2].value, "");
+
+    ck_assert_int_eq(http_query_get(&query, "name", buf, sizeof(buf)), 14);
+    ck_assert_str_eq(buf, "my photo+1.jpg");
+    ck_assert_int_eq(http_query_get(&query, "a b", buf, sizeof(buf)), 4);
+    ck_assert_str_eq(buf, "c=&d");
+    // The first one is taken
+    ck_assert_int_eq(http_query_get(&query, "res", buf, sizeof(buf)), 4);
+    ck_assert_str_eq(buf, "orig");
+    ck_assert_int_eq(http_query_get(&query, "flag", buf, sizeof(buf)), 0);
+    ck_assert_int_eq(http_query_get(&query, "na", buf, sizeof(buf)), 0);
+    ck_assert_err(http_query_get(&query, "name", buf, 14), ERR_RUNTIME);
+
+    // Same through http_get_var()
+    ck_assert_int_eq(http_get_var(&http_str, "name", buf, sizeof(buf)), 14);
+    ck_assert_str_eq(buf, "my photo+1.jpg");
+
+    // No query string
+    http_str.len = strlen("/imgfs/insert");
+    ck_assert_err_none(http_parse_query(&http_str, &query));
+    ck_assert_uint_eq(query.num_params, 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_query_invalid)
+{
+    start_test_print;
+
+    static const char* const invalid[] = {
+        "/imgfs/read?img_id=a%2", "/imgfs/read?img_id=a%zz", "/imgfs/read?img_id=a%00b", "/imgfs/read?%g=1"
+    };
+    struct http_query query;
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        const struct http_string http_str = { .val = invalid[i], .len = strlen(invalid[i]) };
+        ck_assert_invalid_arg(http_parse_query(&http_str, &query));
+        ck_assert_uint_eq(query.num_params, 0);
+    }
+
+    // Too many parameters
+    char str[8 * (MAX_QUERY_PARAMS + 1) + 2] = "/?";
+    for (size_t i = 0; i <= MAX_QUERY_PARAMS; ++i) strcat(str, "a=1&");
+    struct http_string http_str = { .val = str, .len = strlen(str) };
+    ck_assert_err(http_parse_query(&http_str, &query), ERR_RUNTIME);
+
+    // Too long once decoded
+    char* const long_str = calloc(1, MAX_QUERY_SIZE + 16);
+    ck_assert_ptr_nonnull(long_str);
+    strcpy(long_str, "/?a=");
+    memset(long_str + 4, 'x', MAX_QUERY_SIZE);
+    http_str.val = long_str;
+    http_str.len = strlen(long_str);
+    ck_assert_err(http_parse_query(&http_str, &query), ERR_RUNTIME);
+    free(long_str);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(http_parse_message_null_params)
 {
@@ -419,6 +515,171 @@ START_TEST(http_parse_message_full_headers_full_content)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_parse_message_browser_headers)
+{
+    start_test_print;
+
+    // Longer than the blocks the delimiters are searched by, with spaces,
+    // ':' and a lone '\r' in the values
+    const char *str =
+    "GET /imgfs/read?res=thumb&img_id=papillon HTTP/1.1" HTTP_LINE_DELIM
+    "Host: localhost:8000" HTTP_LINE_DELIM
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:131.0) Gecko/20100101 Firefox/131.0" HTTP_LINE_DELIM
+    "Referer: http://localhost:8000/index.html" HTTP_LINE_DELIM
+    "X-Odd: a\rb: c" HTTP_LINE_DELIM
+    "Priority: u=5, i" HTTP_HDR_END_DELIM;
+    struct http_message msg;
+    int content_len;
+
+    ck_assert_int_eq(http_parse_message(str, strlen(str), &msg, &content_len), 1);
+    ck_assert_int_eq(content_len, 0);
+
+    ck_assert_http_str_eq(msg.method, "GET");
+    ck_assert_http_str_eq(msg.uri, "/imgfs/read?res=thumb&img_id=papillon");
+
+    ck_assert_int_eq(msg.num_headers, 5);
+    ck_assert_has_header(&msg, "Host", "localhost:8000");
+    ck_assert_has_header(&msg, "User-Agent", "Mozilla/5.0 (X11; Linux x86_64; rv:131.0) Gecko/20100101 Firefox/131.0");
+    ck_assert_has_header(&msg, "Referer", "http://localhost:8000/index.html");
+    ck_assert_has_header(&msg, "X-Odd", "a\rb: c");
+    ck_assert_has_header(&msg, "Priority", "u=5, i");
+
+    // A header line without key
+    const char *no_key = "GET / HTTP/1.1" HTTP_LINE_DELIM "Host localhost" HTTP_HDR_END_DELIM;
+    ck_assert_int_lt(http_parse_message(no_key, strlen(no_key), &msg, &content_len), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_feed_null_params)
+{
+    start_test_print;
+
+    const char *str = "";
+    struct http_parser parser;
+    struct http_message msg;
+    int content_len;
+
+    http_parser_init(&parser);
+    http_parser_init(NULL);
+    ck_assert_invalid_arg(http_parser_feed(NULL, str, 0, &msg, &content_len));
+    ck_assert_invalid_arg(http_parser_feed(&parser, NULL, 0, &msg, &content_len));
+    ck_assert_invalid_arg(http_parser_feed(&parser, str, 0, NULL, &content_len));
+    ck_assert_invalid_arg(http_parser_feed(&parser, str, 0, &msg, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_feed_byte_by_byte)
+{
+    start_test_print;
+
+    // The body looks like the end of headers: it must only be counted
+    const char *str = "POST /imgfs/insert?name=a.jpg HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_LINE_DELIM
+                      "Content-Length: 8" HTTP_HDR_END_DELIM "ab" HTTP_HDR_END_DELIM "cd";
+    const size_t len = strlen(str);
+    const size_t header_len = strstr(str, HTTP_HDR_END_DELIM) + strlen(HTTP_HDR_END_DELIM) - str;
+    char stream[256] = { 0 };
+    struct http_parser parser;
+    struct http_message msg;
+    int content_len = 0;
+
+    http_parser_init(&parser);
+    for (size_t i = 1; i < len; ++i) {
+        stream[i - 1] = str[i - 1];
+        ck_assert_int_eq(http_parser_feed(&parser, stream, i, &msg, &content_len), 0);
+        ck_assert_uint_eq(parser.scanned, i < header_len ? i : header_len);
+        ck_assert_int_eq(content_len, i < header_len ? 0 : 8);
+    }
+    stream[len - 1] = str[len - 1];
+    ck_assert_int_eq(http_parser_feed(&parser, stream, len, &msg, &content_len), 1);
+
+    ck_assert_http_str_eq(msg.method, "POST");
+    ck_assert_http_str_eq(msg.uri, "/imgfs/insert?name=a.jpg");
+    ck_assert_int_eq(msg.num_headers, 2);
+    ck_assert_has_header(&msg, "Content-Length", "8");
+    ck_assert_http_str_eq(msg.body, "ab" HTTP_HDR_END_DELIM "cd");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_feed_taken_body)
+{
+    start_test_print;
+
+    const char *headers = "POST /imgfs/insert?name=a.jpg HTTP/1.1" HTTP_LINE_DELIM "Content-Length: 10" HTTP_HDR_END_DELIM;
+    const size_t header_len = strlen(headers);
+    char stream[256] = { 0 };
+    struct http_parser parser;
+    struct http_message msg;
+    int content_len = 0;
+
+    http_parser_init(&parser);
+    ck_assert_invalid_arg(http_parser_headers(NULL, stream, &msg));
+    ck_assert_invalid_arg(http_parser_headers(&parser, stream, &msg)); // Not received yet
+
+    // The headers and the start of the body: the body is taken out as it arrives
+    snprintf(stream, sizeof(stream), "%s%s", headers, "0123");
+    ck_assert_int_eq(http_parser_feed(&parser, stream, header_len + 4, &msg, &content_len), 0);
+    ck_assert_err_none(http_parser_headers(&parser, stream, &msg));
+    ck_assert_http_str_eq(msg.uri, "/imgfs/insert?name=a.jpg");
+    ck_assert_uint_eq(msg.body.len, 0);
+    http_parser_take_body(&parser, 4);
+    stream[header_len] = '\0';
+
+    // The rest of it, then the next message
+    snprintf(stream + header_len, sizeof(stream) - header_len, "%s", "456789GET");
+    ck_assert_int_eq(http_parser_feed(&parser, stream, header_len + 5, &msg, &content_len), 0);
+    ck_assert_int_eq(http_parser_feed(&parser, stream, header_len + 9, &msg, &content_len), 1);
+    ck_assert_int_eq(content_len, 10);
+    ck_assert_http_str_eq(msg.body, "456789");
+    ck_assert_uint_eq(http_parser_message_len(&parser), header_len + 6);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_feed_moved_stream)
+{
+    start_test_print;
+
+    const char *str = "GET /imgfs/list HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_HDR_END_DELIM;
+    const size_t len = strlen(str);
+    const size_t split = len - 3; // In the middle of the end of the headers
+    struct http_parser parser;
+    struct http_message msg;
+    int content_len = 0;
+
+    http_parser_init(&parser);
+    char *stream = calloc(1, len + 1);
+    ck_assert_ptr_nonnull(stream);
+    memcpy(stream, str, split);
+    ck_assert_int_eq(http_parser_feed(&parser, stream, split, &msg, &content_len), 0);
+
+    // The buffer grows (and moves) in between
+    char *moved = calloc(1, 2 * len);
+    ck_assert_ptr_nonnull(moved);
+    memcpy(moved, str, len);
+    free(stream);
+    ck_assert_int_eq(http_parser_feed(&parser, moved, len, &msg, &content_len), 1);
+    ck_assert_int_eq(content_len, 0);
+    ck_assert_http_str_eq(msg.uri, "/imgfs/list");
+    ck_assert_ptr_eq(msg.uri.val, moved + strlen("GET "));
+
+    free(moved);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *http_test_suite()
 {
@@ -441,11 +702,21 @@ Suite *http_test_suite()
     Add_Test(s, http_get_var_too_big);
     Add_Test(s, http_get_var_valid);
 
+    Add_Test(s, http_parse_query_null_params);
+    Add_Test(s, http_parse_query_decoded);
+    Add_Test(s, http_parse_query_invalid);
+
     Add_Test(s, http_parse_message_null_params);
     Add_Test(s, http_parse_message_partial_headers);
     Add_Test(s, http_parse_message_full_headers_no_content);
     Add_Test(s, http_parse_message_full_headers_partial_content);
     Add_Test(s, http_parse_message_full_headers_full_content);
+    Add_Test(s, http_parse_message_browser_headers);
+
+    Add_Test(s, http_parser_feed_null_params);
+    Add_Test(s, http_parser_feed_byte_by_byte);
+    Add_Test(s, http_parser_feed_moved_stream);
+    Add_Test(s, http_parser_feed_taken_body);
 
     return s;
 }
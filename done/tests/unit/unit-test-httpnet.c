@@ -0,0 +1,580 @@
+#include "http_net.h"
+#include "error.h"
+#include "util.h"
+#include "test.h"
+#include <check.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PIPELINED_REPLY(BODY) HTTP_PROTOCOL_ID HTTP_OK HTTP_LINE_DELIM "Content-Length: %zu" HTTP_HDR_END_DELIM BODY
+
+#define BIG_SIZE (4 * 1024 * 1024) // More than the socket buffers take
+
+// Counts the calls to the FileReadCallback
+static void count_done(void* arg)
+{
+    ++*(int*) arg;
+}
+
+// Creates a file of size bytes (byte i being i % 251), already unlinked
+static int make_file(size_t size)
+{
+    char path[] = "/tmp/imgfs-httpnet-XXXXXX";
+    const int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    unlink(path);
+
+    char* content = malloc(size);
+    ck_assert_ptr_nonnull(content);
+    for (size_t i = 0; i < size; ++i) content[i] = (char) (i % 251);
+    ck_assert_int_eq(pwrite(fd, content, size, 0), (ssize_t) size);
+    free(content);
+    return fd;
+}
+
+struct client {
+    int fd;
+    const int* done_calls;
+    int done_before_reading;    // Whether the callback was called before the client started reading
+    char* received;
+    size_t len;
+};
+
+// Reads everything sent on the socket (after a while, like a slow client)
+static void* slow_client(void* arg)
+{
+    struct client* const client = arg;
+    usleep(200000);
+    client->done_before_reading = *client->done_calls;
+
+    size_t size = BIG_SIZE + MAX_HEADER_SIZE;
+    client->received = malloc(size);
+    ssize_t bytes_read = 0;
+    while (client->received != NULL
+           && (bytes_read = read(client->fd, client->received + client->len, size - client->len)) > 0) {
+        client->len += (size_t) bytes_read;
+    }
+    return NULL;
+}
+
+// ======================================================================
+START_TEST(http_reply_file_null_params)
+{
+    start_test_print;
+
+    int sockets[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+
+    // The callback is called anyway
+    int done_calls = 0;
+    ck_assert_invalid_arg(http_reply_file(sockets[0], NULL, "", 0, 0, 1, count_done, &done_calls));
+    ck_assert_invalid_arg(http_reply_file(sockets[0], HTTP_OK, NULL, 0, 0, 1, count_done, &done_calls));
+    ck_assert_invalid_arg(http_reply_file(sockets[0], HTTP_OK, "", -1, 0, 1, count_done, &done_calls));
+    ck_assert_int_eq(done_calls, 3);
+
+    close(sockets[0]);
+    close(sockets[1]);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_reply_file_valid)
+{
+    start_test_print;
+
+    const int fd = make_file(1000);
+    int sockets[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+
+    int done_calls = 0;
+    ck_assert_err_none(http_reply_file(sockets[0], HTTP_OK, "Content-Type: image/jpeg" HTTP_LINE_DELIM,
+                                       fd, 100, 500, count_done, &done_calls));
+    ck_assert_int_eq(done_calls, 1);
+    close(sockets[0]);
+
+    char received[1024];
+    size_t len = 0;
+    ssize_t bytes_read = 0;
+    while ((bytes_read = read(sockets[1], received + len, sizeof(received) - len)) > 0) {
+        len += (size_t) bytes_read;
+    }
+
+    const char expected_header[] = HTTP_PROTOCOL_ID HTTP_OK HTTP_LINE_DELIM
+                                   "Content-Type: image/jpeg" HTTP_LINE_DELIM
+                                   "Content-Length: 500" HTTP_HDR_END_DELIM;
+    const size_t header_len = strlen(expected_header);
+    ck_assert_uint_eq(len, header_len + 500);
+    ck_assert_mem_eq(received, expected_header, header_len);
+    for (size_t i = 0; i < 500; ++i) ck_assert_int_eq(received[header_len + i], (char) ((100 + i) % 251));
+
+    close(sockets[1]);
+    close(fd);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_reply_file_slow_client)
+{
+    start_test_print;
+
+    const int fd = make_file(BIG_SIZE);
+    int sockets[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+
+    int done_calls = 0;
+    struct client client = { .fd = sockets[1], .done_calls = &done_calls };
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, slow_client, &client), 0);
+
+    ck_assert_err_none(http_reply_file(sockets[0], HTTP_OK, "", fd, 0, BIG_SIZE, count_done, &done_calls));
+    close(sockets[0]);
+    pthread_join(thread, NULL);
+
+    // The file is not kept waiting on the client
+    ck_assert_int_eq(done_calls, 1);
+    ck_assert_int_eq(client.done_before_reading, 1);
+
+    ck_assert_ptr_nonnull(client.received);
+    ck_assert_uint_gt(client.len, BIG_SIZE);
+    const size_t header_len = client.len - BIG_SIZE;
+    for (size_t i = 0; i < BIG_SIZE; ++i) ck_assert_int_eq(client.received[header_len + i], (char) (i % 251));
+
+    free(client.received);
+    close(sockets[1]);
+    close(fd);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_reply_file_client_not_reading)
+{
+    start_test_print;
+
+    const int fd = make_file(1000);
+    int sockets[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+
+    // The client does not read a previous reply: the socket takes nothing more
+    ck_assert_int_eq(fcntl(sockets[0], F_SETFL, O_NONBLOCK), 0);
+    static const char filler[4096];
+    size_t filled = 0;
+    ssize_t bytes_sent = 0;
+    while ((bytes_sent = write(sockets[0], filler, sizeof(filler))) > 0) filled += (size_t) bytes_sent;
+    ck_assert_int_eq(fcntl(sockets[0], F_SETFL, 0), 0);
+    ck_assert_uint_gt(filled, 0);
+    ck_assert_uint_lt(filled, BIG_SIZE);
+
+    int done_calls = 0;
+    struct client client = { .fd = sockets[1], .done_calls = &done_calls };
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, slow_client, &client), 0);
+
+    ck_assert_err_none(http_reply_file(sockets[0], HTTP_OK, "", fd, 0, 1000, count_done, &done_calls));
+    close(sockets[0]);
+    pthread_join(thread, NULL);
+
+    // The file is not kept waiting on the client, even for the headers
+    ck_assert_int_eq(done_calls, 1);
+    ck_assert_int_eq(client.done_before_reading, 1);
+
+    const char expected_header[] = HTTP_PROTOCOL_ID HTTP_OK HTTP_LINE_DELIM
+                                   "Content-Length: 1000" HTTP_HDR_END_DELIM;
+    const size_t header_len = strlen(expected_header);
+    ck_assert_ptr_nonnull(client.received);
+    ck_assert_uint_eq(client.len, filled + header_len + 1000);
+    ck_assert_mem_eq(client.received + filled, expected_header, header_len);
+    for (size_t i = 0; i < 1000; ++i) ck_assert_int_eq(client.received[filled + header_len + i], (char) (i % 251));
+
+    free(client.received);
+    close(sockets[1]);
+    close(fd);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_reply_iov_null_params)
+{
+    start_test_print;
+
+    struct iovec body[MAX_BODY_IOV + 1] = { { .iov_base = NULL, .iov_len = 1 } };
+    ck_assert_invalid_arg(http_reply_iov(0, NULL, "", NULL, 0));
+    ck_assert_invalid_arg(http_reply_iov(0, HTTP_OK, NULL, NULL, 0));
+    ck_assert_invalid_arg(http_reply_iov(0, HTTP_OK, "", NULL, 1));
+    ck_assert_invalid_arg(http_reply_iov(0, HTTP_OK, "", body, 1));
+    body[0].iov_len = 0;
+    ck_assert_invalid_arg(http_reply_iov(0, HTTP_OK, "", body, MAX_BODY_IOV + 1));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_reply_iov_valid)
+{
+    start_test_print;
+
+    int sockets[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+
+    char first[] = "Hello";
+    char second[] = ", world";
+    const struct iovec body[] = {
+        { .iov_base = first, .iov_len = strlen(first) },
+        { .iov_base = NULL, .iov_len = 0 },
+        { .iov_base = second, .iov_len = strlen(second) }
+    };
+    ck_assert_err_none(http_reply_iov(sockets[0], HTTP_OK, "X-Test: 1" HTTP_LINE_DELIM, body, 3));
+    close(sockets[0]);
+
+    char received[256] = { 0 };
+    size_t len = 0;
+    ssize_t bytes_read = 0;
+    while ((bytes_read = read(sockets[1], received + len, sizeof(received) - 1 - len)) > 0) {
+        len += (size_t) bytes_read;
+    }
+    ck_assert_str_eq(received, HTTP_PROTOCOL_ID HTTP_OK HTTP_LINE_DELIM "X-Test: 1" HTTP_LINE_DELIM
+                     "Content-Length: 12" HTTP_HDR_END_DELIM "Hello, world");
+
+    close(sockets[1]);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_reply_iov_big_body)
+{
+    start_test_print;
+
+    int sockets[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+
+    // Much more than the socket buffers take: sent as the client reads it
+    char* const content = malloc(BIG_SIZE);
+    ck_assert_ptr_nonnull(content);
+    for (size_t i = 0; i < BIG_SIZE; ++i) content[i] = (char) (i % 251);
+    const struct iovec body[] = {
+        { .iov_base = content, .iov_len = BIG_SIZE / 2 },
+        { .iov_base = content + BIG_SIZE / 2, .iov_len = BIG_SIZE - BIG_SIZE / 2 }
+    };
+
+    int done_calls = 0;
+    struct client client = { .fd = sockets[1], .done_calls = &done_calls };
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, slow_client, &client), 0);
+
+    ck_assert_err_none(http_reply_iov(sockets[0], HTTP_OK, "", body, 2));
+    close(sockets[0]);
+    pthread_join(thread, NULL);
+
+    ck_assert_ptr_nonnull(client.received);
+    ck_assert_uint_gt(client.len, BIG_SIZE);
+    ck_assert_mem_eq(client.received + client.len - BIG_SIZE, content, BIG_SIZE);
+
+    free(client.received);
+    free(content);
+    close(sockets[1]);
+
+    end_test_print;
+}
+END_TEST
+
+// Replies with the URI and the body of the request
+static int echo_request(struct http_message* message, int connection)
+{
+    char body[64];
+    const int len = snprintf(body, sizeof(body), "%.*s%.*s", (int) message->uri.len, message->uri.val,
+                             (int) message->body.len, message->body.val);
+    return http_reply(connection, HTTP_OK, "", body, (size_t) len);
+}
+
+struct pipelining_client {
+    uint16_t port;
+    char received[1024];
+    size_t len;
+    size_t expected_len;
+    volatile int done;
+};
+
+// Sends several requests without waiting for the replies (the last one in two parts), then reads them all
+static void* pipelining_client(void* arg)
+{
+    struct pipelining_client* const client = arg;
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(client->port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd >= 0 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+        const char first[] = "GET /a HTTP/1.1" HTTP_LINE_DELIM "Host: localhost" HTTP_HDR_END_DELIM
+                             "POST /b HTTP/1.1" HTTP_LINE_DELIM "Content-Length: 5" HTTP_HDR_END_DELIM "hello"
+                             "GET /c HTTP/1.1" HTTP_HDR_END_DELIM
+                             "GET /d HTTP/1.1" HTTP_LINE_DELIM;
+        const char last[] = HTTP_LINE_DELIM;
+        ssize_t bytes = write(fd, first, strlen(first));
+        usleep(50000);
+        if (bytes > 0) bytes = write(fd, last, strlen(last));
+
+        while (bytes > 0 && client->len < client->expected_len) {
+            bytes = read(fd, client->received + client->len, sizeof(client->received) - 1 - client->len);
+            if (bytes > 0) client->len += (size_t) bytes;
+        }
+    }
+
+    client->done = 1;
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+// Pipelined requests are all replied to, in order, in the mode switch_mode switches to (NULL: blocking)
+static void check_pipelining(int (*switch_mode)(void))
+{
+    const int passive = http_init(0, echo_request);
+    ck_assert_int_ge(passive, 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    ck_assert_int_eq(getsockname(passive, (struct sockaddr*) &addr, &addr_len), 0);
+
+    if (switch_mode != NULL && switch_mode() != ERR_NONE) {
+        test_print("mode unavailable: skipped\n");
+        http_close();
+        return;
+    }
+
+    char expected[1024];
+    const int expected_len = snprintf(expected, sizeof(expected),
+                                      PIPELINED_REPLY("/a") PIPELINED_REPLY("/bhello")
+                                      PIPELINED_REPLY("/c") PIPELINED_REPLY("/d"),
+                                      strlen("/a"), strlen("/bhello"), strlen("/c"), strlen("/d"));
+
+    struct pipelining_client client = { .port = ntohs(addr.sin_port), .expected_len = (size_t) expected_len };
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, pipelining_client, &client), 0);
+
+    // Blocking: until the client leaves; loops: its leaving is the last event
+    do {
+        ck_assert_err_none(http_receive());
+    } while (switch_mode != NULL && !client.done);
+    pthread_join(thread, NULL);
+    http_close();
+
+    ck_assert_uint_eq(client.len, client.expected_len);
+    ck_assert_str_eq(client.received, expected);
+}
+
+// ======================================================================
+START_TEST(http_receive_pipelined)
+{
+    start_test_print;
+
+    check_pipelining(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_receive_pipelined_event_loop)
+{
+    start_test_print;
+
+    check_pipelining(http_use_event_loop);
+    check_pipelining(http_use_io_uring);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+#define STREAMED_SIZE 300000 // Several pieces
+
+// What the streaming handlers saw
+static struct {
+    size_t received;    // Bytes of the last body, each checked (byte i being i % 251)
+    size_t max_piece;
+    int wrong;          // Whether a byte was not the expected one
+    int started;
+    int finished;
+    int aborted;
+} streamed;
+
+static void* stream_start(const struct http_message* message, size_t content_len)
+{
+    if (!http_match_uri(message, "/s") || content_len != STREAMED_SIZE || message->body.len != 0) return NULL;
+    ++streamed.started;
+    streamed.received = 0;
+    return &streamed;
+}
+
+static int stream_write(void* state, const char* data, size_t len)
+{
+    ck_assert_ptr_eq(state, &streamed);
+    for (size_t i = 0; i < len; ++i) {
+        streamed.wrong |= (unsigned char) data[i] != (streamed.received + i) % 251;
+    }
+    streamed.received += len;
+    if (len > streamed.max_piece) streamed.max_piece = len;
+    return ERR_NONE;
+}
+
+static int stream_finish(void* state, struct http_message* message, int connection)
+{
+    ck_assert_ptr_eq(state, &streamed);
+    ck_assert_uint_eq(message->body.len, 0);
+    ++streamed.finished;
+    char body[64];
+    const int len = snprintf(body, sizeof(body), "%.*s%zu", (int) message->uri.len, message->uri.val,
+                             streamed.received);
+    return http_reply(connection, HTTP_OK, "", body, (size_t) len);
+}
+
+static void stream_abort(void* state)
+{
+    ck_assert_ptr_eq(state, &streamed);
+    ++streamed.aborted;
+}
+
+// Sends the body of a streamed request from byte from to byte to
+static ssize_t send_streamed(int fd, size_t from, size_t to)
+{
+    char piece[4096];
+    ssize_t bytes = 1;
+    while (bytes > 0 && from < to) {
+        const size_t len = MIN(sizeof(piece), to - from);
+        for (size_t i = 0; i < len; ++i) piece[i] = (char) ((from + i) % 251);
+        bytes = write(fd, piece, len);
+        if (bytes > 0) from += (size_t) bytes;
+    }
+    return bytes;
+}
+
+// Leaves in the middle of a streamed body, then sends one whole, with a request pipelined after it
+static void* streaming_client(void* arg)
+{
+    struct pipelining_client* const client = arg;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(client->port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    char headers[128];
+    const int headers_len = snprintf(headers, sizeof(headers), "POST /s HTTP/1.1" HTTP_LINE_DELIM
+                                     "Content-Length: %d" HTTP_HDR_END_DELIM, STREAMED_SIZE);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0
+        && write(fd, headers, (size_t) headers_len) == headers_len) {
+        send_streamed(fd, 0, 1000);
+        usleep(50000);
+    }
+    if (fd >= 0) close(fd);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0
+        && write(fd, headers, (size_t) headers_len) == headers_len) {
+        ssize_t bytes = send_streamed(fd, 0, 1000);
+        usleep(50000);
+        if (bytes > 0) bytes = send_streamed(fd, 1000, STREAMED_SIZE);
+        const char next[] = "GET /c HTTP/1.1" HTTP_HDR_END_DELIM;
+        if (bytes > 0) bytes = write(fd, next, strlen(next));
+
+        while (bytes > 0 && client->len < client->expected_len) {
+            bytes = read(fd, client->received + client->len, sizeof(client->received) - 1 - client->len);
+            if (bytes > 0) client->len += (size_t) bytes;
+        }
+    }
+
+    client->done = 1;
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+// A streamed body goes to the handlers by pieces, in the mode switch_mode switches to (NULL: blocking)
+static void check_streaming(int (*switch_mode)(void))
+{
+    const int passive = http_init(0, echo_request);
+    ck_assert_int_ge(passive, 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    ck_assert_int_eq(getsockname(passive, (struct sockaddr*) &addr, &addr_len), 0);
+
+    if (switch_mode != NULL && switch_mode() != ERR_NONE) {
+        test_print("mode unavailable: skipped\n");
+        http_close();
+        return;
+    }
+    const struct http_body_stream stream = { stream_start, stream_write, stream_finish, stream_abort };
+    ck_assert_invalid_arg(http_stream_bodies(NULL));
+    ck_assert_err_none(http_stream_bodies(&stream));
+    memset(&streamed, 0, sizeof(streamed));
+
+    char expected[1024];
+    const int expected_len = snprintf(expected, sizeof(expected),
+                                      PIPELINED_REPLY("/s%d") PIPELINED_REPLY("/c"),
+                                      strlen("/s") + 6, STREAMED_SIZE, strlen("/c"));
+
+    struct pipelining_client client = { .port = ntohs(addr.sin_port), .expected_len = (size_t) expected_len };
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, streaming_client, &client), 0);
+
+    // Blocking: one call per connection
+    ck_assert_err_none(http_receive());
+    do {
+        ck_assert_err_none(http_receive());
+    } while (switch_mode != NULL && !client.done);
+    pthread_join(thread, NULL);
+    http_close();
+
+    ck_assert_str_eq(client.received, expected);
+    ck_assert_uint_eq(streamed.received, STREAMED_SIZE);
+    ck_assert_int_eq(streamed.wrong, 0);
+    ck_assert_int_eq(streamed.started, 2);
+    ck_assert_int_eq(streamed.finished, 1);
+    ck_assert_int_eq(streamed.aborted, 1);
+    ck_assert_uint_le(streamed.max_piece, 65536); // Never more than a small buffer
+}
+
+// ======================================================================
+START_TEST(http_receive_streamed)
+{
+    start_test_print;
+
+    check_streaming(NULL);
+    check_streaming(http_use_event_loop);
+    check_streaming(http_use_io_uring);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *httpnet_test_suite()
+{
+    Suite *s = suite_create("Tests for the HTTP network layer");
+
+    Add_Test(s, http_reply_file_null_params);
+    Add_Test(s, http_reply_file_valid);
+    Add_Test(s, http_reply_file_slow_client);
+    Add_Test(s, http_reply_file_client_not_reading);
+    Add_Test(s, http_reply_iov_null_params);
+    Add_Test(s, http_reply_iov_valid);
+    Add_Test(s, http_reply_iov_big_body);
+    Add_Test(s, http_receive_pipelined);
+    Add_Test(s, http_receive_pipelined_event_loop);
+    Add_Test(s, http_receive_streamed);
+
+    return s;
+}
+
+TEST_SUITE(httpnet_test_suite)
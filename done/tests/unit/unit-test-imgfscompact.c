@@ -0,0 +1,341 @@
+#include "imgfs.h"
+#include "imgfs_compact.h"
+#include "test.h"
+#include "util.h"
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define METADATA_END_test02 21664 // sizeof(struct imgfs_header) + 100 * sizeof(struct img_metadata)
+#define SIZE_test02        192659
+#define SIZE_THUMB          12319 // coquelicots_thumb.jpg
+
+static long file_size(const char* filename)
+{
+    FILE* file = fopen(filename, "rb");
+    ck_assert_ptr_nonnull(file);
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+// test02 with a small image appended then pic1 deleted: the small image fits in the hole
+static void make_fragmented(const char* dump, struct imgfs_file* file)
+{
+    char image[SIZE_THUMB];
+    read_file(image, DATA_DIR "coquelicots_thumb.jpg", SIZE_THUMB);
+
+    ck_assert_err_none(do_open(dump, "rb+", file));
+    ck_assert_err_none(do_insert(image, SIZE_THUMB, "pic3", file));
+    ck_assert_err_none(do_delete("pic1", file));
+    fflush(file->file);
+    ck_assert_int_eq(file_size(dump), SIZE_test02 + SIZE_THUMB);
+}
+
+// ======================================================================
+START_TEST(imgfs_compact_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct imgfs_relocation relocation;
+    uint32_t copied = 0;
+    zero_init_var(file);
+    zero_init_var(relocation);
+
+    ck_assert_invalid_arg(imgfs_compact_plan(NULL, &relocation));
+    ck_assert_invalid_arg(imgfs_compact_plan(&file, &relocation));
+    ck_assert_invalid_arg(imgfs_compact_copy(NULL, &relocation, &copied, 1));
+    ck_assert_invalid_arg(imgfs_compact_copy(&file, &relocation, &copied, 1));
+    ck_assert_invalid_arg(imgfs_compact_commit(NULL, &relocation));
+    ck_assert_invalid_arg(imgfs_compact_commit(&file, &relocation));
+
+    struct imgfs_stats stats;
+    ck_assert_invalid_arg(imgfs_get_stats(NULL, &stats));
+    ck_assert_invalid_arg(imgfs_get_stats(&file, &stats));
+    ck_assert_invalid_arg(do_stats(NULL, STDOUT, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_compact_nothing_to_do)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct imgfs_relocation relocation;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    ck_assert_err_none(imgfs_compact_plan(&file, &relocation));
+    ck_assert_uint_eq(relocation.size, 0);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_compact_relocate_tail)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct imgfs_relocation relocation;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    make_fragmented(dump, &file);
+
+    ck_assert_err_none(imgfs_compact_plan(&file, &relocation));
+    ck_assert_uint_eq(relocation.from, SIZE_test02);
+    ck_assert_uint_eq(relocation.to, METADATA_END_test02);
+    ck_assert_uint_eq(relocation.size, SIZE_THUMB);
+
+    // Bounded steps
+    uint32_t copied = 0;
+    ck_assert_err_none(imgfs_compact_copy(&file, &relocation, &copied, 4096));
+    ck_assert_uint_eq(copied, 4096);
+    while (copied < relocation.size) {
+        ck_assert_err_none(imgfs_compact_copy(&file, &relocation, &copied, 4096));
+    }
+    ck_assert_uint_eq(copied, SIZE_THUMB);
+
+    ck_assert_err_none(imgfs_compact_commit(&file, &relocation));
+    ck_assert_int_eq(file_size(dump), SIZE_test02);
+
+    char expected[SIZE_THUMB];
+    read_file(expected, DATA_DIR "coquelicots_thumb.jpg", SIZE_THUMB);
+    char* image = NULL;
+    uint32_t image_size = 0;
+    ck_assert_err_none(do_read("pic3", ORIG_RES, &image, &image_size, &file));
+    ck_assert_uint_eq(image_size, SIZE_THUMB);
+    ck_assert_mem_eq(image, expected, SIZE_THUMB);
+    free(image);
+
+    // Nothing left to do
+    ck_assert_err_none(imgfs_compact_plan(&file, &relocation));
+    ck_assert_uint_eq(relocation.size, 0);
+    do_close(&file);
+
+    // The new offset is on disk
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err_none(do_read("pic3", ORIG_RES, &image, &image_size, &file));
+    ck_assert_mem_eq(image, expected, SIZE_THUMB);
+    free(image);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_compact_shared_blob)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct imgfs_relocation relocation;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    make_fragmented(dump, &file);
+
+    // pic4 shares the content of pic3 (deduplication)
+    char image[SIZE_THUMB];
+    read_file(image, DATA_DIR "coquelicots_thumb.jpg", SIZE_THUMB);
+    ck_assert_err_none(do_insert(image, SIZE_THUMB, "pic4", &file));
+    ck_assert_int_eq(file_size(dump), SIZE_test02 + SIZE_THUMB);
+
+    // Counted once
+    struct imgfs_stats stats;
+    ck_assert_err_none(imgfs_get_stats(&file, &stats));
+    ck_assert_uint_eq(stats.live_bytes, 98119 + SIZE_THUMB);
+    ck_assert_uint_eq(stats.dead_bytes, 72876);
+
+    ck_assert_err_none(imgfs_compact_plan(&file, &relocation));
+    ck_assert_uint_eq(relocation.from, SIZE_test02);
+    ck_assert_uint_eq(relocation.size, SIZE_THUMB);
+    uint32_t copied = 0;
+    ck_assert_err_none(imgfs_compact_copy(&file, &relocation, &copied, SIZE_THUMB));
+    ck_assert_err_none(imgfs_compact_commit(&file, &relocation));
+    ck_assert_int_eq(file_size(dump), SIZE_test02);
+
+    // Both entries use the relocated blob
+    const char* const ids[] = { "pic3", "pic4" };
+    for (size_t i = 0; i < 2; ++i) {
+        char* read = NULL;
+        uint32_t read_size = 0;
+        ck_assert_err_none(do_read(ids[i], ORIG_RES, &read, &read_size, &file));
+        ck_assert_uint_eq(read_size, SIZE_THUMB);
+        ck_assert_mem_eq(read, image, SIZE_THUMB);
+        free(read);
+    }
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_compact_deleted_meanwhile)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct imgfs_relocation relocation;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    make_fragmented(dump, &file);
+
+    ck_assert_err_none(imgfs_compact_plan(&file, &relocation));
+    uint32_t copied = 0;
+    ck_assert_err_none(imgfs_compact_copy(&file, &relocation, &copied, SIZE_THUMB));
+
+    // The relocated image is deleted before the commit: only the dead end goes
+    ck_assert_err_none(do_delete("pic3", &file));
+    ck_assert_err_none(imgfs_compact_commit(&file, &relocation));
+    ck_assert_int_eq(file_size(dump), SIZE_test02);
+    ck_assert_uint_eq(file.metadata[1].offset[ORIG_RES], 94540);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_compact_truncate_only)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct imgfs_relocation relocation;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_delete("pic2", &file));
+
+    ck_assert_err_none(imgfs_compact_plan(&file, &relocation));
+    ck_assert_uint_eq(relocation.size, 0);
+    ck_assert_err_none(imgfs_compact_commit(&file, &relocation));
+    ck_assert_int_eq(file_size(dump), METADATA_END_test02 + 72876);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_compact_during_upload)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct imgfs_relocation relocation;
+    struct imgfs_upload upload;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    make_fragmented(dump, &file);
+
+    char image[SIZE_THUMB];
+    read_file(image, DATA_DIR "coquelicots_thumb.jpg", SIZE_THUMB);
+    ck_assert_err_none(do_insert_begin("pic4", 1000, &file, &upload));
+    ck_assert_err_none(do_insert_write(&upload, image, 1000, &file));
+
+    // The content being uploaded is neither written over nor cut off
+    ck_assert_err_none(imgfs_compact_plan(&file, &relocation));
+    ck_assert_uint_eq(relocation.size, 0);
+    ck_assert_err_none(imgfs_compact_commit(&file, &relocation));
+    ck_assert_int_eq(file_size(dump), SIZE_test02 + SIZE_THUMB + 1000);
+
+    do_insert_abort(&upload, &file);
+    ck_assert_int_eq(file_size(dump), SIZE_test02 + SIZE_THUMB);
+    ck_assert_err_none(imgfs_compact_plan(&file, &relocation));
+    ck_assert_uint_eq(relocation.size, SIZE_THUMB);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_stats_no_dead_bytes)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct imgfs_stats stats;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    ck_assert_err_none(imgfs_get_stats(&file, &stats));
+    ck_assert_uint_eq(stats.file_size, SIZE_test02);
+    ck_assert_uint_eq(stats.metadata_size, METADATA_END_test02);
+    ck_assert_uint_eq(stats.live_bytes, 72876 + 98119);
+    ck_assert_uint_eq(stats.dead_bytes, 0);
+    ck_assert_double_eq_tol(imgfs_dead_ratio(&stats), 0.0, 1e-9);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_stats_dead_bytes)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct imgfs_stats stats;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    make_fragmented(dump, &file);
+
+    // pic1 is dead, pic2 and pic3 live
+    ck_assert_err_none(imgfs_get_stats(&file, &stats));
+    ck_assert_uint_eq(stats.file_size, SIZE_test02 + SIZE_THUMB);
+    ck_assert_uint_eq(stats.live_bytes, 98119 + SIZE_THUMB);
+    ck_assert_uint_eq(stats.dead_bytes, 72876);
+    ck_assert_double_eq_tol(imgfs_dead_ratio(&stats), 72876.0 / (72876 + 98119 + SIZE_THUMB), 1e-9);
+
+    // Reclaimed by a compaction
+    struct imgfs_relocation relocation;
+    uint32_t copied = 0;
+    ck_assert_err_none(imgfs_compact_plan(&file, &relocation));
+    ck_assert_err_none(imgfs_compact_copy(&file, &relocation, &copied, SIZE_THUMB));
+    ck_assert_err_none(imgfs_compact_commit(&file, &relocation));
+    ck_assert_err_none(imgfs_get_stats(&file, &stats));
+    ck_assert_uint_eq(stats.file_size, SIZE_test02);
+    ck_assert_uint_eq(stats.dead_bytes, 72876 - SIZE_THUMB);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_compact_test_suite()
+{
+    Suite *s = suite_create("Tests for the online compaction of an imgFS");
+
+    Add_Test(s, imgfs_compact_null_params);
+    Add_Test(s, imgfs_compact_nothing_to_do);
+    Add_Test(s, imgfs_compact_relocate_tail);
+    Add_Test(s, imgfs_compact_shared_blob);
+    Add_Test(s, imgfs_compact_deleted_meanwhile);
+    Add_Test(s, imgfs_compact_truncate_only);
+    Add_Test(s, imgfs_compact_during_upload);
+    Add_Test(s, imgfs_stats_no_dead_bytes);
+    Add_Test(s, imgfs_stats_dead_bytes);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_compact_test_suite)
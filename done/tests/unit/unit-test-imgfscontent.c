@@ -2,6 +2,8 @@
 #include "imgfs.h"
 #include "test.h"
 #include <check.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <vips/vips.h>
 
 #if VIPS_MINOR_VERSION >= 15
@@ -262,6 +264,279 @@ START_TEST(lazily_resize_valid_fallible)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(lazily_resize_all_valid)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+
+    ck_assert_invalid_arg(lazily_resize_all(NULL, 0));
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err(lazily_resize_all(&file, 218), ERR_INVALID_IMGID);
+    ck_assert_err(lazily_resize_all(&file, 3), ERR_INVALID_IMGID);
+
+    ck_assert_uint_eq(file.metadata[0].size[THUMB_RES], 0);
+    ck_assert_uint_eq(file.metadata[0].size[SMALL_RES], 0);
+    ck_assert_err_none(lazily_resize_all(&file, 0));
+
+    // Both appended at once, one after the other
+    const uint32_t thumb_size = file.metadata[0].size[THUMB_RES];
+    const uint32_t small_size = file.metadata[0].size[SMALL_RES];
+    ck_assert_uint_ne(thumb_size, 0);
+    ck_assert_uint_ne(small_size, 0);
+    ck_assert_uint_eq(file.metadata[0].offset[THUMB_RES], 192659);
+    ck_assert_uint_eq(file.metadata[0].offset[SMALL_RES], 192659 + thumb_size);
+
+    // Each of them fits in its resolution (papillon is 1200 x 800)
+    for (int res = THUMB_RES; res <= SMALL_RES; ++res) {
+        char* content = NULL;
+        uint32_t content_size = 0;
+        uint32_t width = 0, height = 0;
+        ck_assert_err_none(do_read(file.metadata[0].img_id, res, &content, &content_size, &file));
+        ck_assert_err_none(get_resolution(&height, &width, content, content_size));
+        ck_assert_uint_eq(width, file.header.resized_res[2 * res]);
+        ck_assert_uint_le(height, file.header.resized_res[2 * res + 1]);
+        free(content);
+    }
+
+    // Nothing left to create
+    ck_assert_err_none(lazily_resize_all(&file, 0));
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    ck_assert_uint_eq(ftell(file.file), 192659 + thumb_size + small_size);
+
+    do_close(&file);
+
+    // Checks that metadata is correctly persisted
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_uint_eq(file.metadata[0].offset[THUMB_RES], 192659);
+    ck_assert_uint_eq(file.metadata[0].size[THUMB_RES], thumb_size);
+    ck_assert_uint_eq(file.metadata[0].offset[SMALL_RES], 192659 + thumb_size);
+    ck_assert_uint_eq(file.metadata[0].size[SMALL_RES], small_size);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(resize_image_fits)
+{
+    start_test_print;
+
+    void* image = NULL;
+    size_t image_size = 0;
+    void* resized = NULL;
+    size_t resized_size = 0;
+    read_file_and_size(&image, DATA_DIR "/papillon.jpg", &image_size);
+
+    ck_assert_invalid_arg(resize_image(NULL, image_size, 64, 64, &resized, &resized_size));
+    ck_assert_invalid_arg(resize_image(image, image_size, 64, 64, NULL, &resized_size));
+    ck_assert_invalid_arg(resize_image(image, image_size, 64, 64, &resized, NULL));
+    ck_assert_err(resize_image("not a JPEG", 10, 64, 64, &resized, &resized_size), ERR_IO);
+
+    // 1200 x 800: the width is the limit
+    ck_assert_err_none(resize_image(image, image_size, 64, 64, &resized, &resized_size));
+    ck_assert_ptr_nonnull(resized);
+
+    uint32_t width = 0, height = 0;
+    ck_assert_err_none(get_resolution(&height, &width, resized, resized_size));
+    ck_assert_uint_eq(width, 64);
+    ck_assert_uint_le(height, 64);
+
+    free(resized);
+    free(image);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+// Lock given to the resize service, counting how often it is taken for writing
+static pthread_rwlock_t test_lock = PTHREAD_RWLOCK_INITIALIZER;
+static atomic_int nb_exclusive_locks;
+
+static void test_lock_take(int exclusive)
+{
+    if (exclusive) {
+        pthread_rwlock_wrlock(&test_lock);
+        atomic_fetch_add(&nb_exclusive_locks, 1);
+    } else {
+        pthread_rwlock_rdlock(&test_lock);
+    }
+}
+
+static void test_lock_release(void)
+{
+    pthread_rwlock_unlock(&test_lock);
+}
+
+struct resize_requester {
+    const char* img_id;
+    int err;
+};
+
+static void* request_small(void* arg)
+{
+    struct resize_requester* const requester = arg;
+    requester->err = resize_service_request(requester->img_id, 0, SMALL_RES);
+    return NULL;
+}
+
+// ======================================================================
+START_TEST(resize_service_params)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_invalid_arg(resize_service_start(NULL, 1, 0, test_lock_take, test_lock_release));
+    ck_assert_invalid_arg(resize_service_start(&file, 1, 0, NULL, test_lock_release));
+    ck_assert_invalid_arg(resize_service_start(&file, 1, 0, test_lock_take, NULL));
+    ck_assert_err(resize_service_start(&file, 0, 0, test_lock_take, test_lock_release), ERR_INVALID_ARGUMENT);
+    ck_assert_err(resize_service_request(file.metadata[0].img_id, 0, SMALL_RES), ERR_THREADING);
+
+    ck_assert_err_none(resize_service_start(&file, 1, 0, test_lock_take, test_lock_release));
+    ck_assert_err(resize_service_start(&file, 1, 0, test_lock_take, test_lock_release), ERR_INVALID_ARGUMENT);
+    ck_assert_invalid_arg(resize_service_request(NULL, 0, SMALL_RES));
+    ck_assert_err(resize_service_request(file.metadata[0].img_id, 0, ORIG_RES), ERR_RESOLUTIONS);
+    ck_assert_err(resize_service_request(file.metadata[0].img_id, 0, NB_RES), ERR_RESOLUTIONS);
+
+    // Not (or no longer) the image of that index
+    ck_assert_err(resize_service_request("nopic", 0, SMALL_RES), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err(resize_service_request(file.metadata[0].img_id, 3, SMALL_RES), ERR_IMAGE_NOT_FOUND);
+    ck_assert_uint_eq(file.metadata[0].size[SMALL_RES], 0);
+
+    resize_service_stop();
+    resize_service_stop();
+    ck_assert_err(resize_service_request(file.metadata[0].img_id, 0, SMALL_RES), ERR_THREADING);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(resize_service_coalesces)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+#define NB_REQUESTERS 16
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_uint_eq(file.metadata[0].size[SMALL_RES], 0);
+
+    atomic_store(&nb_exclusive_locks, 0);
+    ck_assert_err_none(resize_service_start(&file, 4, 0, test_lock_take, test_lock_release));
+
+    pthread_t threads[NB_REQUESTERS];
+    struct resize_requester requesters[NB_REQUESTERS];
+    for (size_t i = 0; i < NB_REQUESTERS; ++i) {
+        requesters[i].img_id = file.metadata[0].img_id;
+        requesters[i].err = ERR_RUNTIME;
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, request_small, &requesters[i]), 0);
+    }
+    for (size_t i = 0; i < NB_REQUESTERS; ++i) {
+        ck_assert_int_eq(pthread_join(threads[i], NULL), 0);
+        ck_assert_err_none(requesters[i].err);
+    }
+
+    // Created once, and stored once
+    ck_assert_int_eq(atomic_load(&nb_exclusive_locks), 1);
+    ck_assert_uint_eq(file.metadata[0].offset[SMALL_RES], 192659);
+    ck_assert_uint_ne(file.metadata[0].size[SMALL_RES], 0);
+
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    ck_assert_uint_eq(ftell(file.file), 192659 + file.metadata[0].size[SMALL_RES]);
+
+    // Already there: nothing to store
+    ck_assert_err_none(resize_service_request(file.metadata[0].img_id, 0, SMALL_RES));
+    ck_assert_int_eq(atomic_load(&nb_exclusive_locks), 1);
+
+    resize_service_stop();
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(resize_service_all_variants)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    atomic_store(&nb_exclusive_locks, 0);
+    ck_assert_err_none(resize_service_start(&file, 2, 1, test_lock_take, test_lock_release));
+
+    // Asking for one creates both
+    ck_assert_err_none(resize_service_request(file.metadata[0].img_id, 0, THUMB_RES));
+    ck_assert_int_eq(atomic_load(&nb_exclusive_locks), 1);
+    ck_assert_uint_ne(file.metadata[0].size[THUMB_RES], 0);
+    ck_assert_uint_ne(file.metadata[0].size[SMALL_RES], 0);
+    ck_assert_uint_eq(file.metadata[0].offset[SMALL_RES],
+                      file.metadata[0].offset[THUMB_RES] + file.metadata[0].size[THUMB_RES]);
+
+    ck_assert_err_none(resize_service_request(file.metadata[0].img_id, 0, SMALL_RES));
+    ck_assert_int_eq(atomic_load(&nb_exclusive_locks), 1);
+
+    resize_service_stop();
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(resize_service_queue_eager)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_err(resize_service_queue(file.metadata[0].img_id, 0), ERR_THREADING);
+
+    atomic_store(&nb_exclusive_locks, 0);
+    ck_assert_err_none(resize_service_start(&file, 1, 0, test_lock_take, test_lock_release));
+    ck_assert_invalid_arg(resize_service_queue(NULL, 0));
+
+    // Returns right away; a read meanwhile joins it (or finds it done)
+    ck_assert_err_none(resize_service_queue(file.metadata[0].img_id, 0));
+    ck_assert_err_none(resize_service_request(file.metadata[0].img_id, 0, SMALL_RES));
+    ck_assert_int_eq(atomic_load(&nb_exclusive_locks), 1);
+    ck_assert_uint_ne(file.metadata[0].size[THUMB_RES], 0);
+    ck_assert_uint_ne(file.metadata[0].size[SMALL_RES], 0);
+
+    // Nothing left to create
+    ck_assert_err_none(resize_service_queue(file.metadata[0].img_id, 0));
+    ck_assert_err_none(resize_service_request(file.metadata[0].img_id, 0, THUMB_RES));
+    ck_assert_int_eq(atomic_load(&nb_exclusive_locks), 1);
+
+    // Pending ones do not hold the stop back
+    ck_assert_err_none(resize_service_queue(file.metadata[1].img_id, 1));
+    resize_service_stop();
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -275,6 +550,12 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, lazily_resize_already_exists);
     Add_Test(s, lazily_resize_valid);
     Add_Test(s, lazily_resize_valid_fallible);
+    Add_Test(s, lazily_resize_all_valid);
+    Add_Test(s, resize_image_fits);
+    Add_Test(s, resize_service_params);
+    Add_Test(s, resize_service_coalesces);
+    Add_Test(s, resize_service_all_variants);
+    Add_Test(s, resize_service_queue_eager);
 
     return s;
 }
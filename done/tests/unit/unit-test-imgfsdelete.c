@@ -2,6 +2,24 @@
 #include "imgfscmd_functions.h"
 #include "test.h"
 #include <check.h>
+#include <stdlib.h>
+
+// Whether size bytes at offset in filename are all zero
+static int is_zero(const char* filename, uint64_t offset, size_t size)
+{
+    FILE* file = fopen(filename, "rb");
+    ck_assert_ptr_nonnull(file);
+    char* buffer = calloc(1, size);
+    ck_assert_ptr_nonnull(buffer);
+    ck_assert_int_eq(fseek(file, (long) offset, SEEK_SET), 0);
+    ck_assert_uint_eq(fread(buffer, 1, size, file), size);
+    fclose(file);
+
+    int zero = 1;
+    for (size_t i = 0; i < size && zero; ++i) zero = buffer[i] == 0;
+    free(buffer);
+    return zero;
+}
 
 // ======================================================================
 START_TEST(do_delete_null_params)
@@ -81,6 +99,38 @@ START_TEST(do_delete_correct)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_delete_mmap_correct)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    // Writes through a read-only mapping fail as with do_open()
+    ck_assert_err_none(do_open_mmap(dump, "rb", &file));
+    ck_assert_err(do_delete("pic1", &file), ERR_IO);
+    do_close(&file);
+
+    ck_assert_err_none(do_open_mmap(dump, "rb+", &file));
+    ck_assert_int_eq(file.metadata[0].is_valid, NON_EMPTY);
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_int_eq(file.header.version, 3);
+    ck_assert_int_eq(file.header.nb_files, 1);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.metadata[0].is_valid, EMPTY);
+    ck_assert_int_eq(file.metadata[1].is_valid, NON_EMPTY);
+    ck_assert_int_eq(file.header.version, 3);
+    ck_assert_int_eq(file.header.nb_files, 1);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(do_delete_bad_open_mode)
 {
@@ -169,6 +219,68 @@ START_TEST(do_delete_cmd_correct)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_delete_punch_holes)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test04"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    file.punch_holes = 1;
+
+    // pic1 shares nothing: its content at every resolution is freed
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert(is_zero(dump, 21664, 72876));
+    ck_assert(is_zero(dump, 208971, 12137));
+    ck_assert(is_zero(dump, 192659, 16312));
+
+    // pic4 shares its content with pic2: nothing is freed
+    ck_assert_err_none(do_delete("pic4", &file));
+    ck_assert(!is_zero(dump, 94540, 98119));
+    ck_assert(!is_zero(dump, 221108, 12319));
+    ck_assert(!is_zero(dump, 233427, 17327));
+
+    // The last user of the content
+    ck_assert_err_none(do_delete("pic2", &file));
+    ck_assert(is_zero(dump, 94540, 98119));
+
+    // Content of pic3 (whose size is unchanged) is still there
+    ck_assert(!is_zero(dump, 250754, 369911));
+    ck_assert_uint_eq(file.header.nb_files, 1);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_delete_cmd_punch)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    char *bad_option[] = {dump, "pic1", "-punched"};
+    ck_assert_invalid_arg(do_delete_cmd(3, bad_option));
+    ck_assert(!is_zero(dump, 21664, 72876));
+
+    char *argv[] = {dump, "pic1", "-punch"};
+    ck_assert_err_none(do_delete_cmd(3, argv));
+    ck_assert(is_zero(dump, 21664, 72876));
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.metadata[0].is_valid, EMPTY);
+    ck_assert_int_eq(file.header.nb_files, 1);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_do_delete_test_suite()
 {
@@ -180,9 +292,12 @@ Suite *imgfs_do_delete_test_suite()
     Add_Test(s, do_delete_cmd_not_enough_arguments);
     Add_Test(s, do_delete_correct);
     Add_Test(s, do_delete_bad_open_mode);
+    Add_Test(s, do_delete_mmap_correct);
     Add_Test(s, do_delete_cmd_null_params);
     Add_Test(s, do_delete_cmd_image_not_found);
     Add_Test(s, do_delete_cmd_correct);
+    Add_Test(s, do_delete_punch_holes);
+    Add_Test(s, do_delete_cmd_punch);
 
     return s;
 }
@@ -0,0 +1,173 @@
+#include "imgfs.h"
+#include "imgfscmd_functions.h"
+#include "test.h"
+#include "util.h"
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#define METADATA_END_test02 21664 // sizeof(struct imgfs_header) + 100 * sizeof(struct img_metadata)
+
+static long file_size(const char* filename)
+{
+    FILE* file = fopen(filename, "rb");
+    ck_assert_ptr_nonnull(file);
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+// Reads img_id (original resolution) and compares it to the given image file
+static void ck_assert_image_eq(struct imgfs_file* file, const char* img_id, const char* filename, uint32_t size)
+{
+    char* expected = calloc(1, size);
+    ck_assert_ptr_nonnull(expected);
+    read_file(expected, filename, size);
+
+    char* image = NULL;
+    uint32_t image_size = 0;
+    ck_assert_err_none(do_read(img_id, ORIG_RES, &image, &image_size, file));
+    ck_assert_uint_eq(image_size, size);
+    ck_assert_mem_eq(image, expected, size);
+
+    free(image);
+    free(expected);
+}
+
+// ======================================================================
+START_TEST(do_gbcollect_null_params)
+{
+    start_test_print;
+
+    ck_assert_invalid_arg(do_gbcollect(NULL, "tmp"));
+    ck_assert_invalid_arg(do_gbcollect("imgfs", NULL));
+    ck_assert_err(do_gbcollect("not a file", DATA_DIR "dump-not-a-file.tmp"), ERR_IO);
+    ck_assert_int_ne(access(DATA_DIR "dump-not-a-file.tmp", F_OK), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_nothing_to_collect)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(tmp);
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    const long size = file_size(dump);
+
+    ck_assert_err_none(do_gbcollect(dump, dumptmp));
+    ck_assert_int_eq(file_size(dump), size);
+    ck_assert_int_ne(access(dumptmp, F_OK), 0);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 2);
+    ck_assert_int_eq(file.header.version, 2);
+    ck_assert_image_eq(&file, "pic1", DATA_DIR "papillon.jpg", 72876);
+    ck_assert_image_eq(&file, "pic2", DATA_DIR "coquelicots.jpg", 98119);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_after_delete)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(tmp);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_delete("pic1", &file));
+    do_close(&file);
+
+    ck_assert_err_none(do_gbcollect(dump, dumptmp));
+    ck_assert_int_eq(file_size(dump), METADATA_END_test02 + 98119);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 1);
+    ck_assert_int_eq(file.metadata[0].is_valid, EMPTY);
+    ck_assert_int_eq(file.metadata[1].offset[ORIG_RES], METADATA_END_test02);
+    ck_assert_image_eq(&file, "pic2", DATA_DIR "coquelicots.jpg", 98119);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_shared_content)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(tmp);
+
+    char image[72876];
+    struct imgfs_file file;
+
+    // pic3 shares the content of pic1
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/papillon.jpg", 72876);
+    ck_assert_err_none(do_insert(image, 72876, "pic3", &file));
+    ck_assert_err_none(do_delete("pic2", &file));
+    do_close(&file);
+
+    ck_assert_err_none(do_gbcollect(dump, dumptmp));
+
+    // The shared content is copied once
+    ck_assert_int_eq(file_size(dump), METADATA_END_test02 + 72876);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 2);
+    ck_assert_image_eq(&file, "pic1", DATA_DIR "papillon.jpg", 72876);
+    ck_assert_image_eq(&file, "pic3", DATA_DIR "papillon.jpg", 72876);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_cmd_arguments)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(tmp);
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    char* argv[] = { dump, dumptmp, dump };
+    ck_assert_invalid_arg(do_gbcollect_cmd(0, NULL));
+    ck_assert_err(do_gbcollect_cmd(1, argv), ERR_NOT_ENOUGH_ARGUMENTS);
+    ck_assert_err(do_gbcollect_cmd(3, argv), ERR_INVALID_COMMAND);
+    ck_assert_err_none(do_gbcollect_cmd(2, argv));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_gbcollect_test_suite()
+{
+    Suite *s = suite_create("Tests for do_gbcollect implementation");
+
+    Add_Test(s, do_gbcollect_null_params);
+    Add_Test(s, do_gbcollect_nothing_to_collect);
+    Add_Test(s, do_gbcollect_after_delete);
+    Add_Test(s, do_gbcollect_shared_content);
+    Add_Test(s, do_gbcollect_cmd_arguments);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_gbcollect_test_suite)
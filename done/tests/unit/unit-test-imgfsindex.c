@@ -0,0 +1,426 @@
+#include "imgfs.h"
+#include "imgfs_index.h"
+#include "test.h"
+#include "util.h"
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <vips/vips.h>
+
+// Builds an in-memory only imgFS with `nb_valid` images named "img<i>" among `max_files` slots
+static void make_memory_imgfs(struct imgfs_file* file, uint32_t max_files, uint32_t nb_valid)
+{
+    const struct imgfs_file empty = { .header.max_files = max_files };
+    memcpy(file, &empty, sizeof(empty));
+    file->metadata = calloc(max_files, sizeof(struct img_metadata));
+    ck_assert_ptr_nonnull(file->metadata);
+
+    for (uint32_t i = 0; i < nb_valid; ++i) {
+        snprintf(file->metadata[i].img_id, MAX_IMG_ID, "img%u", i);
+        file->metadata[i].SHA[0] = (unsigned char) i;
+        file->metadata[i].is_valid = NON_EMPTY;
+    }
+    file->header.nb_files = nb_valid;
+}
+
+// ======================================================================
+START_TEST(imgfs_index_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    zero_init_var(file);
+
+    ck_assert_invalid_arg(imgfs_index_build(NULL));
+    ck_assert_invalid_arg(imgfs_index_build(&file));
+
+    // Shall not crash
+    imgfs_index_free(NULL);
+    imgfs_index_add(NULL, 0);
+    imgfs_index_remove(NULL, 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_built_on_open)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    ck_assert_ptr_nonnull(file.index);
+
+    ck_assert_uint_eq(imgfs_index_find_id(&file, "pic1"), 0);
+    ck_assert_uint_eq(imgfs_index_find_id(&file, "pic2"), 1);
+    ck_assert_uint_eq(imgfs_index_find_id(&file, "pic3"), file.header.max_files);
+    ck_assert_uint_eq(imgfs_index_find_id(&file, ""), file.header.max_files);
+
+    do_close(&file);
+    ck_assert_ptr_null(file.index);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_after_delete)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_uint_eq(imgfs_index_find_id(&file, "pic1"), file.header.max_files);
+    ck_assert_uint_eq(imgfs_index_find_id(&file, "pic2"), 1);
+    ck_assert_err(do_delete("pic1", &file), ERR_IMAGE_NOT_FOUND);
+
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(imgfs_index_find_id(&file, "pic1"), file.header.max_files);
+    ck_assert_uint_eq(imgfs_index_find_id(&file, "pic2"), 1);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_after_insert)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char image[82234];
+    struct imgfs_file file;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+
+    ck_assert_err_none(do_insert(image, 82234, "pic3", &file));
+    const uint32_t slot = imgfs_index_find_id(&file, "pic3");
+    ck_assert_uint_lt(slot, file.header.max_files);
+    ck_assert_str_eq(file.metadata[slot].img_id, "pic3");
+
+    ck_assert_err(do_insert(image, 82234, "pic3", &file), ERR_DUPLICATE_ID);
+
+    // Deleting then inserting again the same ID is allowed
+    ck_assert_err_none(do_delete("pic3", &file));
+    ck_assert_err_none(do_insert(image, 82234, "pic3", &file));
+    ck_assert_uint_lt(imgfs_index_find_id(&file, "pic3"), file.header.max_files);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_many_removals)
+{
+    start_test_print;
+
+    // Small table (64 buckets for 32 slots) to force long probe runs
+    struct imgfs_file file;
+    make_memory_imgfs(&file, 32, 32);
+    ck_assert_err_none(imgfs_index_build(&file));
+
+    // Remove every third entry, then check every entry
+    for (uint32_t i = 0; i < 32; i += 3) {
+        imgfs_index_remove(&file, i);
+        file.metadata[i].is_valid = EMPTY;
+    }
+
+    char img_id[MAX_IMG_ID + 1];
+    for (uint32_t i = 0; i < 32; ++i) {
+        snprintf(img_id, MAX_IMG_ID, "img%u", i);
+        const uint32_t expected = (i % 3 == 0) ? file.header.max_files : i;
+        ck_assert_uint_eq(imgfs_index_find_id(&file, img_id), expected);
+    }
+
+    // Removing an entry twice is harmless
+    imgfs_index_remove(&file, 0);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_fallback_without_index)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    make_memory_imgfs(&file, 16, 4);
+    ck_assert_ptr_null(file.index);
+
+    ck_assert_uint_eq(imgfs_index_find_id(&file, "img2"), 2);
+    ck_assert_uint_eq(imgfs_index_find_id(&file, "img4"), file.header.max_files);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_same_sha)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    make_memory_imgfs(&file, 32, 8);
+    // img2 and img5 share their content
+    file.metadata[5].SHA[0] = 2;
+    ck_assert_err_none(imgfs_index_build(&file));
+
+    ck_assert_uint_eq(imgfs_index_find_same_sha(&file, 2), 5);
+    ck_assert_uint_eq(imgfs_index_find_same_sha(&file, 5), 2);
+    ck_assert_uint_eq(imgfs_index_find_same_sha(&file, 3), file.header.max_files);
+    ck_assert_uint_eq(imgfs_index_find_same_id(&file, 3), file.header.max_files);
+
+    // An entry being inserted (not yet valid) finds its valid twins
+    strcpy(file.metadata[8].img_id, "img3");
+    file.metadata[8].SHA[0] = 6;
+    ck_assert_uint_eq(imgfs_index_find_same_id(&file, 8), 3);
+    ck_assert_uint_eq(imgfs_index_find_same_sha(&file, 8), 6);
+
+    imgfs_index_remove(&file, 2);
+    file.metadata[2].is_valid = EMPTY;
+    ck_assert_uint_eq(imgfs_index_find_same_sha(&file, 5), file.header.max_files);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_dedup_content)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char image[72876];
+    struct imgfs_file file;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/papillon.jpg", 72876);
+
+    // Same content as pic1, under another name
+    ck_assert_err_none(do_insert(image, 72876, "pic3", &file));
+    const uint32_t slot = imgfs_index_find_id(&file, "pic3");
+    ck_assert_uint_lt(slot, file.header.max_files);
+    ck_assert_uint_eq(imgfs_index_find_same_sha(&file, slot), 0);
+    ck_assert_uint_eq(file.metadata[slot].offset[ORIG_RES], file.metadata[0].offset[ORIG_RES]);
+
+    // Once pic1 is deleted, pic3 still holds the content
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_uint_eq(imgfs_index_find_same_sha(&file, slot), file.header.max_files);
+    ck_assert_err_none(do_insert(image, 72876, "pic1", &file));
+    ck_assert_uint_eq(file.metadata[imgfs_index_find_id(&file, "pic1")].offset[ORIG_RES],
+                      file.metadata[slot].offset[ORIG_RES]);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_valid_iteration)
+{
+    start_test_print;
+
+    // Valid entries 0..3, then 70 and 199, spread over four bitmap words
+    struct imgfs_file file;
+    make_memory_imgfs(&file, 200, 4);
+    file.metadata[70].is_valid = NON_EMPTY;
+    file.metadata[199].is_valid = NON_EMPTY;
+
+    for (int indexed = 0; indexed <= 1; ++indexed) {
+        if (indexed) ck_assert_err_none(imgfs_index_build(&file));
+
+        ck_assert_uint_eq(imgfs_index_next_valid(&file, 0), 0);
+        ck_assert_uint_eq(imgfs_index_next_valid(&file, 3), 3);
+        ck_assert_uint_eq(imgfs_index_next_valid(&file, 4), 70);
+        ck_assert_uint_eq(imgfs_index_next_valid(&file, 71), 199);
+        ck_assert_uint_eq(imgfs_index_next_valid(&file, 200), file.header.max_files);
+        ck_assert_uint_eq(imgfs_index_next_valid(&file, UINT32_MAX), file.header.max_files);
+    }
+
+    imgfs_index_remove(&file, 70);
+    file.metadata[70].is_valid = EMPTY;
+    ck_assert_uint_eq(imgfs_index_next_valid(&file, 4), 199);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_free_slot_stack)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    make_memory_imgfs(&file, 8, 4);
+
+    // Without index: first-fit
+    ck_assert_uint_eq(imgfs_index_free_slot(&file), 4);
+
+    ck_assert_err_none(imgfs_index_build(&file));
+    ck_assert_uint_eq(imgfs_index_free_slot(&file), 4);
+
+    // Not taken until registered
+    ck_assert_uint_eq(imgfs_index_free_slot(&file), 4);
+    file.metadata[4].is_valid = NON_EMPTY;
+    imgfs_index_add(&file, 4);
+    ck_assert_uint_eq(imgfs_index_free_slot(&file), 5);
+
+    // A freed slot is reused first
+    imgfs_index_remove(&file, 1);
+    file.metadata[1].is_valid = EMPTY;
+    ck_assert_uint_eq(imgfs_index_free_slot(&file), 1);
+
+    // A slot registered out of order is skipped once it reaches the top
+    file.metadata[6].is_valid = NON_EMPTY;
+    imgfs_index_add(&file, 6);
+    file.metadata[1].is_valid = NON_EMPTY;
+    imgfs_index_add(&file, 1);
+    ck_assert_uint_eq(imgfs_index_free_slot(&file), 5);
+    file.metadata[5].is_valid = NON_EMPTY;
+    imgfs_index_add(&file, 5);
+    ck_assert_uint_eq(imgfs_index_free_slot(&file), 7);
+    file.metadata[7].is_valid = NON_EMPTY;
+    imgfs_index_add(&file, 7);
+    ck_assert_uint_eq(imgfs_index_free_slot(&file), file.header.max_files);
+
+    // Free and take every slot many times: the stack never overflows
+    for (uint32_t round = 0; round < 4; ++round) {
+        for (uint32_t i = 0; i < 8; ++i) {
+            imgfs_index_remove(&file, i);
+            file.metadata[i].is_valid = EMPTY;
+        }
+        for (uint32_t i = 0; i < 8; ++i) {
+            const uint32_t slot = imgfs_index_free_slot(&file);
+            ck_assert_uint_lt(slot, file.header.max_files);
+            file.metadata[slot].is_valid = NON_EMPTY;
+            imgfs_index_add(&file, slot);
+        }
+        ck_assert_uint_eq(imgfs_index_free_slot(&file), file.header.max_files);
+    }
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_blob_refs_shared)
+{
+    start_test_print;
+
+    // pic2 and pic4 share their content at every resolution
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test04"), "rb", &file));
+
+    for (int indexed = 1; indexed >= 0; --indexed) {
+        ck_assert_uint_eq(imgfs_index_blob_refs(&file, 94540, 98119), 2);
+        ck_assert_uint_eq(imgfs_index_blob_refs(&file, 221108, 12319), 2);
+        ck_assert_uint_eq(imgfs_index_blob_refs(&file, 21664, 72876), 1);
+        ck_assert_uint_eq(imgfs_index_blob_refs(&file, 21664, 72875), 0);
+        ck_assert_uint_eq(imgfs_index_blob_refs(&file, 0, 0), 0);
+        imgfs_index_free(&file); // Same answers from the linear scan
+    }
+    ck_assert_err_none(imgfs_index_build(&file));
+
+    imgfs_index_remove(&file, 3);
+    file.metadata[3].is_valid = EMPTY;
+    ck_assert_uint_eq(imgfs_index_blob_refs(&file, 94540, 98119), 1);
+    imgfs_index_remove(&file, 1);
+    file.metadata[1].is_valid = EMPTY;
+    ck_assert_uint_eq(imgfs_index_blob_refs(&file, 94540, 98119), 0);
+    ck_assert_uint_eq(imgfs_index_blob_refs(&file, 233427, 17327), 0);
+
+    // Content which moves
+    imgfs_index_unref_blob(&file, 0, ORIG_RES);
+    file.metadata[0].offset[ORIG_RES] = 94540;
+    imgfs_index_ref_blob(&file, 0, ORIG_RES);
+    ck_assert_uint_eq(imgfs_index_blob_refs(&file, 21664, 72876), 0);
+    ck_assert_uint_eq(imgfs_index_blob_refs(&file, 94540, 72876), 1);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_blob_refs_many_removals)
+{
+    start_test_print;
+
+    // Pairs of entries share their content; small table to force long probe runs
+    struct imgfs_file file;
+    make_memory_imgfs(&file, 32, 32);
+    for (uint32_t i = 0; i < 32; ++i) {
+        file.metadata[i].offset[ORIG_RES] = 1000 + (i / 2) * 100;
+        file.metadata[i].size[ORIG_RES] = 100;
+        file.metadata[i].offset[THUMB_RES] = 5000 + i * 10;
+        file.metadata[i].size[THUMB_RES] = 10;
+    }
+    ck_assert_err_none(imgfs_index_build(&file));
+
+    for (uint32_t i = 0; i < 32; i += 3) {
+        imgfs_index_remove(&file, i);
+        file.metadata[i].is_valid = EMPTY;
+    }
+
+    for (uint32_t i = 0; i < 32; ++i) {
+        const uint32_t pair = (i / 2) * 2;
+        const uint32_t orig_refs = (pair % 3 != 0) + ((pair + 1) % 3 != 0);
+        ck_assert_uint_eq(imgfs_index_blob_refs(&file, 1000 + (i / 2) * 100, 100), orig_refs);
+        ck_assert_uint_eq(imgfs_index_blob_refs(&file, 5000 + i * 10, 10), i % 3 != 0);
+    }
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_index_test_suite()
+{
+    Suite *s = suite_create("Tests for the in-memory imgFS lookup tables");
+
+    Add_Test(s, imgfs_index_null_params);
+    Add_Test(s, imgfs_index_built_on_open);
+    Add_Test(s, imgfs_index_after_delete);
+    Add_Test(s, imgfs_index_after_insert);
+    Add_Test(s, imgfs_index_many_removals);
+    Add_Test(s, imgfs_index_fallback_without_index);
+    Add_Test(s, imgfs_index_same_sha);
+    Add_Test(s, imgfs_index_dedup_content);
+    Add_Test(s, imgfs_index_valid_iteration);
+    Add_Test(s, imgfs_index_free_slot_stack);
+    Add_Test(s, imgfs_index_blob_refs_shared);
+    Add_Test(s, imgfs_index_blob_refs_many_removals);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_index_test_suite)
@@ -1,7 +1,10 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
+#include "util.h"
 #include "test.h"
 #include <check.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <vips/vips.h>
 
 // ======================================================================
@@ -338,6 +341,229 @@ START_TEST(do_insert_write_initializes_metadata)
 }
 END_TEST
 
+// ======================================================================
+static off_t file_size(const char* filename)
+{
+    struct stat st;
+    ck_assert_int_eq(stat(filename, &st), 0);
+    return st.st_size;
+}
+
+// Uploads the content in pieces of at most piece bytes
+static void upload_content(struct imgfs_upload* upload, const char* content, size_t size,
+                           size_t piece, struct imgfs_file* file)
+{
+    for (size_t done = 0; done < size; done += piece) {
+        ck_assert_err_none(do_insert_write(upload, content + done, MIN(piece, size - done), file));
+    }
+}
+
+// ======================================================================
+START_TEST(do_insert_stream_null_params)
+{
+    start_test_print;
+
+    char data = 0;
+    struct imgfs_file file;
+    struct imgfs_upload upload;
+    memset(&file, 0, sizeof(file));
+    memset(&upload, 0, sizeof(upload));
+
+    ck_assert_invalid_arg(do_insert_begin(NULL, 1, &file, &upload));
+    ck_assert_invalid_arg(do_insert_begin("pic", 1, NULL, &upload));
+    ck_assert_invalid_arg(do_insert_begin("pic", 1, &file, &upload));
+    ck_assert_invalid_arg(do_insert_write(NULL, &data, 1, &file));
+    ck_assert_invalid_arg(do_insert_write(&upload, &data, 1, &file));
+    ck_assert_invalid_arg(do_insert_commit(NULL, &file));
+    ck_assert_invalid_arg(do_insert_commit(&upload, &file));
+    do_insert_abort(NULL, &file);
+    do_insert_abort(&upload, NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_stream_valid)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[82234];
+    struct imgfs_file file;
+    struct imgfs_upload upload;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+
+    ck_assert_err(do_insert_begin("pic1", 82234, &file, &upload), ERR_DUPLICATE_ID);
+    ck_assert_err(do_insert_begin("pic3", 0, &file, &upload), ERR_INVALID_ARGUMENT);
+
+    ck_assert_err_none(do_insert_begin("pic3", 82234, &file, &upload));
+    ck_assert_int_eq(upload.offset, 192659);
+    ck_assert_int_eq(file.nb_uploads, 1);
+    ck_assert_int_eq(file.uploads_end, 192659 + 82234);
+
+    upload_content(&upload, image, 82234, 1000, &file);
+    ck_assert_invalid_arg(do_insert_write(&upload, image, 1, &file));
+    ck_assert_err_none(do_insert_commit(&upload, &file));
+    ck_assert_ptr_null(upload.sha);
+    ck_assert_int_eq(file.nb_uploads, 0);
+    ck_assert_int_eq(file.uploads_end, 0);
+    do_close(&file);
+
+    // Same as do_insert()
+    ck_assert_int_eq(file_size(dump), 192659 + 82234);
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    const struct img_metadata *md = NULL;
+    for (uint32_t i = 0; i < file.header.max_files; ++i) {
+        if (strcmp(file.metadata[i].img_id, "pic3") == 0) md = &file.metadata[i];
+    }
+    ck_assert_msg(md != NULL, "the inserted metadata could not be found by image id");
+
+    unsigned char pic_sha[SHA256_DIGEST_LENGTH] = {0xf8, 0x88, 0xf0, 0xdd, 0xd4, 0xf8, 0x24, 0x75, 0x99, 0xf6, 0xde,
+                                                   0x79, 0x7e, 0x0a, 0x6f, 0x55, 0x76, 0xd3, 0xd1, 0xe7, 0x41, 0x97,
+                                                   0xd3, 0x3d, 0xac, 0x09, 0x08, 0x94, 0xdb, 0x07, 0xbf, 0x1e
+                                                  };
+    ck_assert_mem_eq(md->SHA, pic_sha, SHA256_DIGEST_LENGTH);
+    ck_assert_int_eq(md->orig_res[0], 600);
+    ck_assert_int_eq(md->orig_res[1], 400);
+    ck_assert_int_eq(md->size[ORIG_RES], 82234);
+    ck_assert_int_eq(md->offset[ORIG_RES], 192659);
+    ck_assert_int_eq(md->size[THUMB_RES], 0);
+    ck_assert_int_eq(md->size[SMALL_RES], 0);
+    ck_assert_int_eq(md->is_valid, NON_EMPTY);
+    ck_assert_int_eq(file.header.version, 3);
+    ck_assert_int_eq(file.header.nb_files, 3);
+
+    char content[82234];
+    ck_assert_err_none(imgfs_read_at(&file, content, 82234, 192659));
+    ck_assert_mem_eq(content, image, 82234);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_stream_duplicate)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[72876];
+    struct imgfs_file file;
+    struct imgfs_upload upload;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    const off_t size_before = file_size(dump);
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/papillon.jpg", 72876);
+
+    ck_assert_err_none(do_insert_begin("pic3", 72876, &file, &upload));
+    upload_content(&upload, image, 72876, 4096, &file);
+    ck_assert_err_none(do_insert_commit(&upload, &file));
+
+    // The existing content is shared, the uploaded one given back
+    ck_assert_int_eq(file_size(dump), size_before);
+    const size_t index = imgfs_index_find_id(&file, "pic3");
+    ck_assert_uint_lt(index, file.header.max_files);
+    ck_assert_int_eq(file.metadata[index].offset[ORIG_RES], 21664);
+    ck_assert_int_eq(file.header.nb_files, 3);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_stream_rollback)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[72876] = {0};
+    struct imgfs_file file;
+    struct imgfs_upload upload;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    const off_t size_before = file_size(dump);
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    // Not an image
+    ck_assert_err_none(do_insert_begin("pic3", 72876, &file, &upload));
+    ck_assert_int_eq(file_size(dump), size_before + 72876);
+    upload_content(&upload, image, 72876, 10000, &file);
+    ck_assert_err(do_insert_commit(&upload, &file), ERR_IMGLIB);
+    ck_assert_int_eq(file_size(dump), size_before);
+
+    // Incomplete
+    read_file(image, DATA_DIR "/papillon.jpg", 72876);
+    ck_assert_err_none(do_insert_begin("pic3", 72876, &file, &upload));
+    upload_content(&upload, image, 1000, 1000, &file);
+    ck_assert_invalid_arg(do_insert_commit(&upload, &file));
+    ck_assert_int_eq(file_size(dump), size_before);
+
+    // Aborted
+    ck_assert_err_none(do_insert_begin("pic3", 72876, &file, &upload));
+    upload_content(&upload, image, 1000, 1000, &file);
+    do_insert_abort(&upload, &file);
+    do_insert_abort(&upload, &file);
+    ck_assert_int_eq(file_size(dump), size_before);
+    ck_assert_int_eq(file.nb_uploads, 0);
+
+    ck_assert_int_eq(imgfs_index_find_id(&file, "pic3"), file.header.max_files);
+    ck_assert_int_eq(file.header.nb_files, 2);
+    ck_assert_int_eq(file.header.version, 2);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_stream_concurrent)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[82234];
+    struct imgfs_file file;
+    struct imgfs_upload first, second;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    const off_t size_before = file_size(dump);
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+
+    // The first one, no longer at the end of the file, leaves a hole
+    ck_assert_err_none(do_insert_begin("pic3", 82234, &file, &first));
+    ck_assert_err_none(do_insert_begin("pic4", 82234, &file, &second));
+    ck_assert_int_eq(second.offset, size_before + 82234);
+    ck_assert_int_eq(file.uploads_end, size_before + 2 * 82234);
+
+    upload_content(&second, image, 82234, 5000, &file);
+    do_insert_abort(&first, &file);
+    ck_assert_int_eq(file.nb_uploads, 1);
+    ck_assert_int_eq(file.uploads_end, size_before + 2 * 82234);
+    ck_assert_err_none(do_insert_commit(&second, &file));
+    ck_assert_int_eq(file.nb_uploads, 0);
+
+    ck_assert_int_eq(file_size(dump), size_before + 2 * 82234);
+    const size_t index = imgfs_index_find_id(&file, "pic4");
+    ck_assert_uint_lt(index, file.header.max_files);
+    ck_assert_int_eq(file.metadata[index].offset[ORIG_RES], size_before + 82234);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -352,6 +578,11 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, do_insert_valid);
     Add_Test(s, do_insert_write_correct_metadata);
     Add_Test(s, do_insert_write_initializes_metadata);
+    Add_Test(s, do_insert_stream_null_params);
+    Add_Test(s, do_insert_stream_valid);
+    Add_Test(s, do_insert_stream_duplicate);
+    Add_Test(s, do_insert_stream_rollback);
+    Add_Test(s, do_insert_stream_concurrent);
 
     return s;
 }
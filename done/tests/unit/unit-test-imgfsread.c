@@ -2,6 +2,7 @@
 #include "imgfs.h"
 #include "test.h"
 #include <check.h>
+#include <pthread.h>
 #include <vips/vips.h>
 
 #if VIPS_MINOR_VERSION >= 15
@@ -134,6 +135,96 @@ START_TEST(do_read_resize_invalid_mode)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_read_location_valid)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    uint64_t offset;
+    uint32_t size;
+
+    ck_assert_invalid_arg(do_read_location(NULL, ORIG_RES, &offset, &size, &file));
+    ck_assert_invalid_arg(do_read_location("pic2", ORIG_RES, NULL, &size, &file));
+    ck_assert_invalid_arg(do_read_location("pic2", ORIG_RES, &offset, NULL, &file));
+    ck_assert_invalid_arg(do_read_location("pic2", ORIG_RES, &offset, &size, NULL));
+
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    ck_assert_err_none(do_read_location("pic2", ORIG_RES, &offset, &size, &file));
+    ck_assert_uint_eq(offset, 94540);
+    ck_assert_uint_eq(size, 98119);
+
+    ck_assert_err(do_read_location("pic3", ORIG_RES, &offset, &size, &file), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err(do_read_location("pic2", NB_RES, &offset, &size, &file), ERR_RESOLUTIONS);
+    ck_assert_err(do_read_location("pic2", -1, &offset, &size, &file), ERR_RESOLUTIONS);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+#define NB_READERS 8
+#define NB_READS  50
+
+struct reader {
+    struct imgfs_file* file;
+    const char* img_id;
+    const char* expected;
+    uint32_t expected_size;
+    int nb_errors;
+};
+
+static void* read_many_times(void* arg)
+{
+    struct reader* reader = arg;
+    for (int i = 0; i < NB_READS; ++i) {
+        char* buffer = NULL;
+        uint32_t size = 0;
+        if (do_read(reader->img_id, ORIG_RES, &buffer, &size, reader->file) != ERR_NONE
+            || size != reader->expected_size || memcmp(buffer, reader->expected, size) != 0) {
+            ++reader->nb_errors;
+        }
+        free(buffer);
+    }
+    return NULL;
+}
+
+START_TEST(do_read_concurrent_readers)
+{
+    start_test_print;
+
+    static char pic1[72876], pic2[98119];
+    read_file(pic1, DATA_DIR "/papillon.jpg", sizeof(pic1));
+    read_file(pic2, DATA_DIR "/coquelicots.jpg", sizeof(pic2));
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    // Readers of different images share the file without any lock
+    pthread_t threads[NB_READERS];
+    struct reader readers[NB_READERS];
+    for (int i = 0; i < NB_READERS; ++i) {
+        const struct reader reader = {
+            &file, i % 2 ? "pic2" : "pic1", i % 2 ? pic2 : pic1,
+            i % 2 ? sizeof(pic2) : sizeof(pic1), 0
+        };
+        readers[i] = reader;
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, read_many_times, &readers[i]), 0);
+    }
+    for (int i = 0; i < NB_READERS; ++i) {
+        ck_assert_int_eq(pthread_join(threads[i], NULL), 0);
+        ck_assert_int_eq(readers[i].nb_errors, 0);
+    }
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_read_test_suite()
 {
@@ -144,6 +235,8 @@ Suite *imgfs_read_test_suite()
     Add_Test(s, do_read_valid);
     Add_Test(s, do_read_resize);
     Add_Test(s, do_read_resize_invalid_mode);
+    Add_Test(s, do_read_location_valid);
+    Add_Test(s, do_read_concurrent_readers);
 
     return s;
 }
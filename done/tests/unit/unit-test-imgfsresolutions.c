@@ -52,6 +52,93 @@ START_TEST(get_resolution_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(get_resolution_test_images)
+{
+    start_test_print;
+
+    static const struct {
+        const char* name;
+        uint32_t width;
+        uint32_t height;
+    } images[] = {
+        { DATA_DIR "/brouillard.jpg", 600, 400 },
+        { DATA_DIR "/coquelicots.jpg", 1200, 800 },
+        { DATA_DIR "/coquelicots_thumb.jpg", 64, 42 },
+        { DATA_DIR "/foret.jpg", 1200, 800 },
+        { DATA_DIR "/mure.jpg", 640, 455 },
+        { DATA_DIR "/papillon.jpg", 1200, 800 },
+    };
+
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+        void* image_buffer = NULL;
+        size_t image_size = 0;
+        read_file_and_size(&image_buffer, images[i].name, &image_size);
+
+        uint32_t height = 0, width = 0;
+        ck_assert_err_none(get_resolution(&height, &width, image_buffer, image_size));
+        ck_assert_uint_eq(width, images[i].width);
+        ck_assert_uint_eq(height, images[i].height);
+
+        free(image_buffer);
+    }
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(get_resolution_jpeg_headers)
+{
+    start_test_print;
+
+    uint32_t height = 0, width = 0;
+
+    // Progressive frame (SOF2), after an APP0 segment and fill bytes, up to its first scan
+    const char progressive[] = {
+        '\xFF', '\xD8', '\xFF', '\xE0', 0x00, 0x04, 'J', 'F',
+        '\xFF', '\xFF', '\xC2', 0x00, 0x0B, 0x08, 0x01, 0x2C, 0x01, '\xF4', 0x01, 0x01, 0x11, 0x00,
+        '\xFF', '\xDA', 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00
+    };
+    ck_assert_err_none(get_resolution(&height, &width, progressive, sizeof(progressive)));
+    ck_assert_uint_eq(width, 500);
+    ck_assert_uint_eq(height, 300);
+
+    // Number of lines defined later (DNL segment): left to the image library
+    const char lines_later[] = {
+        '\xFF', '\xD8', '\xFF', '\xC0', 0x00, 0x0B, 0x08, 0x00, 0x00, 0x01, '\xF4', 0x01, 0x01, 0x11, 0x00
+    };
+    ck_assert_err(get_resolution(&height, &width, lines_later, sizeof(lines_later)), ERR_IMGLIB);
+
+    // Scan before any frame header
+    const char scan_first[] = {
+        '\xFF', '\xD8', '\xFF', '\xDA', 0x00, 0x02,
+        '\xFF', '\xC0', 0x00, 0x0B, 0x08, 0x01, 0x2C, 0x01, '\xF4', 0x01, 0x01, 0x11, 0x00
+    };
+    ck_assert_err(get_resolution(&height, &width, scan_first, sizeof(scan_first)), ERR_IMGLIB);
+
+    // Lossless frame (SOF3): left to the image library, which does not decode it
+    const char lossless[] = {
+        '\xFF', '\xD8', '\xFF', '\xC3', 0x00, 0x0B, 0x08, 0x01, 0x2C, 0x01, '\xF4', 0x01, 0x01, 0x11, 0x00,
+        '\xFF', '\xDA', 0x00, 0x08, 0x01, 0x01, 0x00, 0x01, 0x00, 0x00
+    };
+    ck_assert_err(get_resolution(&height, &width, lossless, sizeof(lossless)), ERR_IMGLIB);
+
+    // Cut off right after the frame header (SOF0)
+    const char cut_after_frame[] = {
+        '\xFF', '\xD8', '\xFF', '\xC0', 0x00, 0x0B, 0x08, 0x01, 0x2C, 0x01, '\xF4', 0x01, 0x01, 0x11, 0x00
+    };
+    ck_assert_err(get_resolution(&height, &width, cut_after_frame, sizeof(cut_after_frame)), ERR_IMGLIB);
+
+    // Truncated within the frame header, or the scan header
+    ck_assert_err(get_resolution(&height, &width, progressive, sizeof(progressive) - 16), ERR_IMGLIB);
+    ck_assert_err(get_resolution(&height, &width, progressive, sizeof(progressive) - 3), ERR_IMGLIB);
+    ck_assert_err(get_resolution(&height, &width, progressive, 3), ERR_IMGLIB);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_get_resolution_test_suite()
 {
@@ -60,6 +147,8 @@ Suite *imgfs_get_resolution_test_suite()
     Add_Test(s, get_resolution_null);
     Add_Test(s, get_resolution_invalid_buffer);
     Add_Test(s, get_resolution_valid);
+    Add_Test(s, get_resolution_test_images);
+    Add_Test(s, get_resolution_jpeg_headers);
 
     return s;
 }
@@ -4,7 +4,7 @@
 // ======================================================================
 #define SIZE_imgfs_header 64
 #define SIZE_img_metadata 216
-#define SIZE_imgfs_file   80
+#define SIZE_imgfs_file   120
 
 #define OFFSET_imgfs_header_name        0
 #define OFFSET_imgfs_header_version     32
@@ -19,9 +19,15 @@
 #define OFFSET_img_metadata_offset   184
 #define OFFSET_img_metadata_is_valid 208
 
-#define OFFSET_imgfs_file_file     0
-#define OFFSET_imgfs_file_header   8
-#define OFFSET_imgfs_file_metadata 72
+#define OFFSET_imgfs_file_file        0
+#define OFFSET_imgfs_file_header      8
+#define OFFSET_imgfs_file_metadata    72
+#define OFFSET_imgfs_file_index       80
+#define OFFSET_imgfs_file_map         88
+#define OFFSET_imgfs_file_map_size    96
+#define OFFSET_imgfs_file_punch_holes 104
+#define OFFSET_imgfs_file_nb_uploads  108
+#define OFFSET_imgfs_file_uploads_end 112
 
 // ======================================================================
 #define test_member(T, M)                                                                                              \
@@ -90,6 +96,12 @@ START_TEST(imgfs_file)
     test_member(imgfs_file, file);
     test_member(imgfs_file, header);
     test_member(imgfs_file, metadata);
+    test_member(imgfs_file, index);
+    test_member(imgfs_file, map);
+    test_member(imgfs_file, map_size);
+    test_member(imgfs_file, punch_holes);
+    test_member(imgfs_file, nb_uploads);
+    test_member(imgfs_file, uploads_end);
 
     end_test_print;
 }
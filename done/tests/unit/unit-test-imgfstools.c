@@ -111,6 +111,101 @@ START_TEST(do_open_correct_metadata)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_open_mmap_same_as_do_open)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct imgfs_file mapped;
+    ck_assert_err_none(do_open(DATA_DIR "test02.imgfs", "rb", &file));
+    ck_assert_err_none(do_open_mmap(DATA_DIR "test02.imgfs", "rb", &mapped));
+
+    ck_assert_ptr_null(file.map);
+    ck_assert_ptr_nonnull(mapped.map);
+    ck_assert_ptr_eq(mapped.metadata, (char*) mapped.map + sizeof(struct imgfs_header));
+    ck_assert_ptr_nonnull(mapped.index);
+
+    ck_assert_mem_eq(&mapped.header, &file.header, sizeof(struct imgfs_header));
+    ck_assert_mem_eq(mapped.metadata, file.metadata, file.header.max_files * sizeof(struct img_metadata));
+
+    do_close(&file);
+    do_close(&mapped);
+    ck_assert_ptr_null(mapped.map);
+    ck_assert_ptr_null(mapped.metadata);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_open_mmap_truncated_file)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    // The header and only some of the metadata
+    char content[sizeof(struct imgfs_header) + sizeof(struct img_metadata)];
+    FILE* in = fopen(DATA_DIR "test02.imgfs", "rb");
+    ck_assert_ptr_nonnull(in);
+    ck_assert_uint_eq(fread(content, sizeof(content), 1, in), 1);
+    fclose(in);
+    FILE* out = fopen(dump, "wb");
+    ck_assert_ptr_nonnull(out);
+    ck_assert_uint_eq(fwrite(content, sizeof(content), 1, out), 1);
+    fclose(out);
+
+    struct imgfs_file file;
+    ck_assert_invalid_arg(do_open_mmap(NULL, "rb", &file));
+    ck_assert_err(do_open_mmap("not a file", "rb", &file), ERR_IO);
+    ck_assert_err(do_open_mmap(dump, "rb", &file), ERR_IO);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_positional_io)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    char buffer[sizeof(struct imgfs_header)];
+    uint64_t offset = 0;
+
+    ck_assert_invalid_arg(imgfs_read_at(NULL, buffer, 1, 0));
+    ck_assert_invalid_arg(imgfs_write_at(NULL, buffer, 1, 0));
+    ck_assert_invalid_arg(imgfs_append(NULL, buffer, 1, &offset));
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_invalid_arg(imgfs_read_at(&file, NULL, 1, 0));
+    ck_assert_invalid_arg(imgfs_append(&file, buffer, 1, NULL));
+
+    ck_assert_err_none(imgfs_read_at(&file, buffer, sizeof(buffer), 0));
+    ck_assert_mem_eq(buffer, &file.header, sizeof(buffer));
+
+    // Past the end of the file
+    ck_assert_err(imgfs_read_at(&file, buffer, 2, 192658), ERR_IO);
+
+    ck_assert_err_none(imgfs_append(&file, "imgfs", 5, &offset));
+    ck_assert_uint_eq(offset, 192659);
+    ck_assert_err_none(imgfs_write_at(&file, "IMG", 3, offset));
+    ck_assert_err_none(imgfs_read_at(&file, buffer, 5, offset));
+    ck_assert_mem_eq(buffer, "IMGfs", 5);
+
+    do_close(&file);
+
+    // Read-only file
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err(imgfs_append(&file, "imgfs", 5, &offset), ERR_IO);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(do_close_null_param)
 {
@@ -128,6 +223,7 @@ START_TEST(do_close_null_file)
     start_test_print;
 
     struct imgfs_file file;
+    zero_init_var(file);
     file.file = NULL;
     file.metadata = malloc(sizeof(struct img_metadata));
 
@@ -147,6 +243,9 @@ Suite *imgfs_tools_suite_RES()
     Add_Test(s, do_open_invalid_mode);
     Add_Test(s, do_open_correct_header);
     Add_Test(s, do_open_correct_metadata);
+    Add_Test(s, do_open_mmap_same_as_do_open);
+    Add_Test(s, do_open_mmap_truncated_file);
+    Add_Test(s, imgfs_positional_io);
 
     Add_Test(s, do_close_null_param);
     Add_Test(s, do_close_null_file);
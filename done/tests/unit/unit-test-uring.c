@@ -0,0 +1,146 @@
+#include "uring.h"
+#include "error.h"
+#include "test.h"
+#include <check.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Some kernels (or sandboxes) do not provide io_uring: what needs it is then skipped
+#define REQUIRE_URING(ring, ops, nb_ops)                                   \
+    do {                                                                   \
+        if (uring_init(ring, 8, ops, nb_ops) != ERR_NONE) {                \
+            ck_assert_int_eq((ring)->fd, -1);                              \
+            test_print("io_uring unavailable: skipped\n");                 \
+            end_test_print;                                                \
+            return;                                                        \
+        }                                                                  \
+    } while (0)
+
+// ======================================================================
+START_TEST(uring_null_params)
+{
+    start_test_print;
+
+    struct uring ring;
+    ck_assert_invalid_arg(uring_init(NULL, 8, NULL, 0));
+    ck_assert_invalid_arg(uring_init(&ring, 8, NULL, 1));
+    ck_assert_invalid_arg(uring_submit(NULL, 0));
+    uring_close(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(uring_unsupported_op)
+{
+    start_test_print;
+
+    struct uring ring;
+    const uint8_t ops[] = { IORING_OP_NOP, 255 };
+    ck_assert_err(uring_init(&ring, 8, ops, 2), ERR_IO);
+    ck_assert_int_eq(ring.fd, -1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(uring_read_file)
+{
+    start_test_print;
+
+    struct uring ring;
+    const uint8_t ops[] = { IORING_OP_READ };
+    REQUIRE_URING(&ring, ops, 1);
+
+    const int fd = open(DATA_DIR "papillon.jpg", O_RDONLY);
+    ck_assert_int_ge(fd, 0);
+
+    char expected[2][64];
+    char buffers[2][64];
+    ck_assert_int_eq(pread(fd, expected[0], 64, 0), 64);
+    ck_assert_int_eq(pread(fd, expected[1], 64, 1000), 64);
+
+    for (size_t i = 0; i < 2; ++i) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+        ck_assert_ptr_nonnull(sqe);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) buffers[i];
+        sqe->len = 64;
+        sqe->off = i * 1000;
+        sqe->user_data = i;
+    }
+    // Nothing happens until submitted
+    ck_assert_ptr_null(uring_peek_cqe(&ring));
+
+    size_t nb_completions = 0;
+    while (nb_completions < 2) {
+        ck_assert_err_none(uring_submit(&ring, 1));
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            ck_assert_uint_lt(cqe->user_data, 2);
+            ck_assert_int_eq(cqe->res, 64);
+            ck_assert_mem_eq(buffers[cqe->user_data], expected[cqe->user_data], 64);
+            uring_cqe_seen(&ring);
+            ++nb_completions;
+        }
+    }
+
+    close(fd);
+    uring_close(&ring);
+    ck_assert_int_eq(ring.fd, -1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(uring_full_queue)
+{
+    start_test_print;
+
+    struct uring ring;
+    REQUIRE_URING(&ring, NULL, 0);
+
+    // More requests than the submission queue holds: it is submitted when full
+    const size_t nb_requests = 3 * ring.sq_entries;
+    for (size_t i = 0; i < nb_requests; ++i) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+        ck_assert_ptr_nonnull(sqe);
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = i;
+    }
+
+    size_t nb_completions = 0;
+    while (nb_completions < nb_requests) {
+        ck_assert_err_none(uring_submit(&ring, 1));
+        while (uring_peek_cqe(&ring) != NULL) {
+            uring_cqe_seen(&ring);
+            ++nb_completions;
+        }
+    }
+    ck_assert_uint_eq(nb_completions, nb_requests);
+    ck_assert_uint_eq(ring.sq_queued, 0);
+
+    uring_close(&ring);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *uring_test_suite()
+{
+    Suite *s = suite_create("Tests for the io_uring support");
+
+    Add_Test(s, uring_null_params);
+    Add_Test(s, uring_unsupported_op);
+    Add_Test(s, uring_read_file);
+    Add_Test(s, uring_full_queue);
+
+    return s;
+}
+
+TEST_SUITE(uring_test_suite)
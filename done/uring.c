@@ -0,0 +1,162 @@
+/**
+ * @file uring.c
+ * @brief Minimal io_uring support, straight on the system calls.
+ */
+
+#include "uring.h"
+#include "error.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**********************************************************************
+ * Checks that the kernel supports all the required operations.
+ ********************************************************************** */
+static int probe_ops(const struct uring* ring, const uint8_t* required_ops, size_t nb_ops)
+{
+    const size_t nb_probed = 256;
+    struct io_uring_probe* probe = calloc(1, sizeof(struct io_uring_probe)
+                                          + nb_probed * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) return ERR_OUT_OF_MEMORY;
+
+    int err = ERR_NONE;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, nb_probed) < 0) {
+        err = ERR_IO;
+    }
+    for (size_t i = 0; err == ERR_NONE && i < nb_ops; ++i) {
+        if (required_ops[i] > probe->last_op
+            || !(probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            err = ERR_IO;
+        }
+    }
+
+    free(probe);
+    return err;
+}
+
+/**********************************************************************/
+int uring_init(struct uring* ring, unsigned entries,
+               const uint8_t* required_ops, size_t nb_ops)
+{
+    M_REQUIRE_NON_NULL(ring);
+    if (nb_ops > 0) M_REQUIRE_NON_NULL(required_ops);
+
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const long fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return ERR_IO;
+    ring->fd = (int) fd;
+
+    // One mapping for both rings (Linux 5.4), and no completion ever dropped (5.5)
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        uring_close(ring);
+        return ERR_IO;
+    }
+
+    const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring == MAP_FAILED) {
+        ring->ring = NULL;
+        uring_close(ring);
+        return ERR_IO;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_close(ring);
+        return ERR_IO;
+    }
+
+    char* const base = ring->ring;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned*) (void*) (base + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (void*) (base + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (void*) (base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (void*) (base + params.sq_off.array);
+    ring->cq_head = (unsigned*) (void*) (base + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (void*) (base + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (void*) (base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (void*) (base + params.cq_off.cqes);
+
+    const int err = probe_ops(ring, required_ops, nb_ops);
+    if (err != ERR_NONE) uring_close(ring);
+    return err;
+}
+
+/**********************************************************************/
+void uring_close(struct uring* ring)
+{
+    if (ring == NULL) return;
+
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring != NULL) munmap(ring->ring, ring->ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = -1;
+}
+
+/**********************************************************************/
+struct io_uring_sqe* uring_get_sqe(struct uring* ring)
+{
+    unsigned tail = *ring->sq_tail; // Only written here
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (uring_submit(ring, 0) != ERR_NONE) return NULL;
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) return NULL;
+    }
+
+    // The kernel only looks at the entries in io_uring_enter(), so the
+    // entry can be published right away and filled in by the caller
+    const unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* const sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->sq_queued;
+
+    return sqe;
+}
+
+/**********************************************************************/
+int uring_submit(struct uring* ring, unsigned wait_nr)
+{
+    M_REQUIRE_NON_NULL(ring);
+
+    const unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    const long ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_queued, wait_nr, flags, NULL, 0);
+    if (ret < 0) {
+        // Interrupted, or completions to reap first
+        if (errno == EINTR || errno == EBUSY || errno == EAGAIN) return ERR_NONE;
+        return ERR_IO;
+    }
+
+    ring->sq_queued -= (unsigned) ret;
+    return ERR_NONE;
+}
+
+/**********************************************************************/
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring)
+{
+    const unsigned head = *ring->cq_head; // Only written here
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**********************************************************************/
+void uring_cqe_seen(struct uring* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,81 @@
+/**
+ * @file uring.h
+ * @brief Minimal io_uring support, straight on the system calls.
+ *
+ * A ring is a submission queue (SQ), where requests are described, and
+ * a completion queue (CQ), where the kernel posts their results; both
+ * are shared with the kernel. Requests are queued with uring_get_sqe(),
+ * handed to the kernel (in batch) with uring_submit(), and their
+ * completions consumed with uring_peek_cqe() / uring_cqe_seen().
+ */
+
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t
+
+struct uring {
+    int fd;     // -1 if not set up
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_queued;     // Entries filled in but not handed to the kernel yet
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* ring;             // Mapping of both queues' rings
+    size_t ring_size;
+    size_t sqes_size;       // Size of the mapping of sqes
+};
+
+/**
+ * @brief Sets up a ring.
+ *
+ * Fails (with ERR_IO) if the kernel does not provide io_uring (too old,
+ * or forbidden, e.g. by a seccomp policy) or lacks one of the operations
+ * of required_ops (IORING_OP_*).
+ *
+ * @param ring The ring to set up
+ * @param entries Size of the submission queue (rounded up to a power of 2)
+ * @param required_ops The operations the ring will be used for
+ * @param nb_ops The number of operations in required_ops
+ * @return Some error code. 0 if no error.
+ */
+int uring_init(struct uring* ring, unsigned entries,
+               const uint8_t* required_ops, size_t nb_ops);
+
+/**
+ * @brief Tears a ring down (pending requests are cancelled).
+ */
+void uring_close(struct uring* ring);
+
+/**
+ * @brief Returns a free (zeroed) submission entry, handing the queued ones to
+ *        the kernel first if there is none; NULL if the queue stays full.
+ */
+struct io_uring_sqe* uring_get_sqe(struct uring* ring);
+
+/**
+ * @brief Hands the queued submission entries to the kernel, and waits until
+ *        at least wait_nr completions are available.
+ *
+ * @return Some error code (ERR_IO). 0 if no error, including if the wait
+ *         was interrupted by a signal.
+ */
+int uring_submit(struct uring* ring, unsigned wait_nr);
+
+/**
+ * @brief Returns the next completion, or NULL if there is none (yet).
+ */
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring);
+
+/**
+ * @brief Releases the completion returned by uring_peek_cqe().
+ */
+void uring_cqe_seen(struct uring* ring);